@@ -1,7 +1,20 @@
 #pragma once
 
 #include "ofxDepthCore.h"
+#include "ofxDepthCpu.h"
 #include "ofxDepthBuffer.h"
 #include "ofxDepthImage.h"
 #include "ofxDepthPoints.h"
+#include "ofxDepthPipeline.h"
+#include "ofxDepthIntegral.h"
+#include "ofxDepthPackedPoints.h"
+#include "ofxDepthCamera.h"
 
+#include "ofxDepthFusion.h"
+#include "ofxDepthTemporal.h"
+#include "ofxDepthBackground.h"
+#include "ofxDepthPyramid.h"
+#include "ofxDepthRecording.h"
+#include "ofxDepthCodec.h"
+#include "ofxDepthPointFile.h"
+#include "ofxDepthBlobs.h"
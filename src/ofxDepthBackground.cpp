@@ -0,0 +1,314 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthBackground.h"
+#include "ofxDepthCpu.h"
+
+#define STRINGIFY(A) #A
+
+string depthBackgroundProgram = STRINGIFY(
+
+// Empty modes rank below every other mode
+float modeRank(float4 g) {
+	return g.x > 0.f ? g.x * rsqrt(g.z) : -1.f;
+}
+
+// Modes are (weight, mean, variance, 0) sorted by weight / deviation, reset treats the model as empty
+__kernel void backgroundUpdate(__global unsigned short* input, __global float4* model, __global unsigned short* output, int size, int numComponents, int reset, float learningRate, float deviations, float minDeviation, float initialDeviation, float backgroundRatio) {
+	int i = get_global_id(0);
+	unsigned short c = input[i];
+	float d = (float)c;
+
+	float4 g[4];
+	for (int k=0; k<numComponents; k++)
+		g[k] = reset ? (float4)(0.f) : model[k * size + i];
+
+	// Invalid pixels neither learn nor count as foreground
+	if (c == 0) {
+		output[i] = 0;
+		if (reset) {
+			for (int k=0; k<numComponents; k++)
+				model[k * size + i] = g[k];
+		}
+		return;
+	}
+
+	int match = -1;
+	int numBackground = 0;
+	float total = 0.f;
+	bool front = true;
+	for (int k=0; k<numComponents; k++) {
+		if (g[k].x <= 0.f)
+			continue;
+		bool background = total < backgroundRatio;
+		total += g[k].x;
+		float threshold = fmax(deviations * sqrt(g[k].z), minDeviation);
+		if (match < 0 && fabs(d - g[k].y) <= threshold)
+			match = k;
+		if (background) {
+			numBackground = k + 1;
+			front = front && d < g[k].y - threshold;
+		}
+	}
+
+	// Foreground has to be in front of the background, which drops mixed pixels behind it
+	bool foreground = (match < 0 || match >= numBackground) && front;
+	output[i] = foreground ? c : 0;
+
+	if (learningRate <= 0.f) {
+		if (reset) {
+			for (int k=0; k<numComponents; k++)
+				model[k * size + i] = g[k];
+		}
+		return;
+	}
+
+	for (int k=0; k<numComponents; k++)
+		g[k].x *= 1.f - learningRate;
+
+	// A new mode takes the first empty slot, or the weakest mode when there is none
+	int moved = numComponents - 1;
+	for (int k=0; k<numComponents; k++) {
+		if (g[k].x <= 0.f) {
+			moved = k;
+			break;
+		}
+	}
+	if (match >= 0) {
+		g[match].x += learningRate;
+		float rate = fmin(learningRate / g[match].x, 1.f);
+		float diff = d - g[match].y;
+		g[match].y += rate * diff;
+		g[match].z = fmax(g[match].z + rate * (diff * diff - g[match].z), 1.f);
+		moved = match;
+	}
+	else
+		g[moved] = (float4)(learningRate, d, initialDeviation * initialDeviation, 0.f);
+
+	total = 0.f;
+	for (int k=0; k<numComponents; k++)
+		total += g[k].x;
+	for (int k=0; k<numComponents; k++)
+		g[k].x /= total;
+
+	// Only the changed mode is out of order, move it up or down
+	int j = moved;
+	while (j > 0 && modeRank(g[j]) > modeRank(g[j-1])) {
+		float4 t = g[j];
+		g[j] = g[j-1];
+		g[j-1] = t;
+		j--;
+	}
+	while (j < numComponents - 1 && modeRank(g[j]) < modeRank(g[j+1])) {
+		float4 t = g[j];
+		g[j] = g[j+1];
+		g[j+1] = t;
+		j++;
+	}
+
+	for (int k=0; k<numComponents; k++)
+		model[k * size + i] = g[k];
+}
+);
+
+//////////////////////////////////////////////////
+
+// Host version of backgroundUpdate, one pixel with its modes g
+static float modeRank(const ofVec4f & g) {
+	return g.x > 0.f ? g.x / sqrtf(g.z) : -1.f;
+}
+
+static unsigned short updatePixel(unsigned short c, ofVec4f * g, int numComponents, float learningRate, float deviations, float minDeviation, float initialDeviation, float backgroundRatio) {
+	if (c == 0)
+		return 0;
+	float d = c;
+
+	int match = -1;
+	int numBackground = 0;
+	float total = 0.f;
+	bool front = true;
+	for (int k=0; k<numComponents; k++) {
+		if (g[k].x <= 0.f)
+			continue;
+		bool background = total < backgroundRatio;
+		total += g[k].x;
+		float threshold = std::max(deviations * sqrtf(g[k].z), minDeviation);
+		if (match < 0 && fabsf(d - g[k].y) <= threshold)
+			match = k;
+		if (background) {
+			numBackground = k + 1;
+			front = front && d < g[k].y - threshold;
+		}
+	}
+	bool foreground = (match < 0 || match >= numBackground) && front;
+	unsigned short output = foreground ? c : 0;
+	if (learningRate <= 0.f)
+		return output;
+
+	for (int k=0; k<numComponents; k++)
+		g[k].x *= 1.f - learningRate;
+
+	int moved = numComponents - 1;
+	for (int k=0; k<numComponents; k++) {
+		if (g[k].x <= 0.f) {
+			moved = k;
+			break;
+		}
+	}
+	if (match >= 0) {
+		g[match].x += learningRate;
+		float rate = std::min(learningRate / g[match].x, 1.f);
+		float diff = d - g[match].y;
+		g[match].y += rate * diff;
+		g[match].z = std::max(g[match].z + rate * (diff * diff - g[match].z), 1.f);
+		moved = match;
+	}
+	else
+		g[moved] = ofVec4f(learningRate, d, initialDeviation * initialDeviation, 0.f);
+
+	total = 0.f;
+	for (int k=0; k<numComponents; k++)
+		total += g[k].x;
+	for (int k=0; k<numComponents; k++)
+		g[k].x /= total;
+
+	int j = moved;
+	while (j > 0 && modeRank(g[j]) > modeRank(g[j-1])) {
+		std::swap(g[j], g[j-1]);
+		j--;
+	}
+	while (j < numComponents - 1 && modeRank(g[j]) < modeRank(g[j+1])) {
+		std::swap(g[j], g[j+1]);
+		j++;
+	}
+	return output;
+}
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthBackground::program;
+const int ofxDepthBackground::maxComponents;
+
+void ofxDepthBackground::setup(int width, int height, int numComponents) {
+	if (numComponents > maxComponents) {
+		ofLogWarning("ofxDepthBackground") << "setup(): " << numComponents << " components, using " << maxComponents;
+		numComponents = maxComponents;
+	}
+	this->width = width;
+	this->height = height;
+	this->numComponents = std::max(numComponents, 1);
+	if (model.getNumElements() != width * height * this->numComponents)
+		model.allocate(width * height * this->numComponents);
+	clear();
+}
+
+void ofxDepthBackground::clear() {
+	numFrames = 0;
+}
+
+void ofxDepthBackground::setTrainingFrames(int trainingFrames) {
+	this->trainingFrames = std::max(trainingFrames, 1);
+}
+
+void ofxDepthBackground::setLearningRate(float learningRate) {
+	this->learningRate = ofClamp(learningRate, 0.f, 1.f);
+}
+
+void ofxDepthBackground::setDeviations(float deviations) {
+	this->deviations = deviations;
+}
+
+void ofxDepthBackground::setMinDeviation(float minDeviation) {
+	this->minDeviation = minDeviation;
+}
+
+void ofxDepthBackground::setInitialDeviation(float initialDeviation) {
+	this->initialDeviation = std::max(initialDeviation, 1.f);
+}
+
+void ofxDepthBackground::setBackgroundRatio(float backgroundRatio) {
+	this->backgroundRatio = ofClamp(backgroundRatio, 0.f, 1.f);
+}
+
+void ofxDepthBackground::update(ofxDepthImage & image) {
+	update(image, image);
+}
+
+void ofxDepthBackground::update(ofxDepthImage & image, ofxDepthImage & outputImage) {
+	// A running mean while training, so every training frame has the same weight
+	float rate = numFrames < trainingFrames ? std::max(1.f / (numFrames + 1), learningRate) : learningRate;
+	run(image, outputImage, rate);
+	numFrames++;
+}
+
+void ofxDepthBackground::apply(ofxDepthImage & image) {
+	apply(image, image);
+}
+
+void ofxDepthBackground::apply(ofxDepthImage & image, ofxDepthImage & outputImage) {
+	run(image, outputImage, 0.f);
+}
+
+void ofxDepthBackground::run(ofxDepthImage & image, ofxDepthImage & outputImage, float rate) {
+
+	if (image.getWidth() != width || image.getHeight() != height || numComponents == 0)
+		setup(image.getWidth(), image.getHeight(), numComponents == 0 ? 3 : numComponents);
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(width, height);
+
+	// Each pixel reads its input before writing its output, so running in place is safe
+	if (image.isHostOnly() || ofxDepth.getBackend("subtract") == OFX_DEPTH_BACKEND_CPU) {
+		const unsigned short * input = image.getHostData();
+		unsigned short * output = outputImage.getHostData();
+		ofVec4f * modes = model.getHostData();
+		int size = width * height;
+		int w = width;
+		int n = numComponents;
+		bool reset = numFrames == 0;
+		float deviations = this->deviations;
+		float minDeviation = this->minDeviation;
+		float initialDeviation = this->initialDeviation;
+		float backgroundRatio = this->backgroundRatio;
+		ofxDepthCpu::parallelRows(height, [=](int y0, int y1) {
+			ofVec4f g[maxComponents];
+			for (int i=y0*w; i<y1*w; i++) {
+				for (int k=0; k<n; k++)
+					g[k] = reset ? ofVec4f(0.f) : modes[k * size + i];
+				output[i] = updatePixel(input[i], g, n, rate, deviations, minDeviation, initialDeviation, backgroundRatio);
+				for (int k=0; k<n; k++)
+					modes[k * size + i] = g[k];
+			}
+		});
+		model.setHostModified();
+		outputImage.setHostModified();
+		return;
+	}
+
+	OpenCLKernelPtr kernel = getKernel("backgroundUpdate");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, model.getCLBuffer());
+	kernel->setArg(2, outputImage.getCLBuffer());
+	kernel->setArg(3, width * height);
+	kernel->setArg(4, numComponents);
+	kernel->setArg(5, numFrames == 0 ? 1 : 0);
+	kernel->setArg(6, rate);
+	kernel->setArg(7, deviations);
+	kernel->setArg(8, minDeviation);
+	kernel->setArg(9, initialDeviation);
+	kernel->setArg(10, backgroundRatio);
+	ofxDepth.run1D(kernel, width * height);
+}
+
+OpenCLKernelPtr ofxDepthBackground::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthBackground::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthBackgroundProgram);
+		ofxDepth.loadKernel("backgroundUpdate", program);
+		return program;
+	}
+}
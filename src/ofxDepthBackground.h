@@ -0,0 +1,83 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthBuffer.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+//////////////////////////////////////////////////
+// DEPTH BACKGROUND
+//
+// Background model learned from every frame it sees, in place of the
+// single frame ofxDepthImage::subtract compares against. Each pixel
+// keeps a small mixture of depth modes (weight, mean and variance), so
+// noisy and multipath surfaces get a wider threshold or a second mode
+// instead of showing up as foreground. One kernel per frame matches the
+// pixel to its modes, updates them and writes the foreground, and the
+// model stays the same size however long it learns. Host-only images,
+// or the CPU backend for "subtract", run the same update on the host.
+
+class ofxDepthBackground {
+public:
+	static const int maxComponents = 4;
+
+	void setup(int width, int height, int numComponents = 3);
+	// Forgets the model, the next frame starts training again
+	void clear();
+
+	int getNumComponents() const {
+		return numComponents;
+	}
+	// Frames learned since setup or clear
+	int getNumFrames() const {
+		return numFrames;
+	}
+	bool isTrained() const {
+		return numFrames >= trainingFrames;
+	}
+
+	// The first frames are averaged with equal weight, then the learning rate takes over
+	void setTrainingFrames(int trainingFrames);
+	// Weight of each new frame once trained, 0 freezes the model
+	void setLearningRate(float learningRate);
+	// A pixel matches a mode within this many standard deviations
+	void setDeviations(float deviations);
+	// Smallest match threshold in depth units, for surfaces the sensor sees without noise
+	void setMinDeviation(float minDeviation);
+	// Standard deviation of a new mode in depth units
+	void setInitialDeviation(float initialDeviation);
+	// Share of the strongest modes that counts as background
+	void setBackgroundRatio(float backgroundRatio);
+
+	// Learns from the image and zeroes the pixels that match the background
+	void update(ofxDepthImage & image);
+	void update(ofxDepthImage & image, ofxDepthImage & outputImage);
+	// Zeroes the background without learning
+	void apply(ofxDepthImage & image);
+	void apply(ofxDepthImage & image, ofxDepthImage & outputImage);
+
+	// Mode k of pixel i is at k * width * height + i as (weight, mean, variance, 0)
+	ofxDepthBufferT<float, ofVec4f> & getModel() {
+		return model;
+	}
+
+protected:
+	void run(ofxDepthImage & image, ofxDepthImage & outputImage, float learningRate);
+
+	int width = 0;
+	int height = 0;
+	int numComponents = 0;
+	int numFrames = 0;
+	int trainingFrames = 30;
+	float learningRate = 0.005f;
+	float deviations = 2.5f;
+	float minDeviation = 10.f;
+	float initialDeviation = 30.f;
+	float backgroundRatio = 0.7f;
+	ofxDepthBufferT<float, ofVec4f> model;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
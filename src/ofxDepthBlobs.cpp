@@ -0,0 +1,318 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthBlobs.h"
+#include "ofxDepthCamera.h"
+
+#define STRINGIFY(A) #A
+
+// Blob record: area, min x, min y, max x, max y, sum x, sum y, then sums of depth, x, y and z as float bits, then the label
+string depthBlobsProgram = STRINGIFY(
+
+bool isConnected(unsigned short a, unsigned short b, int threshold) {
+	return a > 0 && b > 0 && abs((int)a - (int)b) <= threshold;
+}
+
+// Labels only ever point to a smaller index with the same root
+int findRoot(__global volatile int* labels, int x) {
+	int l = labels[x];
+	while (l != x) {
+		x = l;
+		l = labels[x];
+	}
+	return x;
+}
+
+void unite(__global volatile int* labels, int a, int b) {
+	bool done = false;
+	while (!done) {
+		a = findRoot(labels, a);
+		b = findRoot(labels, b);
+		if (a < b) {
+			int old = atomic_min(&labels[b], a);
+			done = old == b;
+			b = old;
+		}
+		else if (b < a) {
+			int old = atomic_min(&labels[a], b);
+			done = old == a;
+			a = old;
+		}
+		else
+			done = true;
+	}
+}
+
+void atomicAddFloat(__global uint* p, float v) {
+	uint old = *p;
+	uint expected;
+	do {
+		expected = old;
+		old = atomic_cmpxchg(p, expected, as_uint(as_float(expected) + v));
+	} while (old != expected);
+}
+
+__kernel void blobInit(__global unsigned short* depth, __global int* labels, __global uint* ids) {
+	int i = get_global_id(0);
+	labels[i] = depth[i] > 0 ? i : -1;
+	ids[i] = 0;
+}
+
+__kernel void blobMerge(__global unsigned short* depth, __global int* labels, int threshold) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int2 dims = (int2)(get_global_size(0), get_global_size(1));
+	int i = coords.y * dims.x + coords.x;
+	unsigned short d = depth[i];
+	if (d == 0)
+		return;
+	if (coords.x + 1 < dims.x && isConnected(d, depth[i + 1], threshold))
+		unite(labels, i, i + 1);
+	if (coords.y + 1 < dims.y && isConnected(d, depth[i + dims.x], threshold))
+		unite(labels, i, i + dims.x);
+}
+
+__kernel void blobCompress(__global int* labels) {
+	int i = get_global_id(0);
+	if (labels[i] >= 0)
+		labels[i] = findRoot(labels, i);
+}
+
+// Counts the area of each blob at its root, one atomic per run of the row segment
+__kernel void blobArea(__global int* labels, __global uint* ids, int width, int segment) {
+	int y = get_global_id(1);
+	int x0 = get_global_id(0) * segment;
+	int x1 = min(x0 + segment, width);
+	int run = -1;
+	uint n = 0;
+	for (int x=x0; x<x1; x++) {
+		int l = labels[y * width + x];
+		if (l != run) {
+			if (run >= 0)
+				atomic_add(&ids[run], n);
+			run = l;
+			n = 0;
+		}
+		n++;
+	}
+	if (run >= 0)
+		atomic_add(&ids[run], n);
+}
+
+// Gives each root with enough area a slot in the blob table, ids then holds the slot instead of the area
+__kernel void blobRoots(__global int* labels, __global uint* ids, __global uint* blobs, __global uint* count, uint minArea, uint maxBlobs) {
+	int i = get_global_id(0);
+	if (labels[i] != i)
+		return;
+	uint area = ids[i];
+	uint id = area >= minArea ? atomic_inc(count) : maxBlobs;
+	if (id >= maxBlobs) {
+		ids[i] = 0xffffffff;
+		return;
+	}
+	ids[i] = id;
+	__global uint* b = blobs + id * 12;
+	b[0] = area;
+	b[1] = 0xffffffff;
+	b[2] = 0xffffffff;
+	for (int k=3; k<11; k++)
+		b[k] = 0;
+	b[11] = i;
+}
+
+void addRun(__global uint* blobs, uint id, int x0, int x1, int y, uint n, uint sumX, float4 sum) {
+	if (id == 0xffffffff || n == 0)
+		return;
+	__global uint* b = blobs + id * 12;
+	atomic_min(&b[1], (uint)x0);
+	atomic_min(&b[2], (uint)y);
+	atomic_max(&b[3], (uint)x1);
+	atomic_max(&b[4], (uint)y);
+	atomic_add(&b[5], sumX);
+	atomic_add(&b[6], n * y);
+	atomicAddFloat(&b[7], sum.w);
+	atomicAddFloat(&b[8], sum.x);
+	atomicAddFloat(&b[9], sum.y);
+	atomicAddFloat(&b[10], sum.z);
+}
+
+__kernel void blobStats(__global unsigned short* depth, __global float2* table, int useTable, __global int* labels, __global uint* ids, __global uint* blobs, int width, int segment) {
+	int y = get_global_id(1);
+	int x0 = get_global_id(0) * segment;
+	int x1 = min(x0 + segment, width);
+	int run = -1;
+	int first = 0;
+	uint n = 0;
+	uint sumX = 0;
+	float4 sum = (float4)(0.f);
+	for (int x=x0; x<x1; x++) {
+		int i = y * width + x;
+		int l = labels[i];
+		if (l != run) {
+			if (run >= 0)
+				addRun(blobs, ids[run], first, x - 1, y, n, sumX, sum);
+			run = l;
+			first = x;
+			n = 0;
+			sumX = 0;
+			sum = (float4)(0.f);
+		}
+		if (l < 0)
+			continue;
+		float d = (float)depth[i];
+		n++;
+		sumX += x;
+		sum.w += d;
+		if (useTable)
+			sum.xyz += (float3)(table[i].x * d, table[i].y * d, -d);
+	}
+	if (run >= 0)
+		addRun(blobs, ids[run], first, x1 - 1, y, n, sumX, sum);
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthBlobs::program;
+
+void ofxDepthBlobs::setMaxBlobs(int maxBlobs) {
+	this->maxBlobs = std::max(maxBlobs, 1);
+}
+
+void ofxDepthBlobs::update(ofxDepthImage & image, int threshold, int minArea) {
+	update(image, nullptr, threshold, minArea);
+}
+
+void ofxDepthBlobs::update(ofxDepthImage & image, ofxDepthTable & table, int threshold, int minArea) {
+	update(image, &table, threshold, minArea);
+}
+
+void ofxDepthBlobs::update(ofxDepthImage & image, ofxDepthCamera & camera, int threshold, int minArea) {
+	update(image, &camera.getTable(), threshold, minArea);
+}
+
+void ofxDepthBlobs::update(ofxDepthImage & image, ofxDepthTable * table, int threshold, int minArea) {
+
+	blobs.clear();
+	if (!image.isAllocated())
+		return;
+
+	// Labelling only runs in OpenCL
+	if (image.isHostOnly()) {
+		ofLogError("ofxDepthBlobs") << "update(): host-only image, blobs need OpenCL";
+		return;
+	}
+
+	if (table && table->getNumElements() != image.getNumElements()) {
+		ofLogError("ofxDepthBlobs") << "update(): table is " << table->getWidth() << "x" << table->getHeight() << ", image is " << image.getWidth() << "x" << image.getHeight();
+		return;
+	}
+
+	int n = image.getNumElements();
+	if (image.getWidth() != width || image.getHeight() != height) {
+		width = image.getWidth();
+		height = image.getHeight();
+		labels.initBuffer(n * sizeof(cl_int));
+		ids.initBuffer(n * sizeof(cl_uint));
+		blobCount.initBuffer(sizeof(cl_uint));
+	}
+	if (blobTableSize != maxBlobs) {
+		blobTable.initBuffer(maxBlobs * blobStride * sizeof(cl_uint));
+		blobTableSize = maxBlobs;
+	}
+	int numSegments = (width + segmentSize - 1) / segmentSize;
+
+	OpenCLKernelPtr kernel = getKernel("blobInit");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, labels);
+	kernel->setArg(2, ids);
+	ofxDepth.run1D(kernel, n);
+
+	kernel = getKernel("blobMerge");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, labels);
+	kernel->setArg(2, threshold);
+	ofxDepth.run2D(kernel, width, height);
+
+	kernel = getKernel("blobCompress");
+	kernel->setArg(0, labels);
+	ofxDepth.run1D(kernel, n);
+
+	kernel = getKernel("blobArea");
+	kernel->setArg(0, labels);
+	kernel->setArg(1, ids);
+	kernel->setArg(2, width);
+	kernel->setArg(3, (int)segmentSize);
+	ofxDepth.run2D(kernel, numSegments, height);
+
+	static const cl_uint zero = 0;
+	ofxDepth.write(blobCount, &zero, 0, sizeof(cl_uint));
+
+	kernel = getKernel("blobRoots");
+	kernel->setArg(0, labels);
+	kernel->setArg(1, ids);
+	kernel->setArg(2, blobTable);
+	kernel->setArg(3, blobCount);
+	kernel->setArg(4, (cl_uint)std::max(minArea, 1));
+	kernel->setArg(5, (cl_uint)maxBlobs);
+	ofxDepth.run1D(kernel, n);
+
+	kernel = getKernel("blobStats");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, table ? table->getCLBuffer() : image.getCLBuffer());
+	kernel->setArg(2, table ? 1 : 0);
+	kernel->setArg(3, labels);
+	kernel->setArg(4, ids);
+	kernel->setArg(5, blobTable);
+	kernel->setArg(6, width);
+	kernel->setArg(7, (int)segmentSize);
+	ofxDepth.run2D(kernel, numSegments, height);
+
+	cl_uint count = 0;
+	ofxDepth.read(blobCount, &count, 0, sizeof(cl_uint), true);
+	if ((int)count > maxBlobs) {
+		ofLogWarning("ofxDepthBlobs") << "update(): " << count << " blobs, keeping " << maxBlobs;
+		count = maxBlobs;
+	}
+	if (count == 0)
+		return;
+
+	blobData.resize(count * blobStride);
+	ofxDepth.read(blobTable, blobData.data(), 0, blobData.size() * sizeof(cl_uint), true);
+
+	blobs.resize(count);
+	for (int i=0; i<(int)count; i++) {
+		const cl_uint * b = &blobData[i * blobStride];
+		const float * f = (const float*)b;
+		ofxDepthBlob & blob = blobs[i];
+		float area = b[0];
+		blob.label = b[11];
+		blob.area = b[0];
+		blob.bounds = ofRectangle(b[1], b[2], b[3] - b[1] + 1, b[4] - b[2] + 1);
+		blob.centroid = ofVec2f(b[5] / area, b[6] / area);
+		blob.depth = f[7] / area;
+		blob.position = table ? ofVec3f(f[8] / area, f[9] / area, f[10] / area) : ofVec3f();
+	}
+
+	// Slots are handed out in no particular order, largest first keeps the order stable between frames
+	std::sort(blobs.begin(), blobs.end(), [](const ofxDepthBlob & a, const ofxDepthBlob & b) {
+		return a.area > b.area || (a.area == b.area && a.label < b.label);
+	});
+}
+
+OpenCLKernelPtr ofxDepthBlobs::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthBlobs::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthBlobsProgram);
+		ofxDepth.loadKernel("blobInit", program);
+		ofxDepth.loadKernel("blobMerge", program);
+		ofxDepth.loadKernel("blobCompress", program);
+		ofxDepth.loadKernel("blobArea", program);
+		ofxDepth.loadKernel("blobRoots", program);
+		ofxDepth.loadKernel("blobStats", program);
+		return program;
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+class ofxDepthCamera;
+
+struct ofxDepthBlob {
+	// Index of the pixel the blob's labels point to
+	int label;
+	int area;
+	ofRectangle bounds;
+	ofVec2f centroid;
+	// Centroid of the blob's points, only with a depth table
+	ofVec3f position;
+	float depth;
+};
+
+//////////////////////////////////////////////////
+// DEPTH BLOBS
+//
+// Connected components of the non-zero pixels, neighbours are connected
+// when their depth differs by less than the threshold. Labels are merged
+// with a lock-free union-find in one pass, then each row segment adds its
+// runs to the blob statistics with a few atomics. Blobs smaller than the
+// minimum area never get a slot, and only the blob table is read back.
+// Needs OpenCL, host-only images are rejected.
+
+class ofxDepthBlobs {
+public:
+	void setMaxBlobs(int maxBlobs);
+	int getMaxBlobs() const {
+		return maxBlobs;
+	}
+
+	// Labels the image and reads back the blobs of at least minArea pixels
+	void update(ofxDepthImage & image, int threshold, int minArea = 1);
+	// Also finds the 3D centroid of each blob from the table
+	void update(ofxDepthImage & image, ofxDepthTable & table, int threshold, int minArea = 1);
+	void update(ofxDepthImage & image, ofxDepthCamera & camera, int threshold, int minArea = 1);
+
+	int size() const {
+		return blobs.size();
+	}
+	const ofxDepthBlob & operator[](int i) const {
+		return blobs[i];
+	}
+	const vector<ofxDepthBlob> & getBlobs() const {
+		return blobs;
+	}
+
+	// Root pixel of each pixel as int, -1 where the depth is zero. Stays on the device
+	OpenCLBuffer & getLabels() {
+		return labels;
+	}
+
+protected:
+	void update(ofxDepthImage & image, ofxDepthTable * table, int threshold, int minArea);
+
+	// Pixels each work item walks along a row when counting
+	static const int segmentSize = 32;
+	// Unsigned ints per blob on the device
+	static const int blobStride = 12;
+
+	int width = 0;
+	int height = 0;
+	int maxBlobs = 256;
+	OpenCLBuffer labels;
+	OpenCLBuffer ids;
+	OpenCLBuffer blobTable;
+	OpenCLBuffer blobCount;
+	int blobTableSize = 0;
+	vector<cl_uint> blobData;
+	vector<ofxDepthBlob> blobs;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
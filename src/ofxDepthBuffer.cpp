@@ -1,38 +1,180 @@
 #include "ofxDepthBuffer.h"
+#include "ofxDepthCore.h"
 
 
 //////////////////////////////////////////////////
 
+ofxDepthBuffer::~ofxDepthBuffer() {
+	ofxDepth.removeBuffer(this);
+}
+
 OpenCLBuffer & ofxDepthBuffer::getCLBuffer() {
+	if (hostModified) {
+		ofxDepth.write(clBuf, hostBuf.data(), 0, hostBuf.size());
+		hostModified = false;
+	}
+	hostValid = false;
 	return clBuf;
 }
 
 ofBufferObject & ofxDepthBuffer::getGLBuffer() {
+	if (hostModified) {
+		ofxDepth.write(clBuf, hostBuf.data(), 0, hostBuf.size(), true);
+		hostModified = false;
+	}
 	return glBuf;
 }
 
+void * ofxDepthBuffer::getHostData() {
+	if (hostEvent.isValid()) {
+		hostEvent.wait();
+		hostEvent = ofxDepthEvent();
+	}
+	if (!hostOnly && !hostValid && isAllocated()) {
+		hostBuf.resize(glBuf.size());
+		ofxDepth.read(clBuf, hostBuf.data(), 0, hostBuf.size(), true);
+		hostValid = true;
+	}
+	return hostBuf.data();
+}
+
+ofxDepthEvent ofxDepthBuffer::download() {
+	if (hostOnly || hostValid || !isAllocated())
+		return hostEvent;
+	hostEvent.wait();
+	hostBuf.resize(glBuf.size());
+	hostEvent = ofxDepth.read(clBuf, hostBuf.data(), 0, hostBuf.size());
+	hostValid = true;
+	return hostEvent;
+}
+
+void * ofxDepthBuffer::mapWrite() {
+	if (hostOnly)
+		return hostBuf.data();
+	if (mapped)
+		return mapped;
+	// GL shared buffers have to be acquired, inside a frame they already are
+	mappedLock = !ofxDepth.isInFrame();
+	if (mappedLock)
+		ofxDepth.acquire(clBuf);
+	mapped = ofxDepth.mapBuffer(clBuf, CL_MAP_WRITE_INVALIDATE_REGION, 0, glBuf.size());
+	hostValid = false;
+	hostModified = false;
+	return mapped;
+}
+
+void ofxDepthBuffer::unmap() {
+	if (!mapped)
+		return;
+	ofxDepth.unmapBuffer(clBuf, mapped);
+	if (mappedLock)
+		ofxDepth.release(clBuf);
+	mapped = nullptr;
+}
+
+void ofxDepthBuffer::setHostModified() {
+	if (!hostOnly)
+		hostModified = true;
+}
+
+bool ofxDepthBuffer::isHostOnly() const {
+	return hostOnly;
+}
+
 void ofxDepthBuffer::allocate(int numElements) {
+	// The old mem leaves the frame before it is replaced
+	ofxDepth.removeBuffer(this);
+	hostOnly = ofxDepth.getBackend() == OFX_DEPTH_BACKEND_CPU && !ofxDepth.isSetup();
+	hostValid = hostOnly;
+	hostModified = false;
+	if (hostOnly) {
+		hostBuf.assign(numElements * getBytesPerElement(), 0);
+		return;
+	}
+	hostBuf.clear();
 	glBuf.allocate(numElements * getBytesPerElement(), GL_STREAM_DRAW);
 	clBuf.initFromGLObject(glBuf.getId());
+	ofxDepth.addBuffer(this);
 }
 
 bool ofxDepthBuffer::isAllocated() const {
-	return glBuf.isAllocated();
+	return hostOnly ? !hostBuf.empty() : glBuf.isAllocated();
+}
+
+int ofxDepthBuffer::getSize() const {
+	return hostOnly ? hostBuf.size() : glBuf.size();
+}
+
+void ofxDepthBuffer::swap(ofxDepthBuffer & other) {
+	std::swap(glBuf, other.glBuf);
+	std::swap(clBuf.getCLMem(), other.clBuf.getCLMem());
+	hostBuf.swap(other.hostBuf);
+	std::swap(hostOnly, other.hostOnly);
+	std::swap(hostValid, other.hostValid);
+	std::swap(hostModified, other.hostModified);
+	std::swap(hostEvent, other.hostEvent);
 }
 
 void ofxDepthBuffer::write(void * data, int numElements) {
 	if (!isAllocated())
 		allocate(numElements);
-	clBuf.write(data, 0, numElements * getBytesPerElement());
+	if (numElements > getNumElements()) {
+		ofLogError("ofxDepthBuffer") << "write(): " << numElements << " elements into a buffer of " << getNumElements();
+		return;
+	}
+	if (hostOnly) {
+		memcpy(hostBuf.data(), data, numElements * getBytesPerElement());
+		return;
+	}
+	ofxDepth.write(clBuf, data, 0, numElements * getBytesPerElement());
+	hostValid = false;
+	hostModified = false;
+}
+
+ofxDepthEvent ofxDepthBuffer::writeAsync(const void * data, int numElements) {
+	if (!isAllocated())
+		allocate(numElements);
+	if (numElements > getNumElements()) {
+		ofLogError("ofxDepthBuffer") << "writeAsync(): " << numElements << " elements into a buffer of " << getNumElements();
+		return ofxDepthEvent();
+	}
+	// The pending upload reads the host copy, so it stays untouched until the event completes
+	hostEvent.wait();
+	if (!hostOnly)
+		hostBuf.resize(glBuf.size());
+	memcpy(hostBuf.data(), data, numElements * getBytesPerElement());
+	if (hostOnly)
+		return ofxDepthEvent();
+	hostEvent = ofxDepth.write(clBuf, hostBuf.data(), 0, numElements * getBytesPerElement());
+	hostValid = (int)hostBuf.size() == numElements * getBytesPerElement();
+	hostModified = false;
+	return hostEvent;
 }
 
 void ofxDepthBuffer::read(void * data, int numElements) {
-	clBuf.read(data, 0, numElements * getBytesPerElement());
+	if (hostOnly || hostModified || hostValid)
+		memcpy(data, getHostData(), numElements * getBytesPerElement());
+	else
+		ofxDepth.read(clBuf, data, 0, numElements * getBytesPerElement(), true);
 }
 
 void ofxDepthBuffer::copy(ofxDepthBuffer & dest) {
-	clBuf.lockGLObject();
-	dest.clBuf.copyFrom(clBuf, 0, 0, glBuf.size());
-	clBuf.unlockGLObject();
+	if (hostOnly && dest.hostOnly) {
+		memcpy(dest.hostBuf.data(), hostBuf.data(), hostBuf.size());
+		return;
+	}
+	OpenCLBuffer & src = getCLBuffer();
+	OpenCLBuffer & dst = dest.getCLBuffer();
+	// Inside a frame every buffer is already acquired
+	bool lock = !ofxDepth.isInFrame();
+	bool lockDest = lock && !dest.hostOnly && &dest != this;
+	if (lock)
+		ofxDepth.acquire(src);
+	if (lockDest)
+		ofxDepth.acquire(dst);
+	ofxDepth.copy(src, dst, glBuf.size());
+	if (lockDest)
+		ofxDepth.release(dst);
+	if (lock)
+		ofxDepth.release(src);
 }
-
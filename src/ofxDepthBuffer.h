@@ -1,6 +1,7 @@
 #pragma once
 
 #include "MSAOpenCL.h"
+#include "ofxDepthCore.h"
 
 using namespace msa;
 
@@ -8,8 +9,13 @@ using namespace msa;
 // DEPTH BUFFER
 //
 // Base class for OpenCL-OpenGL interop buffer
+//
+// Keeps an optional host copy for the CPU backend. Without an OpenCL
+// device (CPU backend, no setup) the buffer lives on the host only.
 class ofxDepthBuffer {
 public:
+	virtual ~ofxDepthBuffer();
+
 	virtual int getBytesPerType() const = 0;
 	virtual int getBytesPerElement() const = 0;
 	virtual int getNumElements() const = 0;
@@ -17,17 +23,43 @@ public:
 	OpenCLBuffer & getCLBuffer();
 	ofBufferObject & getGLBuffer();
 
+	void * getHostData();
+	void setHostModified();
+	bool isHostOnly() const;
+
 	void allocate(int numElements);
 	bool isAllocated() const;
+	int getSize() const;
+
+	// Exchanges storage with another buffer of the same size, so a result can replace the contents without a copy
+	void swap(ofxDepthBuffer & other);
+
+	// Starts copying the device data to the host copy, getHostData() then only waits for it
+	ofxDepthEvent download();
+
+	// Maps the device memory for the host to overwrite, unmap() hands it back. Host only buffers return the host copy
+	void * mapWrite();
+	void unmap();
 
 protected:
+	friend class ofxDepthCore;
+
 	void write(void * data, int numElements);
+	ofxDepthEvent writeAsync(const void * data, int numElements);
 	void read(void * data, int numElements);
 	void copy(ofxDepthBuffer & dest);
 
 	//private:
 	ofBufferObject glBuf;
 	OpenCLBuffer clBuf;
+
+	vector<unsigned char> hostBuf;
+	bool hostOnly = false;
+	bool hostValid = false;
+	bool hostModified = false;
+	ofxDepthEvent hostEvent;
+	void * mapped = nullptr;
+	bool mappedLock = false;
 };
 
 template<typename T, class E = T>
@@ -40,17 +72,24 @@ public:
 		return sizeof(E);
 	}
 	int getNumElements() const {
-		return glBuf.size() / sizeof(E);
+		return getSize() / sizeof(E);
 	}
 	int getNumTypePerElement() const {
 		return sizeof(E) / sizeof(T);
 	}
+	E * getHostData() {
+		return (E*)ofxDepthBuffer::getHostData();
+	}
 	void allocate(int numElements) {
 		ofxDepthBuffer::allocate(numElements);
 	}
 	void write(T * data, int numElements) {
 		ofxDepthBuffer::write((void*)data, numElements);
 	}
+	// Returns once data is staged, the upload completes with the event
+	ofxDepthEvent writeAsync(const T * data, int numElements) {
+		return ofxDepthBuffer::writeAsync((const void*)data, numElements);
+	}
 	void read(T * data, int numElements) {
 		ofxDepthBuffer::read((void*)data, numElements);
 	}
@@ -58,4 +97,4 @@ public:
 		ofxDepthBuffer::copy(dest);
 	}
 protected:
-};
\ No newline at end of file
+};
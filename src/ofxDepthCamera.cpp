@@ -0,0 +1,110 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthCamera.h"
+
+#define STRINGIFY(A) #A
+
+string depthCameraProgram = STRINGIFY(
+
+// Inverts the distortion by fixed point iteration, as the forward model has no closed form inverse
+__kernel void cameraRays(__global float2* table, float4 intrinsics, float4 radial, float2 tangential) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int i = coords.y * get_global_size(0) + coords.x;
+	float2 d = ((float2)(coords.x, coords.y) - intrinsics.zw) / intrinsics.xy;
+	float2 p = d;
+	for (int n=0; n<10; n++) {
+		float r2 = dot(p, p);
+		float k = 1.f + r2 * (radial.x + r2 * (radial.y + r2 * radial.z));
+		float2 delta;
+		delta.x = 2.f * tangential.x * p.x * p.y + tangential.y * (r2 + 2.f * p.x * p.x);
+		delta.y = tangential.x * (r2 + 2.f * p.y * p.y) + 2.f * tangential.y * p.x * p.y;
+		p = (d - delta) / k;
+	}
+	table[i] = p;
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthCamera::program;
+
+void ofxDepthCamera::setup(int width, int height, float fx, float fy, float cx, float cy) {
+	this->width = width;
+	this->height = height;
+	this->fx = fx;
+	this->fy = fy;
+	this->cx = cx;
+	this->cy = cy;
+	tableDirty = true;
+}
+
+void ofxDepthCamera::setupFromFov(int width, int height, float fovH, float fovV) {
+	float fx = 0.5f * width / tanf(0.5f * fovH * DEG_TO_RAD);
+	float fy = 0.5f * height / tanf(0.5f * fovV * DEG_TO_RAD);
+	setup(width, height, fx, fy, 0.5f * width, 0.5f * height);
+	setDistortion(0, 0, 0, 0, 0);
+}
+
+void ofxDepthCamera::setDistortion(float k1, float k2, float p1, float p2, float k3) {
+	this->k1 = k1;
+	this->k2 = k2;
+	this->k3 = k3;
+	this->p1 = p1;
+	this->p2 = p2;
+	tableDirty = true;
+}
+
+ofVec2f ofxDepthCamera::getRay(float x, float y) const {
+	ofVec2f d((x - cx) / fx, (y - cy) / fy);
+	ofVec2f p = d;
+	for (int n=0; n<10; n++) {
+		float r2 = p.x * p.x + p.y * p.y;
+		float k = 1.f + r2 * (k1 + r2 * (k2 + r2 * k3));
+		ofVec2f delta;
+		delta.x = 2.f * p1 * p.x * p.y + p2 * (r2 + 2.f * p.x * p.x);
+		delta.y = p1 * (r2 + 2.f * p.y * p.y) + 2.f * p2 * p.x * p.y;
+		p = (d - delta) / k;
+	}
+	return p;
+}
+
+ofxDepthTable & ofxDepthCamera::getTable() {
+	if (!tableDirty && table.isAllocated())
+		return table;
+
+	if (!table.isAllocated() || table.getWidth() != width || table.getHeight() != height)
+		table.allocate(width, height);
+
+	if (table.isHostOnly()) {
+		ofVec2f * rays = table.getHostData();
+		for (int y=0; y<height; y++) {
+			for (int x=0; x<width; x++)
+				rays[y * width + x] = getRay(x, y);
+		}
+		table.setHostModified();
+	}
+	else {
+		OpenCLKernelPtr kernel = getKernel("cameraRays");
+		kernel->setArg(0, table.getCLBuffer());
+		kernel->setArg(1, ofVec4f(fx, fy, cx, cy));
+		kernel->setArg(2, ofVec4f(k1, k2, k3, 0));
+		kernel->setArg(3, ofVec2f(p1, p2));
+		ofxDepth.run2D(kernel, width, height);
+	}
+	tableDirty = false;
+	return table;
+}
+
+OpenCLKernelPtr ofxDepthCamera::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthCamera::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthCameraProgram);
+		ofxDepth.loadKernel("cameraRays", program);
+		return program;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+//////////////////////////////////////////////////
+// DEPTH CAMERA
+//
+// Pinhole intrinsics with Brown-Conrady distortion (k1, k2, k3 radial,
+// p1, p2 tangential). The undistorted ray of every pixel is built once
+// on the device as an ofxDepthTable, so converting depth to points is a
+// table lookup instead of trigonometry per pixel.
+
+class ofxDepthCamera {
+public:
+	void setup(int width, int height, float fx, float fy, float cx, float cy);
+	// Distortion free camera with the given horizontal and vertical field of view in degrees
+	void setupFromFov(int width, int height, float fovH, float fovV);
+	void setDistortion(float k1, float k2, float p1, float p2, float k3 = 0.f);
+
+	int getWidth() const {
+		return width;
+	}
+	int getHeight() const {
+		return height;
+	}
+	ofVec2f getFocalLength() const {
+		return ofVec2f(fx, fy);
+	}
+	ofVec2f getPrincipalPoint() const {
+		return ofVec2f(cx, cy);
+	}
+
+	// Size of a pixel at depth 1, the factor the discontinuity thresholds scale depth by
+	float getFovFactor() const {
+		return 1.f / fy;
+	}
+
+	// Undistorted ray (x/z, y/z) through a pixel
+	ofVec2f getRay(float x, float y) const;
+	// Rays of all pixels, built on first use after a change
+	ofxDepthTable & getTable();
+
+protected:
+	int width = 0;
+	int height = 0;
+	float fx = 1.f;
+	float fy = 1.f;
+	float cx = 0.f;
+	float cy = 0.f;
+	float k1 = 0.f;
+	float k2 = 0.f;
+	float k3 = 0.f;
+	float p1 = 0.f;
+	float p2 = 0.f;
+
+	ofxDepthTable table;
+	bool tableDirty = true;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
@@ -0,0 +1,402 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthCodec.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OFX_DEPTH_CODEC_SSE2
+#endif
+
+struct ofxDepthCodecHeader {
+	char magic[4];
+	uint32_t width;
+	uint32_t height;
+	uint16_t step;
+	uint16_t reserved;
+};
+
+static const char codecMagic[4] = {'R', 'V', 'L', '2'};
+
+// Frames are coded in blocks of 16 pixels. The low 2 bits of a block's tag give the width of its
+// zigzag deltas, or mark a run of (tag >> 2) + 1 empty blocks. A 16 bit mask of the valid pixels
+// follows when some are empty, and empty pixels repeat the value before them so their delta is 0
+enum {
+	BLOCK_EMPTY = 0,
+	BLOCK_NIBBLE = 1,
+	BLOCK_BYTE = 2,
+	BLOCK_SHORT = 3,
+	BLOCK_MASK = 4
+};
+
+static const int blockSize = 16;
+static const int maxBlockBytes = 1 + 2 + 32;
+static const int maxEmptyRun = 64;
+
+static inline int getBlockBytes(int tag) {
+	static const int dataBytes[4] = {0, 8, 16, 32};
+	return (tag & BLOCK_MASK ? 2 : 0) + dataBytes[tag & 3];
+}
+
+static inline void flushEmpty(int & empty, unsigned char *& out) {
+	while (empty > 0) {
+		int n = std::min(empty, maxEmptyRun);
+		*out++ = BLOCK_EMPTY | ((n - 1) << 2);
+		empty -= n;
+	}
+}
+
+static inline void putTag(int width, int valid, unsigned char *& out) {
+	*out++ = width | (valid != 0xffff ? BLOCK_MASK : 0);
+	if (valid != 0xffff) {
+		*out++ = valid & 0xff;
+		*out++ = valid >> 8;
+	}
+}
+
+#ifdef OFX_DEPTH_CODEC_SSE2
+
+// Quantised value of the last valid pixel in every lane
+struct BlockCoder {
+	BlockCoder(int step) : step(step) {
+		previous = _mm_setzero_si128();
+		steps = _mm_set1_epi16((short)step);
+		inverse = _mm_set1_ps(1.f / step);
+		bias = _mm_set1_ps(step / 2 + 0.5f);
+	}
+	int step;
+	__m128i previous;
+	__m128i steps;
+	__m128 inverse;
+	__m128 bias;
+};
+
+static inline __m128i broadcastLast(__m128i x) {
+	return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// Empty lanes take the value of the lane before, the first lanes take previous
+static inline __m128i fillEmpty(__m128i x, __m128i valid, __m128i previous) {
+	__m128i m = valid;
+	x = _mm_or_si128(x, _mm_andnot_si128(m, _mm_slli_si128(x, 2)));
+	m = _mm_or_si128(m, _mm_slli_si128(m, 2));
+	x = _mm_or_si128(x, _mm_andnot_si128(m, _mm_slli_si128(x, 4)));
+	m = _mm_or_si128(m, _mm_slli_si128(m, 4));
+	x = _mm_or_si128(x, _mm_andnot_si128(m, _mm_slli_si128(x, 8)));
+	m = _mm_or_si128(m, _mm_slli_si128(m, 8));
+	return _mm_or_si128(x, _mm_andnot_si128(m, previous));
+}
+
+// (v + step / 2) / step, at least 1. Adding 0.5 keeps the float quotient clear of the integer below it
+static inline __m128i quantise(const BlockCoder & coder, __m128i v, __m128i valid) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), coder.bias), coder.inverse));
+	__m128i hi = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), coder.bias), coder.inverse));
+	__m128i q = _mm_max_epi16(_mm_packs_epi32(lo, hi), _mm_set1_epi16(1));
+	return _mm_and_si128(q, valid);
+}
+
+static inline __m128i zigzag(__m128i d) {
+	return _mm_xor_si128(_mm_slli_epi16(d, 1), _mm_srai_epi16(d, 15));
+}
+
+static inline __m128i unzigzag(__m128i z) {
+	return _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, _mm_set1_epi16(1))));
+}
+
+static inline __m128i prefixSum(__m128i x, __m128i previous) {
+	x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+	x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+	x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+	return _mm_add_epi16(x, previous);
+}
+
+// value * step, saturated where the top step passes 65535
+static inline __m128i scale(const BlockCoder & coder, __m128i x) {
+	__m128i lo = _mm_mullo_epi16(x, coder.steps);
+	__m128i fits = _mm_cmpeq_epi16(_mm_mulhi_epu16(x, coder.steps), _mm_setzero_si128());
+	return _mm_or_si128(lo, _mm_andnot_si128(fits, _mm_set1_epi16(-1)));
+}
+
+static inline __m128i laneMask(int bits) {
+	const __m128i lanes = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+	return _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16((short)(bits & 0xff)), lanes), lanes);
+}
+
+static inline void encodeBlock(BlockCoder & coder, const unsigned short * px, int & empty, unsigned char *& out) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(-1);
+	__m128i a = _mm_loadu_si128((const __m128i*)px);
+	__m128i b = _mm_loadu_si128((const __m128i*)(px + 8));
+	__m128i validA = _mm_xor_si128(_mm_cmpeq_epi16(a, zero), ones);
+	__m128i validB = _mm_xor_si128(_mm_cmpeq_epi16(b, zero), ones);
+	int valid = _mm_movemask_epi8(_mm_packs_epi16(validA, validB));
+	if (valid == 0) {
+		empty++;
+		return;
+	}
+
+	if (coder.step > 1) {
+		a = quantise(coder, a, validA);
+		b = quantise(coder, b, validB);
+	}
+	a = fillEmpty(a, validA, coder.previous);
+	b = fillEmpty(b, validB, broadcastLast(a));
+	__m128i za = zigzag(_mm_sub_epi16(a, _mm_or_si128(_mm_slli_si128(a, 2), _mm_srli_si128(coder.previous, 14))));
+	__m128i zb = zigzag(_mm_sub_epi16(b, _mm_or_si128(_mm_slli_si128(b, 2), _mm_srli_si128(a, 14))));
+	coder.previous = broadcastLast(b);
+
+	// The OR of all deltas has the bits of the widest one
+	__m128i o = _mm_or_si128(za, zb);
+	o = _mm_or_si128(o, _mm_srli_si128(o, 8));
+	o = _mm_or_si128(o, _mm_srli_si128(o, 4));
+	o = _mm_or_si128(o, _mm_srli_si128(o, 2));
+	int bits = _mm_cvtsi128_si32(o) & 0xffff;
+	int width = bits < 16 ? BLOCK_NIBBLE : bits < 256 ? BLOCK_BYTE : BLOCK_SHORT;
+
+	flushEmpty(empty, out);
+	putTag(width, valid, out);
+	if (width == BLOCK_NIBBLE) {
+		// Pixel 2k in the low nibble of byte k, 2k + 1 in the high nibble
+		__m128i p = _mm_packus_epi16(za, zb);
+		__m128i n = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi16(0x000f)), _mm_and_si128(_mm_srli_epi16(p, 4), _mm_set1_epi16(0x00f0)));
+		_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(n, n));
+		out += 8;
+	}
+	else if (width == BLOCK_BYTE) {
+		_mm_storeu_si128((__m128i*)out, _mm_packus_epi16(za, zb));
+		out += 16;
+	}
+	else {
+		_mm_storeu_si128((__m128i*)out, za);
+		_mm_storeu_si128((__m128i*)(out + 16), zb);
+		out += 32;
+	}
+}
+
+static inline void decodeBlock(BlockCoder & coder, int tag, const unsigned char * in, unsigned short * px) {
+	const __m128i zero = _mm_setzero_si128();
+	int valid = 0xffff;
+	if (tag & BLOCK_MASK) {
+		valid = in[0] | (in[1] << 8);
+		in += 2;
+	}
+
+	__m128i za, zb;
+	if ((tag & 3) == BLOCK_NIBBLE) {
+		const __m128i low = _mm_set1_epi8(0x0f);
+		__m128i n = _mm_loadl_epi64((const __m128i*)in);
+		__m128i bytes = _mm_unpacklo_epi8(_mm_and_si128(n, low), _mm_and_si128(_mm_srli_epi16(n, 4), low));
+		za = _mm_unpacklo_epi8(bytes, zero);
+		zb = _mm_unpackhi_epi8(bytes, zero);
+	}
+	else if ((tag & 3) == BLOCK_BYTE) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)in);
+		za = _mm_unpacklo_epi8(bytes, zero);
+		zb = _mm_unpackhi_epi8(bytes, zero);
+	}
+	else {
+		za = _mm_loadu_si128((const __m128i*)in);
+		zb = _mm_loadu_si128((const __m128i*)(in + 16));
+	}
+
+	__m128i a = prefixSum(unzigzag(za), coder.previous);
+	__m128i b = prefixSum(unzigzag(zb), broadcastLast(a));
+	coder.previous = broadcastLast(b);
+	if (coder.step > 1) {
+		a = scale(coder, a);
+		b = scale(coder, b);
+	}
+	if (valid != 0xffff) {
+		a = _mm_and_si128(a, laneMask(valid));
+		b = _mm_and_si128(b, laneMask(valid >> 8));
+	}
+	_mm_storeu_si128((__m128i*)px, a);
+	_mm_storeu_si128((__m128i*)(px + 8), b);
+}
+
+#else
+
+// Quantised value of the last valid pixel
+struct BlockCoder {
+	BlockCoder(int step) : step(step), inverse(1.f / step), bias(step / 2 + 0.5f) {}
+	int step;
+	uint16_t previous = 0;
+	float inverse;
+	float bias;
+};
+
+static inline void encodeBlock(BlockCoder & coder, const unsigned short * px, int & empty, unsigned char *& out) {
+	int valid = 0;
+	for (int i=0; i<blockSize; i++)
+		valid |= (px[i] != 0) << i;
+	if (valid == 0) {
+		empty++;
+		return;
+	}
+
+	uint16_t z[blockSize];
+	int bits = 0;
+	for (int i=0; i<blockSize; i++) {
+		uint16_t value = coder.previous;
+		if (px[i] != 0)
+			value = coder.step == 1 ? px[i] : std::max((int)((px[i] + coder.bias) * coder.inverse), 1);
+		int16_t delta = (int16_t)(value - coder.previous);
+		z[i] = (uint16_t)((delta << 1) ^ (delta >> 15));
+		bits |= z[i];
+		coder.previous = value;
+	}
+	int width = bits < 16 ? BLOCK_NIBBLE : bits < 256 ? BLOCK_BYTE : BLOCK_SHORT;
+
+	flushEmpty(empty, out);
+	putTag(width, valid, out);
+	for (int i=0; i<blockSize; i++) {
+		if (width == BLOCK_NIBBLE) {
+			if (i & 1)
+				out[i >> 1] |= z[i] << 4;
+			else
+				out[i >> 1] = z[i];
+		}
+		else if (width == BLOCK_BYTE)
+			out[i] = z[i];
+		else {
+			out[i * 2] = z[i] & 0xff;
+			out[i * 2 + 1] = z[i] >> 8;
+		}
+	}
+	out += getBlockBytes(width);
+}
+
+static inline void decodeBlock(BlockCoder & coder, int tag, const unsigned char * in, unsigned short * px) {
+	int valid = 0xffff;
+	if (tag & BLOCK_MASK) {
+		valid = in[0] | (in[1] << 8);
+		in += 2;
+	}
+	for (int i=0; i<blockSize; i++) {
+		uint16_t z;
+		if ((tag & 3) == BLOCK_NIBBLE)
+			z = (in[i >> 1] >> ((i & 1) * 4)) & 0x0f;
+		else if ((tag & 3) == BLOCK_BYTE)
+			z = in[i];
+		else
+			z = in[i * 2] | (in[i * 2 + 1] << 8);
+		coder.previous += (uint16_t)((z >> 1) ^ -(z & 1));
+		px[i] = valid & (1 << i) ? std::min((int)coder.previous * coder.step, 0xffff) : 0;
+	}
+}
+
+#endif
+
+//////////////////////////////////////////////////
+
+size_t ofxDepthCodec::encode(const unsigned short * depth, int width, int height, vector<unsigned char> & output, int tolerance) {
+	size_t start = output.size();
+	int numPixels = width * height;
+	int numBlocks = (numPixels + blockSize - 1) / blockSize;
+	int step = std::min(2 * std::max(tolerance, 0) + 1, 32767);
+	ofxDepthCodecHeader header;
+	memcpy(header.magic, codecMagic, 4);
+	header.width = width;
+	header.height = height;
+	header.step = step;
+	header.reserved = 0;
+
+	// Room for every block at its widest, trimmed at the end
+	output.resize(start + sizeof(header) + numBlocks * maxBlockBytes);
+	memcpy(output.data() + start, &header, sizeof(header));
+	unsigned char * out = output.data() + start + sizeof(header);
+
+	BlockCoder coder(step);
+	int empty = 0;
+	int full = numPixels / blockSize;
+	for (int b=0; b<full; b++)
+		encodeBlock(coder, depth + b * blockSize, empty, out);
+	if (full < numBlocks) {
+		unsigned short last[blockSize] = {0};
+		memcpy(last, depth + full * blockSize, (numPixels - full * blockSize) * sizeof(unsigned short));
+		encodeBlock(coder, last, empty, out);
+	}
+	flushEmpty(empty, out);
+
+	output.resize(out - output.data());
+	return output.size() - start;
+}
+
+size_t ofxDepthCodec::encode(ofxDepthImage & image, vector<unsigned char> & output, int tolerance) {
+	return encode(image.getHostData(), image.getWidth(), image.getHeight(), output, tolerance);
+}
+
+bool ofxDepthCodec::getSize(const unsigned char * data, size_t size, int & width, int & height) {
+	if (size < sizeof(ofxDepthCodecHeader) || memcmp(data, codecMagic, 4) != 0)
+		return false;
+	ofxDepthCodecHeader header;
+	memcpy(&header, data, sizeof(header));
+	// Callers allocate from this, so a damaged header must not ask for an empty or huge image
+	if (header.width == 0 || header.height == 0 || (uint64_t)header.width * header.height > INT_MAX / 2)
+		return false;
+	width = header.width;
+	height = header.height;
+	return true;
+}
+
+bool ofxDepthCodec::decode(const unsigned char * data, size_t size, unsigned short * depth, int numPixels) {
+	int width, height;
+	if (!getSize(data, size, width, height) || (long long)width * height != numPixels)
+		return false;
+	ofxDepthCodecHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header.step == 0)
+		return false;
+
+	const unsigned char * in = data + sizeof(header);
+	const unsigned char * end = data + size;
+	int numBlocks = (numPixels + blockSize - 1) / blockSize;
+	int full = numPixels / blockSize;
+	BlockCoder coder(header.step);
+	int b = 0;
+	while (b < numBlocks) {
+		if (in >= end)
+			return false;
+		int tag = *in++;
+		if ((tag & 3) == BLOCK_EMPTY) {
+			int n = (tag >> 2) + 1;
+			if (n > numBlocks - b)
+				return false;
+			int first = b * blockSize;
+			memset(depth + first, 0, (std::min(first + n * blockSize, numPixels) - first) * sizeof(unsigned short));
+			b += n;
+			continue;
+		}
+
+		int bytes = getBlockBytes(tag);
+		if (bytes > end - in)
+			return false;
+		if (b < full)
+			decodeBlock(coder, tag, in, depth + b * blockSize);
+		else {
+			unsigned short last[blockSize];
+			decodeBlock(coder, tag, in, last);
+			memcpy(depth + b * blockSize, last, (numPixels - b * blockSize) * sizeof(unsigned short));
+		}
+		in += bytes;
+		b++;
+	}
+	return true;
+}
+
+bool ofxDepthCodec::decode(const unsigned char * data, size_t size, ofxDepthImage & image) {
+	int width, height;
+	if (!getSize(data, size, width, height))
+		return false;
+	if (!image.isAllocated() || image.getWidth() != width || image.getHeight() != height)
+		image.allocate(width, height);
+
+	unsigned short * depth = (unsigned short*)image.mapWrite();
+	bool ok = depth && decode(data, size, depth, width * height);
+	// A damaged frame is cleared rather than left half decoded
+	if (depth && !ok)
+		memset(depth, 0, width * height * sizeof(unsigned short));
+	image.unmap();
+	if (image.isHostOnly())
+		image.setHostModified();
+	return ok;
+}
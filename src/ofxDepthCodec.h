@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ofxDepthImage.h"
+
+//////////////////////////////////////////////////
+// DEPTH CODEC
+//
+// Compression in the spirit of RVL (Wilson 2017), in blocks of 16 pixels
+// so SSE2 can code a block at a time: empty pixels repeat the last
+// valid depth, the deltas are zigzag coded at the width of the largest
+// in the block, and runs of empty blocks take one byte. A valid mask
+// follows a block only when some of its pixels are empty. Without SSE2
+// the same format is coded a pixel at a time. A tolerance above 0
+// quantises depth to steps of 2 * tolerance + 1 first, which shrinks
+// the deltas at up to tolerance error, except that depths below one
+// step round up to one step.
+
+class ofxDepthCodec {
+public:
+	// Appends an encoded frame to output and returns its size in bytes
+	static size_t encode(const unsigned short * depth, int width, int height, vector<unsigned char> & output, int tolerance = 0);
+	static size_t encode(ofxDepthImage & image, vector<unsigned char> & output, int tolerance = 0);
+
+	// Size of an encoded frame, false if it is not one or the size is empty or over INT_MAX / 2 pixels
+	static bool getSize(const unsigned char * data, size_t size, int & width, int & height);
+
+	static bool decode(const unsigned char * data, size_t size, unsigned short * depth, int numPixels);
+	// Decodes straight into the mapped device buffer of the image, which is cleared if the frame is damaged
+	static bool decode(const unsigned char * data, size_t size, ofxDepthImage & image);
+};
@@ -1,7 +1,119 @@
 #include "ofxDepthCore.h"
+#include "ofxDepthBuffer.h"
+
+typedef cl_event (CL_API_CALL * CreateEventFromGLsync)(cl_context context, GLsync sync, cl_int * err);
+
+//////////////////////////////////////////////////
+
+static string getDeviceString(cl_device_id device, cl_device_info param) {
+	char value[1024] = {0};
+	clGetDeviceInfo(device, param, sizeof(value) - 1, value, NULL);
+	return value;
+}
+
+bool ofxDepthProgram::buildFromSource(OpenCL & cl, string source, string options) {
+	const char * src = source.c_str();
+	size_t length = source.size();
+	cl_int err;
+	clProgram = clCreateProgramWithSource(cl.getContext(), 1, &src, &length, &err);
+	if (err != CL_SUCCESS) {
+		ofLogError("ofxDepthProgram") << "Error creating program from source: " << err;
+		return false;
+	}
+	return build(cl, options, true);
+}
+
+bool ofxDepthProgram::buildFromBinary(OpenCL & cl, const char * binary, size_t size, string options) {
+	const unsigned char * bin = (const unsigned char*)binary;
+	cl_int status;
+	cl_int err;
+	clProgram = clCreateProgramWithBinary(cl.getContext(), 1, &cl.getDevice(), &size, &bin, &status, &err);
+	if (err != CL_SUCCESS || status != CL_SUCCESS) {
+		if (clProgram)
+			clReleaseProgram(clProgram);
+		clProgram = NULL;
+		return false;
+	}
+	if (!build(cl, options, false)) {
+		clReleaseProgram(clProgram);
+		clProgram = NULL;
+		return false;
+	}
+	return true;
+}
+
+ofBuffer ofxDepthProgram::getBinary() {
+	size_t size = 0;
+	clGetProgramInfo(clProgram, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL);
+	vector<char> binary(size);
+	char * data = binary.data();
+	if (size == 0 || clGetProgramInfo(clProgram, CL_PROGRAM_BINARIES, sizeof(char*), &data, NULL) != CL_SUCCESS)
+		return ofBuffer();
+	return ofBuffer(binary.data(), size);
+}
+
+bool ofxDepthProgram::build(OpenCL & cl, string options, bool logErrors) {
+	pOpenCL = &cl;
+	cl_int err = clBuildProgram(clProgram, 1, &cl.getDevice(), options.c_str(), NULL, NULL);
+	if (err != CL_SUCCESS && logErrors) {
+		size_t length = 0;
+		clGetProgramBuildInfo(clProgram, cl.getDevice(), CL_PROGRAM_BUILD_LOG, 0, NULL, &length);
+		vector<char> log(length + 1, 0);
+		clGetProgramBuildInfo(clProgram, cl.getDevice(), CL_PROGRAM_BUILD_LOG, length, log.data(), NULL);
+		ofLogError("ofxDepthProgram") << "Error building program: " << err << "\n" << log.data();
+	}
+	return err == CL_SUCCESS;
+}
 
 //////////////////////////////////////////////////
 
+ofxDepthEvent::ofxDepthEvent(cl_event event) {
+	if (event)
+		this->event.reset(event, clReleaseEvent);
+}
+
+bool ofxDepthEvent::isValid() const {
+	return event != nullptr;
+}
+
+bool ofxDepthEvent::isComplete() const {
+	if (!event)
+		return true;
+	cl_int status = CL_COMPLETE;
+	clGetEventInfo(event.get(), CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+	return status <= CL_COMPLETE;
+}
+
+void ofxDepthEvent::wait() const {
+	if (event) {
+		cl_event e = event.get();
+		clWaitForEvents(1, &e);
+	}
+}
+
+cl_event ofxDepthEvent::getCLEvent() const {
+	return event.get();
+}
+
+void ofxDepthEvent::wait(const vector<ofxDepthEvent> & events) {
+	vector<cl_event> list;
+	for (const ofxDepthEvent & e : events) {
+		if (e.isValid())
+			list.push_back(e.getCLEvent());
+	}
+	if (!list.empty())
+		clWaitForEvents(list.size(), list.data());
+}
+
+//////////////////////////////////////////////////
+
+ofxDepthCore::~ofxDepthCore() {
+	// Pooled buffers unregister themselves, so they go while the registry still exists
+	scratch.clear();
+	for (size_t i=1; i<queues.size(); i++)
+		clReleaseCommandQueue(queues[i]);
+}
+
 void ofxDepthCore::setup(int deviceNumber) {
 	if (isSetup())
 		return;
@@ -64,10 +176,401 @@ OpenCL & ofxDepthCore::getCL() {
 	return opencl;
 }
 
-OpenCLProgramPtr ofxDepthCore::loadProgram(string source) {
-	return opencl.loadProgramFromSource(source);
+OpenCLProgramPtr ofxDepthCore::loadProgram(string source, string options) {
+	OpenCL & cl = getCL();
+	shared_ptr<ofxDepthProgram> program = make_shared<ofxDepthProgram>();
+
+	string path;
+	if (!cacheDirectory.empty()) {
+		string dir = ofToDataPath(cacheDirectory, true);
+		path = ofFilePath::join(dir, getProgramKey(source, options) + ".bin");
+		if (ofFile::doesFileExist(path, false)) {
+			ofBuffer binary = ofBufferFromFile(path, true);
+			if (program->buildFromBinary(cl, binary.getData(), binary.size(), options))
+				return program;
+			ofLogNotice("ofxDepthCore") << "Cached program is stale, rebuilding: " << path;
+		}
+	}
+
+	program->buildFromSource(cl, source, options);
+
+	if (!path.empty()) {
+		ofBuffer binary = program->getBinary();
+		if (binary.size() > 0) {
+			ofDirectory::createDirectory(ofToDataPath(cacheDirectory, true), false, true);
+			ofBufferToFile(path, binary, true);
+		}
+	}
+	return program;
+}
+
+void ofxDepthCore::setCacheDirectory(string path) {
+	cacheDirectory = path;
+}
+
+string ofxDepthCore::getCacheDirectory() const {
+	return cacheDirectory;
+}
+
+string ofxDepthCore::getProgramKey(string source, string options) {
+	cl_device_id device = getCL().getDevice();
+	string key = getDeviceString(device, CL_DEVICE_VENDOR) + "\n";
+	key += getDeviceString(device, CL_DEVICE_NAME) + "\n";
+	key += getDeviceString(device, CL_DRIVER_VERSION) + "\n";
+	key += options + "\n";
+	key += source;
+
+	// 64 bit FNV-1a, stable between runs unlike std::hash
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	return name;
 }
 
 OpenCLKernelPtr ofxDepthCore::getKernel(string name) {
 	return getCL().kernel(name);
 }
+
+size_t ofxDepthCore::getWorkGroupSize(OpenCLKernelPtr kernel, size_t maxSize) {
+	size_t size = 0;
+	clGetKernelWorkGroupInfo(kernel->getCLKernel(), getCL().getDevice(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &size, NULL);
+	return std::max<size_t>(1, std::min(size, maxSize));
+}
+
+bool ofxDepthCore::getTileSize(OpenCLKernelPtr kernel, int radius, int bytesPerPixel, size_t & localX, size_t & localY) {
+	cl_device_id device = getCL().getDevice();
+	cl_kernel clKernel = kernel->getCLKernel();
+
+	auto it = tileSizes.find(clKernel);
+	if (it == tileSizes.end()) {
+		// One row of the tile spans the preferred SIMD width (warp/wavefront), up to 256 work-items in total
+		size_t maxSize = 0;
+		size_t multiple = 0;
+		clGetKernelWorkGroupInfo(clKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxSize, NULL);
+		clGetKernelWorkGroupInfo(clKernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, NULL);
+		size_t x = std::min<size_t>(std::max<size_t>(multiple, 8), 64);
+		size_t y = std::max<size_t>(1, std::min<size_t>(maxSize, 256) / x);
+		it = tileSizes.insert(make_pair(clKernel, make_pair(x, y))).first;
+	}
+
+	cl_ulong localMem = 0;
+	clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+
+	localX = it->second.first;
+	localY = it->second.second;
+	while ((localX + 2 * radius) * (localY + 2 * radius) * bytesPerPixel > localMem) {
+		if (localY > 1)
+			localY /= 2;
+		else if (localX > 8)
+			localX /= 2;
+		else
+			return false;
+	}
+
+	// When the border dominates the tile, loading it costs more than the global reads it saves
+	return (localX + 2 * radius) * (localY + 2 * radius) <= 8 * localX * localY;
+}
+
+int ofxDepthCore::addQueue() {
+	getCLQueue();
+	cl_int err;
+	cl_command_queue q = clCreateCommandQueue(opencl.getContext(), opencl.getDevice(), 0, &err);
+	if (err != CL_SUCCESS) {
+		ofLogError("ofxDepthCore") << "Error creating command queue: " << err;
+		return 0;
+	}
+	queues.push_back(q);
+	return queues.size() - 1;
+}
+
+void ofxDepthCore::setQueue(int index) {
+	getCLQueue();
+	if (index < 0 || index >= (int)queues.size()) {
+		ofLogError("ofxDepthCore") << "No command queue " << index;
+		return;
+	}
+	queue = index;
+}
+
+int ofxDepthCore::getQueue() const {
+	return queue;
+}
+
+int ofxDepthCore::getNumQueues() const {
+	return std::max<int>(queues.size(), 1);
+}
+
+cl_command_queue ofxDepthCore::getCLQueue() {
+	if (queues.empty())
+		queues.push_back(getCL().getQueue());
+	return queues[queue];
+}
+
+void ofxDepthCore::waitFor(ofxDepthEvent event) {
+	if (event.isValid())
+		waitEvents.push_back(event);
+}
+
+vector<cl_event> ofxDepthCore::getWaitList() {
+	vector<cl_event> list;
+	for (ofxDepthEvent & e : waitEvents)
+		list.push_back(e.getCLEvent());
+	return list;
+}
+
+ofxDepthEvent ofxDepthCore::enqueued(cl_int err, cl_event event, string command) {
+	// Commands on one queue run in order, so only the next command has to wait
+	waitEvents.clear();
+	if (err != CL_SUCCESS) {
+		ofLogError("ofxDepthCore") << "Error queuing " << command << ": " << err;
+		return ofxDepthEvent();
+	}
+	lastEvent = ofxDepthEvent(event);
+	return lastEvent;
+}
+
+ofxDepthEvent ofxDepthCore::run1D(OpenCLKernelPtr kernel, size_t globalSize, size_t localSize) {
+	return run3D(kernel, globalSize, 1, 1, localSize, localSize ? 1 : 0, localSize ? 1 : 0);
+}
+
+ofxDepthEvent ofxDepthCore::run2D(OpenCLKernelPtr kernel, size_t globalX, size_t globalY, size_t localX, size_t localY) {
+	return run3D(kernel, globalX, globalY, 1, localX, localY, localX ? 1 : 0);
+}
+
+ofxDepthEvent ofxDepthCore::run3D(OpenCLKernelPtr kernel, size_t globalX, size_t globalY, size_t globalZ, size_t localX, size_t localY, size_t localZ) {
+	cl_command_queue q = getCLQueue();
+	size_t global[3] = {globalX, globalY, globalZ};
+	size_t local[3] = {localX, localY, localZ};
+	cl_uint dim = globalZ > 1 ? 3 : globalY > 1 ? 2 : 1;
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueNDRangeKernel(q, kernel->getCLKernel(), dim, NULL, global, localX ? local : NULL, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "kernel");
+}
+
+ofxDepthEvent ofxDepthCore::read(OpenCLBuffer & buffer, void * data, size_t offset, size_t bytes, bool blocking) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueReadBuffer(q, buffer.getCLMem(), blocking ? CL_TRUE : CL_FALSE, offset, bytes, data, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "read");
+}
+
+ofxDepthEvent ofxDepthCore::write(OpenCLBuffer & buffer, const void * data, size_t offset, size_t bytes, bool blocking) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueWriteBuffer(q, buffer.getCLMem(), blocking ? CL_TRUE : CL_FALSE, offset, bytes, data, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "write");
+}
+
+ofxDepthEvent ofxDepthCore::copy(OpenCLBuffer & src, OpenCLBuffer & dest, size_t bytes) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueCopyBuffer(q, src.getCLMem(), dest.getCLMem(), 0, 0, bytes, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "copy");
+}
+
+void * ofxDepthCore::mapBuffer(OpenCLBuffer & buffer, cl_map_flags flags, size_t offset, size_t bytes) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = CL_SUCCESS;
+	void * data = clEnqueueMapBuffer(q, buffer.getCLMem(), CL_TRUE, flags, offset, bytes, wait.size(), wait.empty() ? NULL : wait.data(), &event, &err);
+	enqueued(err, event, "map");
+	return err == CL_SUCCESS ? data : nullptr;
+}
+
+ofxDepthEvent ofxDepthCore::unmapBuffer(OpenCLBuffer & buffer, void * data) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueUnmapMemObject(q, buffer.getCLMem(), data, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "unmap");
+}
+
+ofxDepthEvent ofxDepthCore::marker() {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueMarkerWithWaitList(q, wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "marker");
+}
+
+ofxDepthEvent ofxDepthCore::getLastEvent() const {
+	return lastEvent;
+}
+
+void ofxDepthCore::flush() {
+	for (cl_command_queue q : queues)
+		clFlush(q);
+}
+
+void ofxDepthCore::finish() {
+	for (cl_command_queue q : queues)
+		clFinish(q);
+}
+
+bool ofxDepthCore::hasGLEvents() {
+	if (glEvents < 0)
+		glEvents = getDeviceString(getCL().getDevice(), CL_DEVICE_EXTENSIONS).find("cl_khr_gl_event") != string::npos;
+	return glEvents > 0;
+}
+
+ofxDepthEvent ofxDepthCore::acquire(const vector<cl_mem> & mems) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueAcquireGLObjects(q, mems.size(), mems.data(), wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "acquire");
+}
+
+ofxDepthEvent ofxDepthCore::release(const vector<cl_mem> & mems) {
+	cl_command_queue q = getCLQueue();
+	vector<cl_event> wait = getWaitList();
+	cl_event event = NULL;
+	cl_int err = clEnqueueReleaseGLObjects(q, mems.size(), mems.data(), wait.size(), wait.empty() ? NULL : wait.data(), &event);
+	return enqueued(err, event, "release");
+}
+
+ofxDepthEvent ofxDepthCore::acquire(OpenCLBuffer & buffer) {
+	return acquire(vector<cl_mem>(1, buffer.getCLMem()));
+}
+
+ofxDepthEvent ofxDepthCore::release(OpenCLBuffer & buffer) {
+	return release(vector<cl_mem>(1, buffer.getCLMem()));
+}
+
+ofxDepthEvent ofxDepthCore::beginFrame() {
+	if (inFrame)
+		endFrame();
+	getCLQueue();
+
+	// CL must not touch the buffers before GL is done with them
+	if (hasGLEvents()) {
+		cl_platform_id platform = NULL;
+		clGetDeviceInfo(opencl.getDevice(), CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, NULL);
+		CreateEventFromGLsync createEvent = (CreateEventFromGLsync)clGetExtensionFunctionAddressForPlatform(platform, "clCreateEventFromGLsyncKHR");
+		if (createEvent) {
+			glSync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+			cl_int err;
+			cl_event event = createEvent(opencl.getContext(), glSync, &err);
+			if (err == CL_SUCCESS)
+				waitFor(ofxDepthEvent(event));
+			else
+				glFinish();
+		}
+		else
+			glFinish();
+	}
+	else
+		glFinish();
+
+	frameMems.clear();
+	for (ofxDepthBuffer * buffer : buffers) {
+		if (buffer->isAllocated() && !buffer->isHostOnly())
+			frameMems.push_back(buffer->clBuf.getCLMem());
+	}
+	inFrame = true;
+	if (frameMems.empty())
+		return ofxDepthEvent();
+	return acquire(frameMems);
+}
+
+ofxDepthEvent ofxDepthCore::endFrame() {
+	if (!inFrame)
+		return ofxDepthEvent();
+	inFrame = false;
+
+	ofxDepthEvent event;
+	if (!frameMems.empty()) {
+		event = release(frameMems);
+		frameMems.clear();
+	}
+
+	// With cl_khr_gl_event a flush is enough for GL to see the results, otherwise wait for the release only
+	if (hasGLEvents())
+		clFlush(getCLQueue());
+	else
+		event.wait();
+
+	if (glSync) {
+		glDeleteSync(glSync);
+		glSync = 0;
+	}
+	return event;
+}
+
+bool ofxDepthCore::isInFrame() const {
+	return inFrame;
+}
+
+void ofxDepthCore::addBuffer(ofxDepthBuffer * buffer) {
+	buffers.insert(buffer);
+	// Allocated during a frame, so acquired on its own
+	if (inFrame && buffer->isAllocated() && !buffer->isHostOnly()) {
+		vector<cl_mem> mems(1, buffer->clBuf.getCLMem());
+		acquire(mems);
+		frameMems.push_back(mems[0]);
+	}
+}
+
+void ofxDepthCore::removeBuffer(ofxDepthBuffer * buffer) {
+	buffers.erase(buffer);
+	// Destroyed or reallocated during a frame, so its mem is released now rather than by endFrame()
+	if (inFrame && buffer->isAllocated() && !buffer->isHostOnly()) {
+		auto it = std::find(frameMems.begin(), frameMems.end(), buffer->clBuf.getCLMem());
+		if (it != frameMems.end()) {
+			release(vector<cl_mem>(1, *it));
+			frameMems.erase(it);
+		}
+	}
+}
+
+void ofxDepthCore::clearScratch() {
+	scratch.clear();
+}
+
+void ofxDepthCore::setBackend(ofxDepthBackend backend) {
+	this->backend = backend;
+	backends.clear();
+}
+
+void ofxDepthCore::setBackend(string operation, ofxDepthBackend backend) {
+	backends[operation] = backend;
+}
+
+ofxDepthBackend ofxDepthCore::getBackend() const {
+	return backend;
+}
+
+ofxDepthBackend ofxDepthCore::getBackend(string operation) const {
+	auto it = backends.find(operation);
+	if (it != backends.end())
+		return it->second;
+	return backend;
+}
+
+//////////////////////////////////////////////////
+
+ofxDepthFrame::ofxDepthFrame() {
+	ofxDepth.beginFrame();
+	active = true;
+}
+
+ofxDepthFrame::~ofxDepthFrame() {
+	end();
+}
+
+ofxDepthEvent ofxDepthFrame::end() {
+	if (!active)
+		return ofxDepthEvent();
+	active = false;
+	return ofxDepth.endFrame();
+}
@@ -1,9 +1,54 @@
 #pragma once
 
 #include "MSAOpenCL.h"
+#include <tuple>
+#include <typeinfo>
 
 using namespace msa;
 
+enum ofxDepthBackend {
+	OFX_DEPTH_BACKEND_OPENCL,
+	OFX_DEPTH_BACKEND_CPU
+};
+
+class ofxDepthBuffer;
+
+//////////////////////////////////////////////////
+// DEPTH PROGRAM
+//
+// OpenCL program built either from source or from a device binary
+
+class ofxDepthProgram : public OpenCLProgram {
+public:
+	bool buildFromSource(OpenCL & cl, string source, string options);
+	bool buildFromBinary(OpenCL & cl, const char * binary, size_t size, string options);
+	ofBuffer getBinary();
+
+protected:
+	bool build(OpenCL & cl, string options, bool logErrors);
+};
+
+//////////////////////////////////////////////////
+// DEPTH EVENT
+//
+// Completion of a queued upload, kernel or readback. Copies share the event
+
+class ofxDepthEvent {
+public:
+	ofxDepthEvent() {}
+	explicit ofxDepthEvent(cl_event event);
+
+	bool isValid() const;
+	bool isComplete() const;
+	void wait() const;
+	cl_event getCLEvent() const;
+
+	static void wait(const vector<ofxDepthEvent> & events);
+
+protected:
+	shared_ptr<std::remove_pointer<cl_event>::type> event;
+};
+
 //////////////////////////////////////////////////
 // DEPTH CORE
 
@@ -20,12 +65,134 @@ public:
 	void loadKernel(string name, OpenCLProgramPtr program);
 
 	OpenCL & getCL();
-	OpenCLProgramPtr loadProgram(string source);
+	OpenCLProgramPtr loadProgram(string source, string options = "");
+
+	// Compiled programs are cached per device, driver, options and source. An empty path disables the cache
+	void setCacheDirectory(string path);
+	string getCacheDirectory() const;
 	OpenCLKernelPtr getKernel(string name);
 
+	// Largest work-group the kernel runs with on the device, up to maxSize
+	size_t getWorkGroupSize(OpenCLKernelPtr kernel, size_t maxSize = 256);
+
+	// Work-group size for a kernel that caches a tile plus a border of radius in local memory.
+	// Returns false when no useful tile fits in the device's local memory
+	bool getTileSize(OpenCLKernelPtr kernel, int radius, int bytesPerPixel, size_t & localX, size_t & localY);
+
+	// Backend used by the image operations, either globally or per operation name ("limit", "denoise", ...)
+	void setBackend(ofxDepthBackend backend);
+	void setBackend(string operation, ofxDepthBackend backend);
+	ofxDepthBackend getBackend() const;
+	ofxDepthBackend getBackend(string operation) const;
+
+	// Commands are queued on the current queue and return an event without blocking.
+	// Frames in flight each get their own queue, e.g. setQueue(frame % 3), and
+	// waitFor() orders the next command after work queued elsewhere
+	int addQueue();
+	void setQueue(int index);
+	int getQueue() const;
+	int getNumQueues() const;
+	cl_command_queue getCLQueue();
+	void waitFor(ofxDepthEvent event);
+
+	ofxDepthEvent run1D(OpenCLKernelPtr kernel, size_t globalSize, size_t localSize = 0);
+	ofxDepthEvent run2D(OpenCLKernelPtr kernel, size_t globalX, size_t globalY, size_t localX = 0, size_t localY = 0);
+	ofxDepthEvent run3D(OpenCLKernelPtr kernel, size_t globalX, size_t globalY, size_t globalZ, size_t localX = 0, size_t localY = 0, size_t localZ = 0);
+	ofxDepthEvent read(OpenCLBuffer & buffer, void * data, size_t offset, size_t bytes, bool blocking = false);
+	ofxDepthEvent write(OpenCLBuffer & buffer, const void * data, size_t offset, size_t bytes, bool blocking = false);
+	ofxDepthEvent copy(OpenCLBuffer & src, OpenCLBuffer & dest, size_t bytes);
+	// Blocks until the range is mapped, unmapBuffer() queues the release
+	void * mapBuffer(OpenCLBuffer & buffer, cl_map_flags flags, size_t offset, size_t bytes);
+	ofxDepthEvent unmapBuffer(OpenCLBuffer & buffer, void * data);
+	// Completes when everything queued so far on the current queue is done
+	ofxDepthEvent marker();
+	ofxDepthEvent getLastEvent() const;
+	void flush();
+	void finish();
+
+	// Acquires every GL shared buffer once for the frame, instead of around each operation.
+	// endFrame() releases them before drawing. Sync with GL goes through events
+	// when the device has cl_khr_gl_event, otherwise through glFinish and the release event
+	ofxDepthEvent beginFrame();
+	ofxDepthEvent endFrame();
+	bool isInFrame() const;
+
+	// Acquires or releases one GL shared buffer on the current queue, for use outside a frame
+	ofxDepthEvent acquire(OpenCLBuffer & buffer);
+	ofxDepthEvent release(OpenCLBuffer & buffer);
+
+	void addBuffer(ofxDepthBuffer * buffer);
+	void removeBuffer(ofxDepthBuffer * buffer);
+
+	// Scratch buffer of a type and size from a pool. It goes back to the pool when the last reference is released
+	template<class B>
+	shared_ptr<B> getScratch(int width, int height);
+	void clearScratch();
+
 private:
 	ofxDepthCore() {}
+	~ofxDepthCore();
+	string getProgramKey(string source, string options);
+	ofxDepthEvent enqueued(cl_int err, cl_event event, string command);
+	vector<cl_event> getWaitList();
+	bool hasGLEvents();
+	ofxDepthEvent acquire(const vector<cl_mem> & mems);
+	ofxDepthEvent release(const vector<cl_mem> & mems);
+
+	typedef std::tuple<string, int, int> ScratchKey;
+	map<ScratchKey, vector<shared_ptr<void> > > scratch;
+
 	OpenCL opencl;
+	map<cl_kernel, pair<size_t, size_t> > tileSizes;
+	string cacheDirectory = "ofxDepthCache";
+	ofxDepthBackend backend = OFX_DEPTH_BACKEND_OPENCL;
+	map<string, ofxDepthBackend> backends;
+
+	vector<cl_command_queue> queues;
+	int queue = 0;
+	vector<ofxDepthEvent> waitEvents;
+	ofxDepthEvent lastEvent;
+
+	set<ofxDepthBuffer*> buffers;
+	vector<cl_mem> frameMems;
+	bool inFrame = false;
+	int glEvents = -1;
+	GLsync glSync = 0;
 };
 
+//////////////////////////////////////////////////
+// DEPTH FRAME
+//
+// Scope of a frame's processing, e.g. { ofxDepthFrame frame; image.denoise(...); ... } image.draw(...)
+
+class ofxDepthFrame {
+public:
+	ofxDepthFrame();
+	~ofxDepthFrame();
+
+	// Releases the buffers before the end of the scope
+	ofxDepthEvent end();
+
+protected:
+	bool active;
+};
+
+template<class B>
+shared_ptr<B> ofxDepthCore::getScratch(int width, int height) {
+	ScratchKey key(typeid(B).name(), width, height);
+	vector<shared_ptr<void> > & pool = scratch[key];
+	shared_ptr<B> buffer;
+	if (pool.empty()) {
+		buffer = make_shared<B>();
+		buffer->allocate(width, height);
+	}
+	else {
+		buffer = static_pointer_cast<B>(pool.back());
+		pool.pop_back();
+	}
+	return shared_ptr<B>(buffer.get(), [this, key, buffer](B *) {
+		scratch[key].push_back(buffer);
+	});
+}
+
 static ofxDepthCore & ofxDepth = ofxDepthCore::get();
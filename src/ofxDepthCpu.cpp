@@ -0,0 +1,703 @@
+#include "ofxDepthCpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#if defined(__AVX2__)
+#define OFX_DEPTH_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OFX_DEPTH_SSE2
+#endif
+#if defined(OFX_DEPTH_AVX2) || defined(OFX_DEPTH_SSE2)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+//////////////////////////////////////////////////
+// WORKER POOL
+
+class ofxDepthCpuPool {
+public:
+	ofxDepthCpuPool() {
+		setNumThreads(thread::hardware_concurrency());
+	}
+	~ofxDepthCpuPool() {
+		stop();
+	}
+
+	void setNumThreads(int numThreads) {
+		lock_guard<mutex> runLock(runMutex);
+		stop();
+		quit = false;
+		for (int i=1; i<numThreads; i++)
+			threads.push_back(thread(&ofxDepthCpuPool::work, this));
+	}
+
+	int getNumThreads() const {
+		return threads.size() + 1;
+	}
+
+	void run(int height, const function<void(int, int)> & rows) {
+		int numBands = min(getNumThreads(), max(1, height / minRowsPerBand));
+		if (numBands <= 1) {
+			rows(0, height);
+			return;
+		}
+		lock_guard<mutex> runLock(runMutex);
+		{
+			lock_guard<mutex> lock(jobMutex);
+			job = &rows;
+			jobHeight = height;
+			jobBands = numBands;
+			nextBand = 1;
+			pending = numBands - 1;
+		}
+		jobReady.notify_all();
+
+		rows(0, height / numBands);
+
+		unique_lock<mutex> lock(jobMutex);
+		jobDone.wait(lock, [this]() { return pending == 0; });
+		job = nullptr;
+	}
+
+private:
+	void work() {
+		unique_lock<mutex> lock(jobMutex);
+		while (true) {
+			jobReady.wait(lock, [this]() { return quit || (job && nextBand < jobBands); });
+			if (quit)
+				return;
+			int band = nextBand++;
+			const function<void(int, int)> & rows = *job;
+			int begin = band * jobHeight / jobBands;
+			int end = (band + 1) * jobHeight / jobBands;
+			lock.unlock();
+			rows(begin, end);
+			lock.lock();
+			if (--pending == 0)
+				jobDone.notify_all();
+		}
+	}
+
+	void stop() {
+		{
+			lock_guard<mutex> lock(jobMutex);
+			quit = true;
+		}
+		jobReady.notify_all();
+		for (thread & t : threads)
+			t.join();
+		threads.clear();
+	}
+
+	vector<thread> threads;
+	mutex runMutex;
+	mutex jobMutex;
+	condition_variable jobReady;
+	condition_variable jobDone;
+	const function<void(int, int)> * job = nullptr;
+	int jobHeight = 0;
+	int jobBands = 0;
+	int nextBand = 0;
+	int pending = 0;
+	bool quit = false;
+	int minRowsPerBand = 16;
+};
+
+static ofxDepthCpuPool & getPool() {
+	static ofxDepthCpuPool pool;
+	return pool;
+}
+
+// Stencils read neighbours, so in-place calls work from a copy of the input
+static const unsigned short * stencilInput(const unsigned short * input, unsigned short * output, int size, vector<unsigned short> & copy) {
+	if (input != output)
+		return input;
+	copy.assign(input, input + size);
+	return copy.data();
+}
+
+//////////////////////////////////////////////////
+
+void ofxDepthCpu::setNumThreads(int numThreads) {
+	getPool().setNumThreads(max(1, numThreads));
+}
+
+int ofxDepthCpu::getNumThreads() {
+	return getPool().getNumThreads();
+}
+
+void ofxDepthCpu::parallelRows(int height, const function<void(int, int)> & rows) {
+	getPool().run(height, rows);
+}
+
+#ifdef OFX_DEPTH_SSE2
+static inline __m128i reverse8(__m128i v) {
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+// Low 16 bits of each 32-bit lane, wrapping like a cast to unsigned short
+static inline __m128i pack16(__m128i lo, __m128i hi) {
+	lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+	hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+	return _mm_packs_epi32(lo, hi);
+}
+#endif
+
+void ofxDepthCpu::flipH(unsigned short * data, int width, int height) {
+	parallelRows(height, [=](int y0, int y1) {
+		for (int y=y0; y<y1; y++) {
+			unsigned short * row = data + y * width;
+			int l = 0;
+			int r = width;
+#ifdef OFX_DEPTH_SSE2
+			// Swaps 8 pixels from each end, the middle is left to reverse()
+			for (; r - l >= 16; l += 8, r -= 8) {
+				__m128i a = _mm_loadu_si128((const __m128i*)(row + l));
+				__m128i b = _mm_loadu_si128((const __m128i*)(row + r - 8));
+				_mm_storeu_si128((__m128i*)(row + l), reverse8(b));
+				_mm_storeu_si128((__m128i*)(row + r - 8), reverse8(a));
+			}
+#endif
+			reverse(row + l, row + r);
+		}
+	});
+}
+
+void ofxDepthCpu::flipV(unsigned short * data, int width, int height) {
+	parallelRows(height / 2, [=](int y0, int y1) {
+		for (int y=y0; y<y1; y++) {
+			unsigned short * a = data + y * width;
+			unsigned short * b = data + (height - y - 1) * width;
+			int i = 0;
+#ifdef OFX_DEPTH_SSE2
+			for (; i + 8 <= width; i += 8) {
+				__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+				__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+				_mm_storeu_si128((__m128i*)(a + i), vb);
+				_mm_storeu_si128((__m128i*)(b + i), va);
+			}
+#endif
+			swap_ranges(a + i, a + width, b + i);
+		}
+	});
+}
+
+void ofxDepthCpu::limit(const unsigned short * input, unsigned short * output, int width, int height, int min, int max) {
+	int lo = std::max(min, 0);
+	int hi = std::min(max, (int)USHRT_MAX);
+	if (lo > hi) {
+		memset(output, 0, width * height * sizeof(unsigned short));
+		return;
+	}
+	// (v - lo) <= (hi - lo) in unsigned 16-bit arithmetic is the same as lo <= v <= hi
+	unsigned short vlo = lo;
+	unsigned short range = hi - lo;
+	parallelRows(height, [=](int y0, int y1) {
+		const unsigned short * in = input + y0 * width;
+		unsigned short * out = output + y0 * width;
+		int n = (y1 - y0) * width;
+		int i = 0;
+#ifdef OFX_DEPTH_AVX2
+		const __m256i lo8 = _mm256_set1_epi16((short)vlo);
+		const __m256i range8 = _mm256_set1_epi16((short)range);
+		const __m256i zero8 = _mm256_setzero_si256();
+		for (; i + 16 <= n; i += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+			__m256i over = _mm256_subs_epu16(_mm256_sub_epi16(v, lo8), range8);
+			__m256i mask = _mm256_cmpeq_epi16(over, zero8);
+			_mm256_storeu_si256((__m256i*)(out + i), _mm256_and_si256(v, mask));
+		}
+#endif
+#ifdef OFX_DEPTH_SSE2
+		const __m128i lo4 = _mm_set1_epi16((short)vlo);
+		const __m128i range4 = _mm_set1_epi16((short)range);
+		const __m128i zero4 = _mm_setzero_si128();
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			__m128i over = _mm_subs_epu16(_mm_sub_epi16(v, lo4), range4);
+			__m128i mask = _mm_cmpeq_epi16(over, zero4);
+			_mm_storeu_si128((__m128i*)(out + i), _mm_and_si128(v, mask));
+		}
+#endif
+		for (; i < n; i++)
+			out[i] = (unsigned short)(in[i] - vlo) <= range ? in[i] : 0;
+	});
+}
+
+void ofxDepthCpu::denoise(const unsigned short * input, unsigned short * output, int width, int height, float threshold, int neighbours) {
+	vector<unsigned short> copy;
+	input = stencilInput(input, output, width * height, copy);
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			// Same window bounds as the OpenCL kernel
+			int ymin = cy >= 2 ? cy-2 : 0;
+			int ymax = cy < height-2 ? cy+2 : height-2;
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				int xmin = cx >= 2 ? cx-2 : 0;
+				int xmax = cx < width-2 ? cx+2 : width-2;
+				int c = input[i];
+				int sum = 0;
+				for (int y=ymin; y<=ymax; y++) {
+					for (int x=xmin; x<=xmax; x++) {
+						int j = y * width + x;
+						if (i != j && abs(c - input[j]) < threshold)
+							sum++;
+					}
+				}
+				output[i] = sum < neighbours ? 0 : c;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::erode(const unsigned short * input, unsigned short * output, int width, int height, int radius, float threshold, float fov) {
+	vector<unsigned short> copy;
+	input = stencilInput(input, output, width * height, copy);
+	int diam = radius*2+1;
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			int ymin = std::max(cy-radius, 0);
+			int ymax = std::min(cy+radius, height-1);
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				int c = input[i];
+				if (c == 0) {
+					output[i] = 0;
+					continue;
+				}
+				int xmin = std::max(cx-radius, 0);
+				int xmax = std::min(cx+radius, width-1);
+				float zrt = fabs(c * fov) * threshold;
+				int count = 0;
+				for (int y=ymin; y<=ymax; y++) {
+					const unsigned short * row = input + y * width;
+					for (int x=xmin; x<=xmax; x++) {
+						if (row[x] != 0 && abs(row[x] - c) < zrt)
+							count++;
+					}
+				}
+				output[i] = count < (diam*diam)/2 ? 0 : c;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::dilate(const unsigned short * input, unsigned short * output, int width, int height, int radius, float threshold, float fov) {
+	vector<unsigned short> copy;
+	input = stencilInput(input, output, width * height, copy);
+	int diam = radius*2+1;
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			int ymin = std::max(cy-radius, 0);
+			int ymax = std::min(cy+radius, height-1);
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				if (input[i] != 0) {
+					output[i] = input[i];
+					continue;
+				}
+				int xmin = std::max(cx-radius, 0);
+				int xmax = std::min(cx+radius, width-1);
+				int count = 0;
+				unsigned long long sum = 0;
+				for (int y=ymin; y<=ymax; y++) {
+					const unsigned short * row = input + y * width;
+					for (int x=xmin; x<=xmax; x++) {
+						if (row[x] != 0) {
+							count++;
+							sum += row[x];
+						}
+					}
+				}
+				if (count == 0 || count < (diam*diam)/2-1) {
+					output[i] = 0;
+					continue;
+				}
+				unsigned short avg = sum / count;
+				float zrt = fabs(avg * fov) * threshold;
+
+				sum = 0;
+				for (int y=ymin; y<=ymax; y++) {
+					const unsigned short * row = input + y * width;
+					for (int x=xmin; x<=xmax; x++) {
+						if (row[x] != 0) {
+							long long d = row[x] - avg;
+							sum += d * d;
+						}
+					}
+				}
+				output[i] = sqrt((double)sum / count) < zrt ? avg : 0;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::blur(const unsigned short * input, unsigned short * output, int width, int height) {
+	const float gaus0 = 0.077847f;
+	const float gaus1 = 0.123317f;
+	const float gaus2 = 0.195346f;
+	vector<unsigned short> copy;
+	input = stencilInput(input, output, width * height, copy);
+	parallelRows(height, [=](int y0, int y1) {
+		// Border pixels are left untouched, like the OpenCL kernel
+		for (int y=std::max(y0, 1); y<std::min(y1, height-1); y++) {
+			const unsigned short * r0 = input + (y-1) * width;
+			const unsigned short * r1 = input + (y+0) * width;
+			const unsigned short * r2 = input + (y+1) * width;
+			for (int x=1; x<width-1; x++) {
+				double avg = 0;
+				avg += r0[x-1] * gaus0;
+				avg += r0[x+0] * gaus1;
+				avg += r0[x+1] * gaus0;
+				avg += r1[x-1] * gaus1;
+				avg += r1[x+0] * gaus2;
+				avg += r1[x+1] * gaus1;
+				avg += r2[x-1] * gaus0;
+				avg += r2[x+0] * gaus1;
+				avg += r2[x+1] * gaus0;
+				output[y * width + x] = (unsigned short)avg;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::convolution(const unsigned short * input, unsigned short * output, int width, int height, const float * ker, int radius, int threshold, float fov) {
+	vector<unsigned short> copy;
+	input = stencilInput(input, output, width * height, copy);
+	int diam = radius*2+1;
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				int c = input[i];
+				if (c == 0) {
+					output[i] = 0;
+					continue;
+				}
+				float zrt = fabs(c * fov) * threshold;
+				double avg = 0;
+				for (int y=-radius; y<=radius; y++) {
+					int iy = cy + y;
+					const float * k = ker + (radius+y)*diam + radius;
+					for (int x=-radius; x<=radius; x++) {
+						int ix = cx + x;
+						int d = (ix >= 0 && ix < width && iy >= 0 && iy < height) ? input[iy * width + ix] : 0;
+						if (d != 0 && abs(d - c) < zrt)
+							avg += d * k[x];
+						else
+							avg += c * k[x];
+					}
+				}
+				output[i] = (unsigned short)avg;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::convolution(const unsigned short * input, unsigned short * output, int width, int height, const float * rowKernel, const float * columnKernel, int radius, int threshold, float fov) {
+	// Each row result keeps the input depth next to it for the column pass, which only reads these
+	vector<float> rows(width * height * 2);
+	float * row = rows.data();
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				int c = input[i];
+				float avg = 0;
+				if (c != 0) {
+					float zrt = fabs(c * fov) * threshold;
+					for (int x=-radius; x<=radius; x++) {
+						int ix = cx + x;
+						int d = ix >= 0 && ix < width ? input[i + x] : 0;
+						if (d != 0 && abs(d - c) < zrt)
+							avg += d * rowKernel[radius+x];
+						else
+							avg += c * rowKernel[radius+x];
+					}
+				}
+				row[i * 2] = avg;
+				row[i * 2 + 1] = (float)c;
+			}
+		}
+	});
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				float c = row[i * 2 + 1];
+				if (c == 0.f) {
+					output[i] = 0;
+					continue;
+				}
+				float zrt = fabs(c * fov) * threshold;
+				float avg = 0;
+				for (int y=-radius; y<=radius; y++) {
+					int iy = cy + y;
+					bool inside = iy >= 0 && iy < height;
+					float d = inside ? row[(iy * width + cx) * 2 + 1] : 0.f;
+					if (d != 0.f && fabs(d - c) < zrt)
+						avg += row[(iy * width + cx) * 2] * columnKernel[radius+y];
+					else
+						avg += row[i * 2] * columnKernel[radius+y];
+				}
+				output[i] = (unsigned short)avg;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::bilateral(const unsigned short * input, const unsigned short * guide, unsigned short * output, int width, int height, const float * space, const float * range, float rangeScale, int radius) {
+	vector<unsigned short> copy;
+	vector<unsigned short> guideCopy;
+	const unsigned short * source = stencilInput(input, output, width * height, copy);
+	guide = guide == input ? source : stencilInput(guide, output, width * height, guideCopy);
+	input = source;
+	int diam = radius*2+1;
+	parallelRows(height, [=](int y0, int y1) {
+		for (int cy=y0; cy<y1; cy++) {
+			for (int cx=0; cx<width; cx++) {
+				int i = cy * width + cx;
+				if (input[i] == 0) {
+					output[i] = 0;
+					continue;
+				}
+				// Pixels outside the image are skipped, like the zero-filled border of bilateralTiled
+				float gc = guide[i];
+				float sum = 0;
+				float weights = 0;
+				for (int y=max(-radius, -cy); y<=min(radius, height - 1 - cy); y++) {
+					for (int x=max(-radius, -cx); x<=min(radius, width - 1 - cx); x++) {
+						int j = i + y * width + x;
+						int d = input[j];
+						if (d == 0)
+							continue;
+						float w = space[(radius+y)*diam+radius+x] * range[min((int)(fabs(guide[j] - gc) * rangeScale), 255)];
+						sum += d * w;
+						weights += w;
+					}
+				}
+				output[i] = (unsigned short)(sum / weights + 0.5f);
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::map(const unsigned short * input, unsigned short * output, int width, int height, int imin, int imax, int omin, int omax) {
+	// An empty input range maps every valid pixel to omin
+	if (imax == imin) {
+		parallelRows(height, [=](int y0, int y1) {
+			for (int i=y0*width; i<y1*width; i++)
+				output[i] = input[i] == 0 ? 0 : omin;
+		});
+		return;
+	}
+	// In doubles the product is exact and the quotient truncates the same as in integers,
+	// as long as it fits the 32-bit lanes it is converted to
+	long long maxQuotient = 65535LL * std::abs(omax - omin) / std::abs(imax - imin) + 65535;
+	bool lanes = maxQuotient <= INT_MAX;
+	parallelRows(height, [=](int y0, int y1) {
+		const unsigned short * in = input + y0 * width;
+		unsigned short * out = output + y0 * width;
+		int n = (y1 - y0) * width;
+		int i = 0;
+#ifdef OFX_DEPTH_SSE2
+		if (lanes) {
+			const __m128i zero4 = _mm_setzero_si128();
+			const __m128i imin4 = _mm_set1_epi32(imin);
+			const __m128i omin4 = _mm_set1_epi32(omin);
+			const __m128d scale2 = _mm_set1_pd(omax - omin);
+			const __m128d range2 = _mm_set1_pd(imax - imin);
+			for (; i + 8 <= n; i += 8) {
+				__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+				__m128i q[2];
+				for (int h=0; h<2; h++) {
+					__m128i d = _mm_sub_epi32(h ? _mm_unpackhi_epi16(v, zero4) : _mm_unpacklo_epi16(v, zero4), imin4);
+					__m128i q0 = _mm_cvttpd_epi32(_mm_div_pd(_mm_mul_pd(_mm_cvtepi32_pd(d), scale2), range2));
+					__m128i q1 = _mm_cvttpd_epi32(_mm_div_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(d, 8)), scale2), range2));
+					q[h] = _mm_add_epi32(_mm_unpacklo_epi64(q0, q1), omin4);
+				}
+				__m128i valid = _mm_xor_si128(_mm_cmpeq_epi16(v, zero4), _mm_set1_epi16(-1));
+				_mm_storeu_si128((__m128i*)(out + i), _mm_and_si128(pack16(q[0], q[1]), valid));
+			}
+		}
+#endif
+		for (; i < n; i++) {
+			if (in[i] == 0)
+				out[i] = 0;
+			else
+				out[i] = (((long long)in[i] - imin) * (omax - omin)) / (imax - imin) + omin;
+		}
+	});
+}
+
+void ofxDepthCpu::accumulate(const unsigned short * input, unsigned short * output, int width, int height, float amount, int threshold) {
+	parallelRows(height, [=](int y0, int y1) {
+		const unsigned short * in = input + y0 * width;
+		unsigned short * out = output + y0 * width;
+		int n = (y1 - y0) * width;
+		int i = 0;
+#ifdef OFX_DEPTH_SSE2
+		// |in - out| > threshold as a saturating subtract, a negative threshold always replaces
+		const __m128i zero4 = _mm_setzero_si128();
+		const __m128i t4 = _mm_set1_epi16((short)std::min(std::max(threshold, 0), (int)USHRT_MAX));
+		const __m128i always4 = _mm_set1_epi16(threshold < 0 ? -1 : 0);
+		const __m128 keep4 = _mm_set1_ps(1 - amount);
+		const __m128 amount4 = _mm_set1_ps(amount);
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			__m128i o = _mm_loadu_si128((const __m128i*)(out + i));
+			__m128i diff = _mm_or_si128(_mm_subs_epu16(v, o), _mm_subs_epu16(o, v));
+			__m128i far = _mm_xor_si128(_mm_cmpeq_epi16(_mm_subs_epu16(diff, t4), zero4), _mm_set1_epi16(-1));
+			__m128i replace = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(o, zero4), far), always4);
+			__m128i lo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(o, zero4)), keep4), _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero4)), amount4)));
+			__m128i hi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(o, zero4)), keep4), _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero4)), amount4)));
+			__m128i blend = pack16(lo, hi);
+			__m128i result = _mm_or_si128(_mm_and_si128(replace, v), _mm_andnot_si128(replace, blend));
+			__m128i empty = _mm_cmpeq_epi16(v, zero4);
+			_mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_and_si128(empty, o), _mm_andnot_si128(empty, result)));
+		}
+#endif
+		for (; i < n; i++) {
+			int v = in[i];
+			int o = out[i];
+			if (v > 0) {
+				if (o == 0 || abs(v - o) > threshold)
+					out[i] = v;
+				else
+					out[i] = o * (1-amount) + v * amount;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::stabilize(const unsigned short * input, unsigned short * mean, float * variance, unsigned short * output, int width, int height, float amount, float threshold) {
+	parallelRows(height, [=](int y0, int y1) {
+		for (int i=y0*width; i<y1*width; i++) {
+			mean[i] = mean[i] * (1-amount) + input[i] * amount;
+			float d = input[i] - mean[i];
+			d /= 8000.0f;
+			float var = d * d;
+			variance[i] = variance[i] * (1-amount) + var * amount;
+			if (var / sqrt(variance[i]) < threshold)
+				output[i] = mean[i];
+			else
+				output[i] = input[i];
+		}
+	});
+}
+
+void ofxDepthCpu::subtract(const unsigned short * input, const unsigned short * background, unsigned short * output, int width, int height, int threshold) {
+	parallelRows(height, [=](int y0, int y1) {
+		const unsigned short * in = input + y0 * width;
+		const unsigned short * bg = background + y0 * width;
+		unsigned short * out = output + y0 * width;
+		int n = (y1 - y0) * width;
+		int i = 0;
+		// Keep input where background is empty or background - input > threshold (in 32-bit lanes)
+#ifdef OFX_DEPTH_AVX2
+		const __m256i t8 = _mm256_set1_epi32(threshold);
+		const __m256i zero8 = _mm256_setzero_si256();
+		for (; i + 16 <= n; i += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(bg + i));
+			__m256i bLo = _mm256_unpacklo_epi16(b, zero8);
+			__m256i bHi = _mm256_unpackhi_epi16(b, zero8);
+			__m256i keepLo = _mm256_or_si256(_mm256_cmpeq_epi32(bLo, zero8), _mm256_cmpgt_epi32(_mm256_sub_epi32(bLo, _mm256_unpacklo_epi16(v, zero8)), t8));
+			__m256i keepHi = _mm256_or_si256(_mm256_cmpeq_epi32(bHi, zero8), _mm256_cmpgt_epi32(_mm256_sub_epi32(bHi, _mm256_unpackhi_epi16(v, zero8)), t8));
+			_mm256_storeu_si256((__m256i*)(out + i), _mm256_and_si256(v, _mm256_packs_epi32(keepLo, keepHi)));
+		}
+#endif
+#ifdef OFX_DEPTH_SSE2
+		const __m128i t4 = _mm_set1_epi32(threshold);
+		const __m128i zero4 = _mm_setzero_si128();
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(bg + i));
+			__m128i bLo = _mm_unpacklo_epi16(b, zero4);
+			__m128i bHi = _mm_unpackhi_epi16(b, zero4);
+			__m128i keepLo = _mm_or_si128(_mm_cmpeq_epi32(bLo, zero4), _mm_cmpgt_epi32(_mm_sub_epi32(bLo, _mm_unpacklo_epi16(v, zero4)), t4));
+			__m128i keepHi = _mm_or_si128(_mm_cmpeq_epi32(bHi, zero4), _mm_cmpgt_epi32(_mm_sub_epi32(bHi, _mm_unpackhi_epi16(v, zero4)), t4));
+			_mm_storeu_si128((__m128i*)(out + i), _mm_and_si128(v, _mm_packs_epi32(keepLo, keepHi)));
+		}
+#endif
+		for (; i < n; i++) {
+			if (bg[i] == 0 || bg[i] - in[i] > threshold)
+				out[i] = in[i];
+			else
+				out[i] = 0;
+		}
+	});
+}
+
+void ofxDepthCpu::pointsFromFov(const unsigned short * depth, int width, int height, float fovH, float fovV, float * points) {
+	// tan() only depends on the column and the row, so it is computed once per frame
+	const float deg = 3.14159265358979f / 180.f;
+	vector<float> tanX(width);
+	vector<float> tanY(height);
+	for (int x=0; x<width; x++)
+		tanX[x] = tan(fovH * ((float)x / width - 0.5f) * deg);
+	for (int y=0; y<height; y++)
+		tanY[y] = tan(fovV * ((float)y / height - 0.5f) * deg);
+	const float * tx = tanX.data();
+	const float * ty = tanY.data();
+	parallelRows(height, [=](int y0, int y1) {
+		for (int y=y0; y<y1; y++) {
+			for (int x=0; x<width; x++) {
+				int i = y * width + x;
+				float d = depth[i];
+				float * p = points + i * 4;
+				p[0] = tx[x] * d;
+				p[1] = ty[y] * d;
+				p[2] = -d;
+				p[3] = 1.f;
+			}
+		}
+	});
+}
+
+void ofxDepthCpu::pointsFromTable(const unsigned short * depth, const float * table, int width, int height, float * points) {
+	parallelRows(height, [=](int y0, int y1) {
+		for (int i=y0*width; i<y1*width; i++) {
+			float d = depth[i];
+			float * p = points + i * 4;
+			p[0] = table[i * 2 + 0] * d;
+			p[1] = table[i * 2 + 1] * d;
+			p[2] = -d;
+			p[3] = 1.f;
+		}
+	});
+}
+
+void ofxDepthCpu::pointsFromTable(const unsigned short * depth, const float * table, int width, int height, const float * mat, float * points) {
+	parallelRows(height, [=](int y0, int y1) {
+		for (int i=y0*width; i<y1*width; i++) {
+			float d = depth[i];
+			float * p = points + i * 4;
+			if (d == 0) {
+				p[0] = p[1] = p[2] = p[3] = 0.f;
+				continue;
+			}
+			float x = table[i * 2 + 0] * d;
+			float y = table[i * 2 + 1] * d;
+			float z = -d;
+			p[0] = mat[0] * x + mat[4] * y + mat[8] * z + mat[12];
+			p[1] = mat[1] * x + mat[5] * y + mat[9] * z + mat[13];
+			p[2] = mat[2] * x + mat[6] * y + mat[10] * z + mat[14];
+			p[3] = 1.f;
+		}
+	});
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <functional>
+
+//////////////////////////////////////////////////
+// DEPTH CPU
+//
+// CPU versions of the depth image kernels. Pointwise kernels and flips
+// use SSE2 (limit and subtract also AVX2) when the compiler targets
+// them, stencils are scalar. All kernels split the image in row bands
+// over a small worker pool. Results match the OpenCL kernels, except
+// that stencils treat pixels outside the image as empty where the
+// OpenCL kernels read out of bounds.
+
+class ofxDepthCpu {
+public:
+	static void setNumThreads(int numThreads);
+	static int getNumThreads();
+
+	static void flipH(unsigned short * data, int width, int height);
+	static void flipV(unsigned short * data, int width, int height);
+	static void limit(const unsigned short * input, unsigned short * output, int width, int height, int min, int max);
+	static void denoise(const unsigned short * input, unsigned short * output, int width, int height, float threshold, int neighbours);
+	static void erode(const unsigned short * input, unsigned short * output, int width, int height, int radius, float threshold, float fov);
+	static void dilate(const unsigned short * input, unsigned short * output, int width, int height, int radius, float threshold, float fov);
+	static void blur(const unsigned short * input, unsigned short * output, int width, int height);
+	static void convolution(const unsigned short * input, unsigned short * output, int width, int height, const float * ker, int radius, int threshold, float fov);
+	// Row pass then column pass, like the convolutionH and convolutionV kernels
+	static void convolution(const unsigned short * input, unsigned short * output, int width, int height, const float * rowKernel, const float * columnKernel, int radius, int threshold, float fov);
+	// Weights are space[(radius+y)*diam+radius+x] * range[min(|g-gc| * rangeScale, 255)], guide may be the input
+	static void bilateral(const unsigned short * input, const unsigned short * guide, unsigned short * output, int width, int height, const float * space, const float * range, float rangeScale, int radius);
+	static void map(const unsigned short * input, unsigned short * output, int width, int height, int imin, int imax, int omin, int omax);
+	static void accumulate(const unsigned short * input, unsigned short * output, int width, int height, float amount, int threshold);
+	static void stabilize(const unsigned short * input, unsigned short * mean, float * variance, unsigned short * output, int width, int height, float amount, float threshold);
+	static void subtract(const unsigned short * input, const unsigned short * background, unsigned short * output, int width, int height, int threshold);
+	static void pointsFromFov(const unsigned short * depth, int width, int height, float fovH, float fovV, float * points);
+	static void pointsFromTable(const unsigned short * depth, const float * table, int width, int height, float * points);
+	// Points multiplied by a row-major 4x4 matrix (row vector times matrix, as ofMatrix4x4)
+	static void pointsFromTable(const unsigned short * depth, const float * table, int width, int height, const float * mat, float * points);
+
+	// Runs rows(begin, end) for bands of [0, height) on the worker pool and waits for all of them
+	static void parallelRows(int height, const std::function<void(int, int)> & rows);
+};
@@ -0,0 +1,112 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthFusion.h"
+#include "ofxDepthCamera.h"
+
+//////////////////////////////////////////////////
+
+int ofxDepthFusion::addSensor(ofxDepthCamera & camera, const ofMatrix4x4 & transform) {
+	return addSensor(&camera, nullptr, transform);
+}
+
+int ofxDepthFusion::addSensor(ofxDepthTable & table, const ofMatrix4x4 & transform) {
+	return addSensor(nullptr, &table, transform);
+}
+
+int ofxDepthFusion::addSensor(ofxDepthCamera * camera, ofxDepthTable * table, const ofMatrix4x4 & transform) {
+	if (sensors.size() >= ofxDepthPoints::maxBatchSize) {
+		ofLogError("ofxDepthFusion") << "addSensor(): at most " << ofxDepthPoints::maxBatchSize << " sensors";
+		return -1;
+	}
+	Sensor sensor;
+	sensor.camera = camera;
+	sensor.table = table;
+	sensor.transform = transform;
+	sensor.offset = 0;
+	sensor.size = 0;
+	sensors.push_back(sensor);
+	return sensors.size() - 1;
+}
+
+void ofxDepthFusion::setTransform(int sensor, const ofMatrix4x4 & transform) {
+	sensors[sensor].transform = transform;
+}
+
+const ofMatrix4x4 & ofxDepthFusion::getTransform(int sensor) const {
+	return sensors[sensor].transform;
+}
+
+int ofxDepthFusion::getNumSensors() const {
+	return sensors.size();
+}
+
+void ofxDepthFusion::clear() {
+	sensors.clear();
+	numPoints = 0;
+}
+
+void ofxDepthFusion::setCompact(bool compact) {
+	this->compact = compact;
+}
+
+bool ofxDepthFusion::getCompact() const {
+	return compact;
+}
+
+void ofxDepthFusion::update(vector<ofxDepthImage*> & images) {
+
+	if (images.size() != sensors.size()) {
+		ofLogError("ofxDepthFusion") << "update(): " << images.size() << " images for " << sensors.size() << " sensors";
+		return;
+	}
+	if (sensors.empty())
+		return;
+
+	// Segments follow each other in the order the sensors were added, like ofxDepthPoints::fromImages lays them out
+	this->images = images;
+	tables.resize(sensors.size());
+	transforms.resize(sensors.size());
+	int total = 0;
+	for (int s=0; s<sensors.size(); s++) {
+		tables[s] = sensors[s].camera ? &sensors[s].camera->getTable() : sensors[s].table;
+		transforms[s] = sensors[s].transform;
+		sensors[s].offset = total;
+		sensors[s].size = images[s]->getNumElements();
+		total += sensors[s].size;
+	}
+
+	points.fromImages(this->images, tables, transforms);
+
+	if (compact) {
+		if (!compactPoints.isAllocated() || compactPoints.getNumElements() != total)
+			compactPoints.allocate(total);
+		numPoints = points.compact(compactPoints);
+	}
+	else
+		numPoints = total;
+}
+
+int ofxDepthFusion::getSegmentOffset(int sensor) const {
+	return sensors[sensor].offset;
+}
+
+int ofxDepthFusion::getSegmentSize(int sensor) const {
+	return sensors[sensor].size;
+}
+
+int ofxDepthFusion::getNumPoints() const {
+	return numPoints;
+}
+
+ofxDepthPoints & ofxDepthFusion::getPoints() {
+	return compact ? compactPoints : points;
+}
+
+void ofxDepthFusion::draw() {
+	if (numPoints > 0)
+		getPoints().draw(0, numPoints);
+}
+
+void ofxDepthFusion::drawSensor(int sensor) {
+	if (sensors[sensor].size > 0)
+		points.draw(sensors[sensor].offset, sensors[sensor].size);
+}
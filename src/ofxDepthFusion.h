@@ -0,0 +1,68 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthImage.h"
+#include "ofxDepthPoints.h"
+
+using namespace msa;
+
+class ofxDepthCamera;
+
+//////////////////////////////////////////////////
+// DEPTH FUSION
+//
+// Points of several depth sensors in one GL/CL buffer. Each sensor owns
+// a segment of the buffer and is unprojected and moved to world space
+// straight into it, all sensors in one launch. The whole cloud is drawn
+// with a single call, optionally after packing out the invalid points.
+
+class ofxDepthFusion {
+public:
+	// Returns the index of the sensor, up to ofxDepthPoints::maxBatchSize sensors
+	int addSensor(ofxDepthCamera & camera, const ofMatrix4x4 & transform = ofMatrix4x4());
+	int addSensor(ofxDepthTable & table, const ofMatrix4x4 & transform = ofMatrix4x4());
+	void setTransform(int sensor, const ofMatrix4x4 & transform);
+	const ofMatrix4x4 & getTransform(int sensor) const;
+	int getNumSensors() const;
+	void clear();
+
+	// Drops invalid points of all sensors after each update, segments are then no longer valid
+	void setCompact(bool compact);
+	bool getCompact() const;
+
+	// One image per sensor, in the order they were added
+	void update(vector<ofxDepthImage*> & images);
+
+	// First point and number of points of a sensor in getPoints()
+	int getSegmentOffset(int sensor) const;
+	int getSegmentSize(int sensor) const;
+
+	// Number of points drawn, the valid points when compacting
+	int getNumPoints() const;
+	ofxDepthPoints & getPoints();
+
+	void draw();
+	void drawSensor(int sensor);
+
+protected:
+	struct Sensor {
+		ofxDepthCamera * camera;
+		ofxDepthTable * table;
+		ofMatrix4x4 transform;
+		int offset;
+		int size;
+	};
+
+	int addSensor(ofxDepthCamera * camera, ofxDepthTable * table, const ofMatrix4x4 & transform);
+
+	vector<Sensor> sensors;
+	bool compact = false;
+	int numPoints = 0;
+
+	ofxDepthPoints points;
+	ofxDepthPoints compactPoints;
+
+	vector<ofxDepthImage*> images;
+	vector<ofxDepthTable*> tables;
+	vector<ofMatrix4x4> transforms;
+};
@@ -1,6 +1,9 @@
 #include "ofxDepthCore.h"
 #include "ofxDepthPoints.h"
 #include "ofxDepthImage.h"
+#include "ofxDepthCpu.h"
+#include "ofxDepthCamera.h"
+#include "ofxDepthBackground.h"
 
 #define STRINGIFY(A) #A
 
@@ -205,13 +208,311 @@ __kernel void convolution(__global unsigned short* input, __global unsigned shor
 	output[i] = (unsigned short)avg;
 }
 
+// Loads the work-group's pixels plus a border of radius into local memory, pixels outside the image are 0
+void loadTile(__global unsigned short* input, __local unsigned short* tile, int width, int height, int radius) {
+	int lw = get_local_size(0);
+	int lh = get_local_size(1);
+	int tw = lw + 2 * radius;
+	int th = lh + 2 * radius;
+	int ox = (int)get_group_id(0) * lw - radius;
+	int oy = (int)get_group_id(1) * lh - radius;
+	for (int y=(int)get_local_id(1); y<th; y+=lh) {
+		for (int x=(int)get_local_id(0); x<tw; x+=lw) {
+			int gx = ox + x;
+			int gy = oy + y;
+			if (gx >= 0 && gx < width && gy >= 0 && gy < height)
+				tile[y * tw + x] = input[gy * width + gx];
+			else
+				tile[y * tw + x] = 0;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__kernel void denoiseTiled(__global unsigned short* input, __global unsigned short* output, float threshold, int neighbours, int width, int height, __local unsigned short* tile) {
+	loadTile(input, tile, width, height, 2);
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	if (cx >= width || cy >= height)
+		return;
+
+	int tw = (int)get_local_size(0) + 4;
+	int ox = (int)(get_group_id(0) * get_local_size(0)) - 2;
+	int oy = (int)(get_group_id(1) * get_local_size(1)) - 2;
+	unsigned short c = tile[(cy - oy) * tw + (cx - ox)];
+
+	int xmin = cx >= 2 ? cx-2 : 0;
+	int xmax = cx < width-2 ? cx+2 : width-2;
+	int ymin = cy >= 2 ? cy-2 : 0;
+	int ymax = cy < height-2 ? cy+2 : height-2;
+
+	int sum = 0;
+	for (int y=ymin; y<=ymax; y++) {
+		for (int x=xmin; x<=xmax; x++) {
+			if ((x != cx || y != cy) && abs(c - tile[(y - oy) * tw + (x - ox)]) < threshold)
+				sum++;
+		}
+	}
+	output[cy * width + cx] = sum < neighbours ? 0 : c;
+}
+
+__kernel void erodeTiled(__global unsigned short* input, __global unsigned short* output, int radius, float threshold, float fov, int width, int height, __local unsigned short* tile) {
+	loadTile(input, tile, width, height, radius);
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	if (cx >= width || cy >= height)
+		return;
+
+	int tw = (int)get_local_size(0) + 2 * radius;
+	int tc = ((int)get_local_id(1) + radius) * tw + (int)get_local_id(0) + radius;
+	unsigned short c = tile[tc];
+	int i = cy * width + cx;
+
+	if (c == 0) {
+		output[i] = 0;
+		return;
+	}
+
+	int diam = radius*2+1;
+	float zrt = fabs(c * fov) * threshold;
+	int count = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int ty = tc + y * tw;
+		for (int x=-radius; x<=radius; x++) {
+			unsigned short d = tile[ty + x];
+			if (d != 0 && abs(d - c) < zrt)
+				count++;
+		}
+	}
+	if (count < (diam*diam)/2)
+		output[i] = 0;
+	else
+		output[i] = c;
+}
+
+__kernel void dilateTiled(__global unsigned short* input, __global unsigned short* output, int radius, float threshold, float fov, int width, int height, __local unsigned short* tile) {
+	loadTile(input, tile, width, height, radius);
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	if (cx >= width || cy >= height)
+		return;
+
+	int tw = (int)get_local_size(0) + 2 * radius;
+	int tc = ((int)get_local_id(1) + radius) * tw + (int)get_local_id(0) + radius;
+	unsigned short c = tile[tc];
+	int i = cy * width + cx;
+
+	if (c != 0) {
+		output[i] = c;
+		return;
+	}
+
+	int diam = radius*2+1;
+	int count = 0;
+	unsigned long sum = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int ty = tc + y * tw;
+		for (int x=-radius; x<=radius; x++) {
+			unsigned short d = tile[ty + x];
+			if (d != 0) {
+				count++;
+				sum += d;
+			}
+		}
+	}
+	if (count == 0 || count < (diam*diam)/2-1) {
+		output[i] = 0;
+		return;
+	}
+	unsigned short avg = sum / count;
+	float zrt = fabs(avg * fov) * threshold;
+
+	sum = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int ty = tc + y * tw;
+		for (int x=-radius; x<=radius; x++) {
+			unsigned short d = tile[ty + x];
+			if (d != 0) {
+				unsigned long e = d - avg;
+				sum += e * e;
+			}
+		}
+	}
+
+	if (sqrt((float)sum / count) < zrt)
+		output[i] = avg;
+	else
+		output[i] = 0;
+}
+
+__kernel void convolutionTiled(__global unsigned short* input, __global unsigned short* output, __global float * ker, int radius, int threshold, float fov, int width, int height, __local unsigned short* tile) {
+	loadTile(input, tile, width, height, radius);
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	if (cx >= width || cy >= height)
+		return;
+
+	int tw = (int)get_local_size(0) + 2 * radius;
+	int tc = ((int)get_local_id(1) + radius) * tw + (int)get_local_id(0) + radius;
+	unsigned short c = tile[tc];
+	int i = cy * width + cx;
+
+	if (c == 0) {
+		output[i] = 0;
+		return;
+	}
+
+	int diam = radius*2+1;
+	float zrt = fabs(c * fov) * threshold;
+	float avg = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int ty = tc + y * tw;
+		int ky = (radius+y)*diam + radius;
+		for (int x=-radius; x<=radius; x++) {
+			unsigned short d = tile[ty + x];
+			if (d != 0 && abs(d - c) < zrt)
+				avg += d * ker[ky+x];
+			else
+				avg += c * ker[ky+x];
+		}
+	}
+	output[i] = (unsigned short)avg;
+}
+
+// Weights are space[(radius+y)*diam+radius+x] * range[min(|g-gc| * rangeScale, 255)], zeros are skipped
+// and so is everything outside the image, like the zero-filled border of bilateralTiled.
+// The range is measured on the guide, which is the depth itself unless joint
+__kernel void bilateral(__global unsigned short* input, __global unsigned short* guide, __global unsigned short* output, __constant float* space, __constant float* range, float rangeScale, int radius) {
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	int i = cy * width + cx;
+	if (input[i] == 0) {
+		output[i] = 0;
+		return;
+	}
+
+	int diam = radius*2+1;
+	float gc = guide[i];
+	float sum = 0;
+	float weights = 0;
+	for (int y=max(-radius, -cy); y<=min(radius, height - 1 - cy); y++) {
+		for (int x=max(-radius, -cx); x<=min(radius, width - 1 - cx); x++) {
+			int j = i + y * width + x;
+			unsigned short d = input[j];
+			if (d == 0)
+				continue;
+			float w = space[(radius+y)*diam+radius+x] * range[min((int)(fabs(guide[j] - gc) * rangeScale), 255)];
+			sum += d * w;
+			weights += w;
+		}
+	}
+	output[i] = (unsigned short)(sum / weights + 0.5f);
+}
+
+__kernel void bilateralTiled(__global unsigned short* input, __global unsigned short* guide, __global unsigned short* output, __constant float* space, __constant float* range, float rangeScale, int radius, int joint, int width, int height, __local unsigned short* tile, __local unsigned short* guideTile) {
+	loadTile(input, tile, width, height, radius);
+	__local unsigned short* g = tile;
+	if (joint) {
+		loadTile(guide, guideTile, width, height, radius);
+		g = guideTile;
+	}
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	if (cx >= width || cy >= height)
+		return;
+
+	int tw = (int)get_local_size(0) + 2 * radius;
+	int tc = ((int)get_local_id(1) + radius) * tw + (int)get_local_id(0) + radius;
+	int i = cy * width + cx;
+	if (tile[tc] == 0) {
+		output[i] = 0;
+		return;
+	}
+
+	int diam = radius*2+1;
+	float gc = g[tc];
+	float sum = 0;
+	float weights = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int ty = tc + y * tw;
+		int ky = (radius+y)*diam + radius;
+		for (int x=-radius; x<=radius; x++) {
+			unsigned short d = tile[ty + x];
+			if (d == 0)
+				continue;
+			float w = space[ky+x] * range[min((int)(fabs(g[ty + x] - gc) * rangeScale), 255)];
+			sum += d * w;
+			weights += w;
+		}
+	}
+	output[i] = (unsigned short)(sum / weights + 0.5f);
+}
+
+// Horizontal pass of a separable convolution, keeps the input depth next to the result for the vertical pass
+__kernel void convolutionH(__global unsigned short* input, __global float2* output, __global float * ker, int radius, int threshold, float fov) {
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	int width = get_global_size(0);
+	int i = cy*width+cx;
+	unsigned short c = input[i];
+
+	if (c == 0) {
+		output[i] = (float2)(0.f);
+		return;
+	}
+
+	float zrt = fabs(c * fov) * threshold;
+	float avg = 0;
+	for (int x=-radius; x<=radius; x++) {
+		int ix = cx+x;
+		unsigned short d = ix >= 0 && ix < width ? input[i+x] : 0;
+		if (d != 0 && abs(d - c) < zrt)
+			avg += d * ker[radius+x];
+		else
+			avg += c * ker[radius+x];
+	}
+	output[i] = (float2)(avg, (float)c);
+}
+
+// Vertical pass, neighbours are tested against the input depth and contribute their horizontal result
+__kernel void convolutionV(__global float2* input, __global unsigned short* output, __global float * ker, int radius, int threshold, float fov) {
+	int cx = get_global_id(0);
+	int cy = get_global_id(1);
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	int i = cy*width+cx;
+	float2 c = input[i];
+
+	if (c.y == 0.f) {
+		output[i] = 0;
+		return;
+	}
+
+	float zrt = fabs(c.y * fov) * threshold;
+	float avg = 0;
+	for (int y=-radius; y<=radius; y++) {
+		int iy = cy+y;
+		float2 d = iy >= 0 && iy < height ? input[iy*width+cx] : (float2)(0.f);
+		if (d.y != 0.f && fabs(d.y - c.y) < zrt)
+			avg += d.x * ker[radius+y];
+		else
+			avg += c.x * ker[radius+y];
+	}
+	output[i] = (unsigned short)avg;
+}
+
+// In 64 bits like ofxDepthCpu::map, the product passes INT_MAX for wide ranges. An empty input range maps to omin
 __kernel void map(__global unsigned short* depthIn, unsigned short imin, unsigned short imax, unsigned short omin, unsigned short omax, __global unsigned short* depthOut) {
 	int2 coords = (int2)(get_global_id(0), get_global_id(1));
 	int i = coords.y * get_global_size(0) + coords.x;
 	if (depthIn[i] == 0)
 		depthOut[i] = 0;
+	else if (imax == imin)
+		depthOut[i] = omin;
 	else
-		depthOut[i] = (( (int)depthIn[i] - imin) * ( (int)omax - omin)) / ( (int)imax - imin) + omin;
+		depthOut[i] = (((long)depthIn[i] - imin) * ((long)omax - omin)) / ((long)imax - imin) + omin;
 }
 
 __kernel void accumulate(__global unsigned short* input, __global unsigned short* output, float amount, int threshold) {
@@ -259,6 +560,27 @@ __kernel void pointsFromFov(__global unsigned short* depth, float2 fov, __global
 	points[i].w = 1.f;
 }
 
+__kernel void pointsFromTableTransform(__global unsigned short* depth, __global float2* table, __global float4* points, float16 mat) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int i = coords.y * get_global_size(0) + coords.x;
+	float d = (float)depth[i];
+	// Invalid pixels stay at zero instead of moving to the sensor's position
+	if (d == 0.f) {
+		points[i] = (float4)(0.f);
+		return;
+	}
+	float4 v = (float4)(table[i].x * d, table[i].y * d, -d, 1.f);
+	points[i] = v.x * mat.s0123 + v.y * mat.s4567 + v.z * mat.s89ab + mat.scdef;
+	points[i].w = 1.f;
+}
+
+__kernel void fovTable(__global float2* table, float2 fov) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int2 dims = (int2)(get_global_size(0), get_global_size(1));
+	float2 angle = fov * (((float2)(coords.x, coords.y) / (float2)(dims.x, dims.y)) - (float2)(0.5f));
+	table[coords.y * dims.x + coords.x] = tan(radians(angle));
+}
+
 __kernel void pointsFromTable(__global unsigned short* depth, __global float2* table, __global float4* points) {
 	int2 coords = (int2)(get_global_id(0), get_global_id(1));
 	int i = coords.y * get_global_size(0) + coords.x;
@@ -274,8 +596,13 @@ __kernel void pointsFromTable(__global unsigned short* depth, __global float2* t
 
 OpenCLProgramPtr ofxDepthImage::program;
 
+static bool isCpu(string operation) {
+	return ofxDepth.getBackend(operation) == OFX_DEPTH_BACKEND_CPU;
+}
+
 void ofxDepthImage::load(string filepath) {
-	ofxDepth.setup();
+	if (ofxDepth.getBackend() == OFX_DEPTH_BACKEND_OPENCL)
+		ofxDepth.setup();
 	ofShortPixels pixels;
 	ofLoadImage(pixels, filepath);
 	ofShortPixels spixels = pixels.getChannel(0);
@@ -297,39 +624,74 @@ void ofxDepthImage::draw(float x, float y, float w, float h) {
 }
 
 void ofxDepthImage::flipHorizontal() {
+	if (isCpu("flipHorizontal")) {
+		ofxDepthCpu::flipH(getHostData(), getWidth(), getHeight());
+		setHostModified();
+		return;
+	}
 	OpenCLKernelPtr kernel = ofxDepth.getKernel("flipH");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::flipVertical() {
+	if (isCpu("flipVertical")) {
+		ofxDepthCpu::flipV(getHostData(), getWidth(), getHeight());
+		setHostModified();
+		return;
+	}
 	OpenCLKernelPtr kernel = ofxDepth.getKernel("flipV");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::limit(int min, int max) {
+	if (isCpu("limit")) {
+		ofxDepthCpu::limit(getHostData(), getHostData(), getWidth(), getHeight(), min, max);
+		setHostModified();
+		return;
+	}
 	OpenCLKernelPtr kernel = ofxDepth.getKernel("limit");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, getCLBuffer());
 	kernel->setArg(2, min);
 	kernel->setArg(3, max);
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::denoise(float threshold, int neighbours, ofxDepthImage &outputImage) {
 
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		denoise(threshold, neighbours, *scratch);
+		swap(*scratch);
+		return;
+	}
+
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
-	OpenCLKernelPtr kernel = ofxDepth.getKernel("denoise");
+	if (isCpu("denoise")) {
+		ofxDepthCpu::denoise(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), threshold, neighbours);
+		outputImage.setHostModified();
+		return;
+	}
+
+	size_t localX, localY;
+	bool tiled = ofxDepth.getTileSize(getKernel("denoiseTiled"), 2, sizeof(unsigned short), localX, localY);
+
+	OpenCLKernelPtr kernel = getKernel(tiled ? "denoiseTiled" : "denoise");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
 	kernel->setArg(2, threshold);
 	kernel->setArg(3, neighbours);
-	kernel->run2D(getWidth(), getHeight());
+	if (tiled)
+		runTiled(kernel, 4, 2, localX, localY);
+	else
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::denoise(float threshold, int neighbours) {
@@ -338,56 +700,307 @@ void ofxDepthImage::denoise(float threshold, int neighbours) {
 
 void ofxDepthImage::erode(int radius, float threshold, ofxDepthImage &outputImage) {
 
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		erode(radius, threshold, *scratch);
+		swap(*scratch);
+		return;
+	}
+
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
-	OpenCLKernelPtr kernel = getKernel("erode");
+	if (isCpu("erode")) {
+		ofxDepthCpu::erode(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), radius, threshold, getFovFactor());
+		outputImage.setHostModified();
+		return;
+	}
+
+	size_t localX, localY;
+	bool tiled = ofxDepth.getTileSize(getKernel("erodeTiled"), radius, sizeof(unsigned short), localX, localY);
+
+	OpenCLKernelPtr kernel = getKernel(tiled ? "erodeTiled" : "erode");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
 	kernel->setArg(2, radius);
 	kernel->setArg(3, threshold);
-	kernel->setArg(4, tanf(60*DEG_TO_RAD)/height);
-	kernel->run2D(getWidth(), getHeight());
+	kernel->setArg(4, getFovFactor());
+	if (tiled)
+		runTiled(kernel, 5, radius, localX, localY);
+	else
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::dilate(int radius, float threshold, ofxDepthImage &outputImage) {
 
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		dilate(radius, threshold, *scratch);
+		swap(*scratch);
+		return;
+	}
+
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
-	OpenCLKernelPtr kernel = getKernel("dilate");
+	if (isCpu("dilate")) {
+		ofxDepthCpu::dilate(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), radius, threshold, getFovFactor());
+		outputImage.setHostModified();
+		return;
+	}
+
+	size_t localX, localY;
+	bool tiled = ofxDepth.getTileSize(getKernel("dilateTiled"), radius, sizeof(unsigned short), localX, localY);
+
+	OpenCLKernelPtr kernel = getKernel(tiled ? "dilateTiled" : "dilate");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
 	kernel->setArg(2, radius);
 	kernel->setArg(3, threshold);
-	kernel->setArg(4, tanf(60*DEG_TO_RAD)/height);
-	kernel->run2D(getWidth(), getHeight());
+	kernel->setArg(4, getFovFactor());
+	if (tiled)
+		runTiled(kernel, 5, radius, localX, localY);
+	else
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::blur(ofxDepthImage & outputImage) {
 
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		blur(*scratch);
+		swap(*scratch);
+		return;
+	}
+
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
+	if (isCpu("blur")) {
+		ofxDepthCpu::blur(getHostData(), outputImage.getHostData(), getWidth(), getHeight());
+		outputImage.setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("blur");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
+}
+
+void ofxDepthImage::blur(float sigma, ofxDepthImage & outputImage) {
+	blur((int)ceilf(sigma * 3.f), sigma, outputImage);
+}
+
+void ofxDepthImage::blur(int radius, float sigma, ofxDepthImage & outputImage) {
+
+	if (radius < 1 || sigma <= 0.f) {
+		if (&outputImage != this) {
+			if (!outputImage.isAllocated())
+				outputImage.allocate(getWidth(), getHeight());
+			copy(outputImage);
+		}
+		return;
+	}
+
+	int diam = radius*2+1;
+	if ((int)blurWeights.size() != diam || blurSigma != sigma) {
+		blurWeights.resize(diam);
+		float sum = 0;
+		for (int x=-radius; x<=radius; x++) {
+			blurWeights[radius+x] = expf(-(x*x) / (2.f * sigma * sigma));
+			sum += blurWeights[radius+x];
+		}
+		for (int x=-radius; x<=radius; x++) {
+			blurWeights[radius+x] /= sum;
+		}
+		blurSigma = sigma;
+		blurKernelValid = false;
+	}
+
+	if (isCpu("blur")) {
+		if (!outputImage.isAllocated())
+			outputImage.allocate(getWidth(), getHeight());
+		ofxDepthCpu::convolution(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), blurWeights.data(), blurWeights.data(), radius, 5, getFovFactor());
+		outputImage.setHostModified();
+		return;
+	}
+
+	if (!blurKernelValid) {
+		blurKernel.initBuffer(diam);
+		for (int x=0; x<diam; x++)
+			blurKernel[x] = blurWeights[x];
+		ofxDepth.write(blurKernel.getCLBuffer(), &blurKernel[0], 0, diam * sizeof(float), true);
+		blurKernelValid = true;
+	}
+
+	convolution(blurKernel, blurKernel, radius, outputImage);
+}
+
+void ofxDepthImage::convolution(OpenCLBufferManagedT<float> & rowKernel, OpenCLBufferManagedT<float> & columnKernel, int radius, ofxDepthImage & outputImage) {
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(getWidth(), getHeight());
+
+	if (isCpu("convolution")) {
+		ofxDepthCpu::convolution(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), &rowKernel[0], &columnKernel[0], radius, 5, getFovFactor());
+		outputImage.setHostModified();
+		return;
+	}
+
+	shared_ptr<ofxDepthImageT<float, ofVec2f> > rowImage = ofxDepth.getScratch<ofxDepthImageT<float, ofVec2f> >(getWidth(), getHeight());
+
+	OpenCLKernelPtr kernel = getKernel("convolutionH");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, rowImage->getCLBuffer());
+	kernel->setArg(2, rowKernel);
+	kernel->setArg(3, radius);
+	kernel->setArg(4, 5);
+	kernel->setArg(5, getFovFactor());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
+
+	kernel = getKernel("convolutionV");
+	kernel->setArg(0, rowImage->getCLBuffer());
+	kernel->setArg(1, outputImage.getCLBuffer());
+	kernel->setArg(2, columnKernel);
+	kernel->setArg(3, radius);
+	kernel->setArg(4, 5);
+	kernel->setArg(5, getFovFactor());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::convolution(OpenCLBufferManagedT<float> & conv, int radius, ofxDepthImage & outputImage) {
 
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		convolution(conv, radius, *scratch);
+		swap(*scratch);
+		return;
+	}
+
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
-	OpenCLKernelPtr kernel = getKernel("convolution");
+	if (isCpu("convolution")) {
+		ofxDepthCpu::convolution(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), &conv[0], radius, 5, getFovFactor());
+		outputImage.setHostModified();
+		return;
+	}
+
+	size_t localX, localY;
+	bool tiled = ofxDepth.getTileSize(getKernel("convolutionTiled"), radius, sizeof(unsigned short), localX, localY);
+
+	OpenCLKernelPtr kernel = getKernel(tiled ? "convolutionTiled" : "convolution");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
 	kernel->setArg(2, conv);
 	kernel->setArg(3, radius);
 	kernel->setArg(4, 5);
-	kernel->setArg(5, tanf(60 * DEG_TO_RAD)/height);
-	kernel->run2D(getWidth(), getHeight());
+	kernel->setArg(5, getFovFactor());
+	if (tiled)
+		runTiled(kernel, 6, radius, localX, localY);
+	else
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
+}
+
+void ofxDepthImage::bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage & outputImage) {
+	bilateral(radius, sigmaSpace, sigmaRange, nullptr, outputImage);
+}
+
+void ofxDepthImage::bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage & guide, ofxDepthImage & outputImage) {
+	bilateral(radius, sigmaSpace, sigmaRange, &guide, outputImage);
+}
+
+void ofxDepthImage::bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage * guide, ofxDepthImage & outputImage) {
+
+	if (radius < 1 || sigmaSpace <= 0.f || sigmaRange <= 0.f) {
+		if (&outputImage != this) {
+			if (!outputImage.isAllocated())
+				outputImage.allocate(getWidth(), getHeight());
+			copy(outputImage);
+		}
+		return;
+	}
+
+	// Neighbours would read pixels already overwritten, so write to scratch and swap
+	if (&outputImage == this) {
+		shared_ptr<ofxDepthImage> scratch = ofxDepth.getScratch<ofxDepthImage>(getWidth(), getHeight());
+		bilateral(radius, sigmaSpace, sigmaRange, guide, *scratch);
+		swap(*scratch);
+		return;
+	}
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(getWidth(), getHeight());
+
+	int diam = radius*2+1;
+	if ((int)bilateralSpaceWeights.size() != diam*diam || bilateralSigmaSpace != sigmaSpace) {
+		bilateralSpaceWeights.resize(diam*diam);
+		for (int y=-radius; y<=radius; y++) {
+			for (int x=-radius; x<=radius; x++)
+				bilateralSpaceWeights[(radius+y)*diam+radius+x] = expf(-(x*x + y*y) / (2.f * sigmaSpace * sigmaSpace));
+		}
+		bilateralSigmaSpace = sigmaSpace;
+		bilateralSpaceValid = false;
+	}
+
+	// 256 steps up to 3 sigma in units of sigma, the last entry cuts off anything further
+	if (bilateralRangeWeights.empty()) {
+		bilateralRangeWeights.resize(256);
+		for (int i=0; i<255; i++) {
+			float d = i * 3.f / 255.f;
+			bilateralRangeWeights[i] = expf(-0.5f * d * d);
+		}
+		bilateralRangeWeights[255] = 0.f;
+	}
+	float rangeScale = 255.f / (3.f * sigmaRange);
+
+	if (isCpu("bilateral")) {
+		const unsigned short * guideData = guide ? guide->getHostData() : getHostData();
+		ofxDepthCpu::bilateral(getHostData(), guideData, outputImage.getHostData(), getWidth(), getHeight(), bilateralSpaceWeights.data(), bilateralRangeWeights.data(), rangeScale, radius);
+		outputImage.setHostModified();
+		return;
+	}
+
+	if (!bilateralSpaceValid) {
+		bilateralSpace.initBuffer(diam*diam);
+		for (int k=0; k<diam*diam; k++)
+			bilateralSpace[k] = bilateralSpaceWeights[k];
+		ofxDepth.write(bilateralSpace.getCLBuffer(), &bilateralSpace[0], 0, diam*diam * sizeof(float), true);
+		bilateralSpaceValid = true;
+	}
+	if (!bilateralRangeValid) {
+		bilateralRange.initBuffer(256);
+		for (int k=0; k<256; k++)
+			bilateralRange[k] = bilateralRangeWeights[k];
+		ofxDepth.write(bilateralRange.getCLBuffer(), &bilateralRange[0], 0, 256 * sizeof(float), true);
+		bilateralRangeValid = true;
+	}
+
+	bool joint = guide != nullptr;
+	size_t localX, localY;
+	bool tiled = ofxDepth.getTileSize(getKernel("bilateralTiled"), radius, sizeof(unsigned short) * (joint ? 2 : 1), localX, localY);
+
+	OpenCLKernelPtr kernel = getKernel(tiled ? "bilateralTiled" : "bilateral");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, joint ? guide->getCLBuffer() : getCLBuffer());
+	kernel->setArg(2, outputImage.getCLBuffer());
+	kernel->setArg(3, bilateralSpace);
+	kernel->setArg(4, bilateralRange);
+	kernel->setArg(5, rangeScale);
+	kernel->setArg(6, radius);
+	if (tiled) {
+		kernel->setArg(7, (int)joint);
+		size_t guideBytes = joint ? (localX + 2 * radius) * (localY + 2 * radius) * sizeof(unsigned short) : sizeof(unsigned short);
+		kernel->setArg(11, NULL, guideBytes);
+		runTiled(kernel, 8, radius, localX, localY);
+	}
+	else
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin, uint16_t outputMax, ofxDepthImage & outputImage) {
@@ -395,6 +1008,12 @@ void ofxDepthImage::map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
+	if (isCpu("map")) {
+		ofxDepthCpu::map(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), inputMin, inputMax, outputMin, outputMax);
+		outputImage.setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("map");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, &inputMin, sizeof(uint16_t));
@@ -402,7 +1021,7 @@ void ofxDepthImage::map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin
 	kernel->setArg(3, &outputMin, sizeof(uint16_t));
 	kernel->setArg(4, &outputMax, sizeof(uint16_t));
 	kernel->setArg(5, outputImage.getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::accumulate(ofxDepthImage & outputImage, float amount, int threshold) {
@@ -410,12 +1029,18 @@ void ofxDepthImage::accumulate(ofxDepthImage & outputImage, float amount, int th
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
+	if (isCpu("accumulate")) {
+		ofxDepthCpu::accumulate(getHostData(), outputImage.getHostData(), getWidth(), getHeight(), amount, threshold);
+		outputImage.setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("accumulate");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, outputImage.getCLBuffer());
 	kernel->setArg(2, amount);
 	kernel->setArg(3, threshold);
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::stabilize(ofxDepthImage & meanImage, ofxDepthImageT<float>& varImage, ofxDepthImage & outputImage, float amount, float threshold) {
@@ -427,6 +1052,14 @@ void ofxDepthImage::stabilize(ofxDepthImage & meanImage, ofxDepthImageT<float>&
 	if (!outputImage.isAllocated())
 		outputImage.allocate(getWidth(), getHeight());
 
+	if (isCpu("stabilize")) {
+		ofxDepthCpu::stabilize(getHostData(), meanImage.getHostData(), varImage.getHostData(), outputImage.getHostData(), getWidth(), getHeight(), amount, threshold);
+		meanImage.setHostModified();
+		varImage.setHostModified();
+		outputImage.setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("stabilize");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, meanImage.getCLBuffer());
@@ -434,7 +1067,7 @@ void ofxDepthImage::stabilize(ofxDepthImage & meanImage, ofxDepthImageT<float>&
 	kernel->setArg(3, outputImage.getCLBuffer());
 	kernel->setArg(4, amount);
 	kernel->setArg(5, threshold);
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
 }
 
 void ofxDepthImage::subtract(ofxDepthImage & background, int threshold) {
@@ -442,12 +1075,22 @@ void ofxDepthImage::subtract(ofxDepthImage & background, int threshold) {
 	if (!background.isAllocated())
 		return;
 
+	if (isCpu("subtract")) {
+		ofxDepthCpu::subtract(getHostData(), background.getHostData(), getHostData(), getWidth(), getHeight(), threshold);
+		setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("subtract");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, background.getCLBuffer());
 	kernel->setArg(2, getCLBuffer());
 	kernel->setArg(3, threshold);
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
+}
+
+void ofxDepthImage::subtract(ofxDepthBackground & background) {
+	background.update(*this);
 }
 
 void ofxDepthImage::map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin, uint16_t outputMax) {
@@ -459,11 +1102,26 @@ void ofxDepthImage::toPoints(float fovH, float fovV, ofxDepthPoints & points) {
 	if (!points.isAllocated())
 		points.allocate(getNumElements());
 
-	OpenCLKernelPtr kernel = getKernel("pointsFromFov");
-	kernel->setArg(0, getCLBuffer());
-	kernel->setArg(1, ofVec2f(fovH, fovV));
-	kernel->setArg(2, points.getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	if (isCpu("toPoints")) {
+		ofxDepthCpu::pointsFromFov(getHostData(), getWidth(), getHeight(), fovH, fovV, (float*)points.getHostData());
+		points.setHostModified();
+		return;
+	}
+
+	// The angles only change with the field of view, so they are kept in a table
+	// for the current width and height, which can change without the number of pixels changing
+	bool resized = fovTable.getWidth() != getWidth() || fovTable.getHeight() != getHeight();
+	if (!fovTable.isAllocated() || resized || fovTableAngles != ofVec2f(fovH, fovV)) {
+		if (!fovTable.isAllocated() || resized)
+			fovTable.allocate(getWidth(), getHeight());
+		OpenCLKernelPtr kernel = getKernel("fovTable");
+		kernel->setArg(0, fovTable.getCLBuffer());
+		kernel->setArg(1, ofVec2f(fovH, fovV));
+		ofxDepth.run2D(kernel, getWidth(), getHeight());
+		fovTableAngles = ofVec2f(fovH, fovV);
+	}
+
+	toPoints(fovTable, points);
 }
 
 void ofxDepthImage::toPoints(ofxDepthTable & table, ofxDepthPoints & points) {
@@ -471,11 +1129,67 @@ void ofxDepthImage::toPoints(ofxDepthTable & table, ofxDepthPoints & points) {
 	if (!points.isAllocated())
 		points.allocate(getNumElements());
 
+	if (isCpu("toPoints")) {
+		ofxDepthCpu::pointsFromTable(getHostData(), (float*)table.getHostData(), getWidth(), getHeight(), (float*)points.getHostData());
+		points.setHostModified();
+		return;
+	}
+
 	OpenCLKernelPtr kernel = getKernel("pointsFromTable");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, table.getCLBuffer());
 	kernel->setArg(2, points.getCLBuffer());
-	kernel->run2D(getWidth(), getHeight());
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
+}
+
+void ofxDepthImage::toPoints(ofxDepthCamera & camera, ofxDepthPoints & points) {
+	toPoints(camera.getTable(), points);
+}
+
+void ofxDepthImage::toPoints(ofxDepthTable & table, const ofMatrix4x4 & mat, ofxDepthPoints & points) {
+
+	if (!points.isAllocated())
+		points.allocate(getNumElements());
+
+	if (isCpu("toPoints")) {
+		ofxDepthCpu::pointsFromTable(getHostData(), (float*)table.getHostData(), getWidth(), getHeight(), mat.getPtr(), (float*)points.getHostData());
+		points.setHostModified();
+		return;
+	}
+
+	// ofMatrix4x4 is 16 floats row by row, passed by value as float16
+	OpenCLKernelPtr kernel = getKernel("pointsFromTableTransform");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, table.getCLBuffer());
+	kernel->setArg(2, points.getCLBuffer());
+	kernel->setArg(3, mat);
+	ofxDepth.run2D(kernel, getWidth(), getHeight());
+}
+
+void ofxDepthImage::toPoints(ofxDepthCamera & camera, const ofMatrix4x4 & mat, ofxDepthPoints & points) {
+	toPoints(camera.getTable(), mat, points);
+}
+
+void ofxDepthImage::setFovFactor(float fovFactor) {
+	this->fovFactor = fovFactor;
+}
+
+void ofxDepthImage::setCamera(const ofxDepthCamera & camera) {
+	fovFactor = camera.getFovFactor();
+}
+
+float ofxDepthImage::getFovFactor() {
+	return fovFactor > 0.f ? fovFactor : tanf(60*DEG_TO_RAD)/getHeight();
+}
+
+void ofxDepthImage::runTiled(OpenCLKernelPtr kernel, int arg, int radius, size_t localX, size_t localY) {
+	int width = getWidth();
+	int height = getHeight();
+	size_t tileBytes = (localX + 2 * radius) * (localY + 2 * radius) * sizeof(unsigned short);
+	kernel->setArg(arg+0, width);
+	kernel->setArg(arg+1, height);
+	kernel->setArg(arg+2, NULL, tileBytes);
+	ofxDepth.run2D(kernel, (width + localX - 1) / localX * localX, (height + localY - 1) / localY * localY, localX, localY);
 }
 
 OpenCLKernelPtr ofxDepthImage::getKernel(string name) {
@@ -496,11 +1210,21 @@ OpenCLProgramPtr ofxDepthImage::getProgram() {
 		ofxDepth.loadKernel("dilate", program);
 		ofxDepth.loadKernel("blur", program);
 		ofxDepth.loadKernel("convolution", program);
+		ofxDepth.loadKernel("denoiseTiled", program);
+		ofxDepth.loadKernel("erodeTiled", program);
+		ofxDepth.loadKernel("dilateTiled", program);
+		ofxDepth.loadKernel("convolutionTiled", program);
+		ofxDepth.loadKernel("bilateral", program);
+		ofxDepth.loadKernel("bilateralTiled", program);
+		ofxDepth.loadKernel("convolutionH", program);
+		ofxDepth.loadKernel("convolutionV", program);
 		ofxDepth.loadKernel("map", program);
 		ofxDepth.loadKernel("accumulate", program);
 		ofxDepth.loadKernel("stabilize", program);
 		ofxDepth.loadKernel("subtract", program);
 		ofxDepth.loadKernel("pointsFromFov", program);
+		ofxDepth.loadKernel("fovTable", program);
+		ofxDepth.loadKernel("pointsFromTableTransform", program);
 		ofxDepth.loadKernel("pointsFromTable", program);
 		return program;
 	}
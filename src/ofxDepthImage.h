@@ -6,6 +6,8 @@
 using namespace msa;
 
 class ofxDepthPoints;
+class ofxDepthCamera;
+class ofxDepthBackground;
 
 template<typename T, class E = T>
 class ofxDepthImageT : public ofxDepthBufferT<T,E> {
@@ -21,19 +23,30 @@ public:
 		this->width = width;
 		this->height = height;
 	}
+	using ofxDepthBufferT<T,E>::write;
 	void write(ofPixels_<T> & p) {
 		ofxDepthBufferT<T,E>::write(p.getData(), p.getTotalBytes() / p.getBytesPerPixel());
 		width = p.getWidth();
 		height = p.getHeight();
 	}
 	void update(ofTexture & tex) {
-		glBuf.bind(GL_PIXEL_UNPACK_BUFFER);
+		if (this->isHostOnly()) {
+			tex.loadData((T*)this->getHostData(), getWidth(), getHeight(), GL_LUMINANCE);
+			return;
+		}
+		ofBufferObject & buf = this->getGLBuffer();
+		buf.bind(GL_PIXEL_UNPACK_BUFFER);
 		tex.loadData((T*)NULL, getWidth(), getHeight(), GL_LUMINANCE);
-		glBuf.unbind(GL_PIXEL_UNPACK_BUFFER);
+		buf.unbind(GL_PIXEL_UNPACK_BUFFER);
+	}
+	void swap(ofxDepthImageT & other) {
+		ofxDepthBuffer::swap(other);
+		std::swap(width, other.width);
+		std::swap(height, other.height);
 	}
 protected:
-	int width;
-	int height;
+	int width = 0;
+	int height = 0;
 };
 
 //////////////////////////////////////////////////
@@ -71,20 +84,59 @@ public:
 	void erode(int radius, float threshold, ofxDepthImage & outputImage);
 	void dilate(int radius, float threshold, ofxDepthImage & outputImage);
 	void blur(ofxDepthImage & outputImage);
+	void blur(float sigma, ofxDepthImage & outputImage);
+	void blur(int radius, float sigma, ofxDepthImage & outputImage);
 	void convolution(OpenCLBufferManagedT<float> & convKernel, int radius, ofxDepthImage & outputImage);
+	// Rows then columns. Depth edges are tested within each pass, so at discontinuities it differs from the 2D kernel
+	void convolution(OpenCLBufferManagedT<float> & rowKernel, OpenCLBufferManagedT<float> & columnKernel, int radius, ofxDepthImage & outputImage);
+	// Edge preserving smoothing, sigmaRange is in depth units or guide units when guided by an IR or grey image
+	void bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage & outputImage);
+	void bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage & guide, ofxDepthImage & outputImage);
+	// Scales valid pixels linearly between the ranges, an empty input range maps them to outputMin
 	void map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin = 0, uint16_t outputMax = USHRT_MAX);
 	void map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin, uint16_t outputMax, ofxDepthImage & outputImage);
 	void accumulate(ofxDepthImage & outputImage, float amount, int threshold);
 	void stabilize(ofxDepthImage & meanImage, ofxDepthImageT<float> & varImage, ofxDepthImage & outputImage, float amount, float threshold);
 	void subtract(ofxDepthImage & background, int threshold);
+	// Learns the background model from this frame and zeroes the pixels that match it
+	void subtract(ofxDepthBackground & background);
 
 	void toPoints(float fovH, float fovV, ofxDepthPoints & points);
 	void toPoints(ofxDepthTable & depthTable, ofxDepthPoints & points);
+	void toPoints(ofxDepthCamera & camera, ofxDepthPoints & points);
+	// Unprojects and transforms to world space in one pass
+	void toPoints(ofxDepthTable & depthTable, const ofMatrix4x4 & mat, ofxDepthPoints & points);
+	void toPoints(ofxDepthCamera & camera, const ofMatrix4x4 & mat, ofxDepthPoints & points);
+
+	// Size of a pixel at depth 1, which the discontinuity thresholds scale depth by. Defaults to a 60 degree sensor
+	void setFovFactor(float fovFactor);
+	void setCamera(const ofxDepthCamera & camera);
+	float getFovFactor();
 
 protected:
+	void runTiled(OpenCLKernelPtr kernel, int arg, int radius, size_t localX, size_t localY);
+	void bilateral(int radius, float sigmaSpace, float sigmaRange, ofxDepthImage * guide, ofxDepthImage & outputImage);
+
 	static OpenCLKernelPtr getKernel(string name);
 	static OpenCLProgramPtr getProgram();
 	static OpenCLProgramPtr program;
 
 	ofTexture tex;
+	float fovFactor = 0.f;
+
+	ofxDepthTable fovTable;
+	ofVec2f fovTableAngles;
+
+	// Weights are built on the host and only uploaded for the OpenCL path
+	vector<float> blurWeights;
+	float blurSigma = 0;
+	OpenCLBufferManagedT<float> blurKernel;
+	bool blurKernelValid = false;
+	vector<float> bilateralSpaceWeights;
+	vector<float> bilateralRangeWeights;
+	float bilateralSigmaSpace = 0;
+	OpenCLBufferManagedT<float> bilateralSpace;
+	OpenCLBufferManagedT<float> bilateralRange;
+	bool bilateralSpaceValid = false;
+	bool bilateralRangeValid = false;
 };
\ No newline at end of file
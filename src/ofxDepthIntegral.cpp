@@ -0,0 +1,317 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthIntegral.h"
+
+#define STRINGIFY(A) #A
+
+string depthIntegralProgram = STRINGIFY(
+
+// Work-group prefix sum of one value per work-item, returns the sum of all previous work-items
+void scanGroup(__local uint* lcount, __local ulong* lsum, __local ulong* lsq, uint* n, ulong* s, ulong* q) {
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+	lcount[lid] = *n;
+	lsum[lid] = *s;
+	lsq[lid] = *q;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset=1; offset<size; offset*=2) {
+		uint c = lid >= offset ? lcount[lid-offset] : 0;
+		ulong a = lid >= offset ? lsum[lid-offset] : 0;
+		ulong b = lid >= offset ? lsq[lid-offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		lcount[lid] += c;
+		lsum[lid] += a;
+		lsq[lid] += b;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	*n = lid > 0 ? lcount[lid-1] : 0;
+	*s = lid > 0 ? lsum[lid-1] : 0;
+	*q = lid > 0 ? lsq[lid-1] : 0;
+}
+
+// One work-group per row, each work-item scans a contiguous chunk
+__kernel void integralRows(__global unsigned short* input, __global uint* count, __global ulong* sum, __global ulong* sumSq, int width, __local uint* lcount, __local ulong* lsum, __local ulong* lsq) {
+	int y = get_global_id(1);
+	int size = get_local_size(0);
+	int chunk = (width + size - 1) / size;
+	int x0 = min((int)get_local_id(0) * chunk, width);
+	int x1 = min(x0 + chunk, width);
+	int row = y * width;
+
+	uint n = 0;
+	ulong s = 0;
+	ulong q = 0;
+	for (int x=x0; x<x1; x++) {
+		ulong d = input[row+x];
+		n += d != 0;
+		s += d;
+		q += d * d;
+	}
+
+	scanGroup(lcount, lsum, lsq, &n, &s, &q);
+
+	for (int x=x0; x<x1; x++) {
+		ulong d = input[row+x];
+		n += d != 0;
+		s += d;
+		q += d * d;
+		count[row+x] = n;
+		sum[row+x] = s;
+		sumSq[row+x] = q;
+	}
+}
+
+// One work-group per column, in place over the row sums
+__kernel void integralColumns(__global uint* count, __global ulong* sum, __global ulong* sumSq, int width, int height, __local uint* lcount, __local ulong* lsum, __local ulong* lsq) {
+	int x = get_global_id(1);
+	int size = get_local_size(0);
+	int chunk = (height + size - 1) / size;
+	int y0 = min((int)get_local_id(0) * chunk, height);
+	int y1 = min(y0 + chunk, height);
+
+	uint n = 0;
+	ulong s = 0;
+	ulong q = 0;
+	for (int y=y0; y<y1; y++) {
+		int i = y * width + x;
+		n += count[i];
+		s += sum[i];
+		q += sumSq[i];
+	}
+
+	scanGroup(lcount, lsum, lsq, &n, &s, &q);
+
+	for (int y=y0; y<y1; y++) {
+		int i = y * width + x;
+		n += count[i];
+		s += sum[i];
+		q += sumSq[i];
+		count[i] = n;
+		sum[i] = s;
+		sumSq[i] = q;
+	}
+}
+
+// Count, sum and sum of squares of the window around (cx, cy), clipped to the image
+void window(__global uint* count, __global ulong* sum, __global ulong* sumSq, int width, int height, int cx, int cy, int radius, uint* n, ulong* s, ulong* q) {
+	int x0 = max(cx - radius, 0) - 1;
+	int y0 = max(cy - radius, 0) - 1;
+	int x1 = min(cx + radius, width - 1);
+	int y1 = min(cy + radius, height - 1);
+	int i11 = y1 * width + x1;
+	int i01 = y1 * width + x0;
+	int i10 = y0 * width + x1;
+	int i00 = y0 * width + x0;
+	*n = count[i11];
+	*s = sum[i11];
+	*q = sumSq[i11];
+	if (x0 >= 0) {
+		*n -= count[i01];
+		*s -= sum[i01];
+		*q -= sumSq[i01];
+	}
+	if (y0 >= 0) {
+		*n -= count[i10];
+		*s -= sum[i10];
+		*q -= sumSq[i10];
+	}
+	if (x0 >= 0 && y0 >= 0) {
+		*n += count[i00];
+		*s += sum[i00];
+		*q += sumSq[i00];
+	}
+}
+
+// n^2 * variance in 128 bits, 64 bits overflow above 65536 valid pixels
+float windowVariance(uint n, ulong s, ulong q) {
+	ulong lo1 = (ulong)n * q;
+	ulong hi1 = mul_hi((ulong)n, q);
+	ulong lo2 = s * s;
+	ulong hi2 = mul_hi(s, s);
+	ulong lo = lo1 - lo2;
+	ulong hi = hi1 - hi2 - (lo1 < lo2 ? 1 : 0);
+	return ((float)hi * 18446744073709551616.f + (float)lo) / ((float)n * n);
+}
+
+__kernel void integralFill(__global unsigned short* input, __global unsigned short* output, __global uint* count, __global ulong* sum, __global ulong* sumSq, int radius, float threshold, float fov) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	int i = coords.y * width + coords.x;
+	unsigned short c = input[i];
+
+	if (c != 0) {
+		output[i] = c;
+		return;
+	}
+
+	uint n;
+	ulong s;
+	ulong q;
+	window(count, sum, sumSq, width, height, coords.x, coords.y, radius, &n, &s, &q);
+
+	int diam = radius*2+1;
+	if (n == 0 || n < (diam*diam)/2-1) {
+		output[i] = 0;
+		return;
+	}
+
+	unsigned short avg = s / n;
+	float zrt = fabs(avg * fov) * threshold;
+	if (sqrt(windowVariance(n, s, q)) < zrt)
+		output[i] = avg;
+	else
+		output[i] = 0;
+}
+
+__kernel void integralReject(__global unsigned short* input, __global unsigned short* output, __global uint* count, __global ulong* sum, __global ulong* sumSq, int radius, float minValid, float maxDeviation) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	int i = coords.y * width + coords.x;
+	unsigned short c = input[i];
+
+	if (c == 0) {
+		output[i] = 0;
+		return;
+	}
+
+	uint n;
+	ulong s;
+	ulong q;
+	window(count, sum, sumSq, width, height, coords.x, coords.y, radius, &n, &s, &q);
+
+	int diam = radius*2+1;
+	float mean = (float)s / n;
+	float deviation = sqrt(windowVariance(n, s, q));
+	if (n < minValid * diam * diam || fabs(c - mean) > maxDeviation * deviation)
+		output[i] = 0;
+	else
+		output[i] = c;
+}
+
+__kernel void integralStats(__global uint* count, __global ulong* sum, __global ulong* sumSq, __global float2* output, int radius) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int width = get_global_size(0);
+	int height = get_global_size(1);
+	int i = coords.y * width + coords.x;
+
+	uint n;
+	ulong s;
+	ulong q;
+	window(count, sum, sumSq, width, height, coords.x, coords.y, radius, &n, &s, &q);
+
+	if (n == 0)
+		output[i] = (float2)(0.f);
+	else
+		output[i] = (float2)((float)s / n, sqrt(windowVariance(n, s, q)));
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthIntegral::program;
+
+void ofxDepthIntegral::update(ofxDepthImage & image) {
+
+	width = image.getWidth();
+	height = image.getHeight();
+	if (count.getNumElements() != width * height) {
+		count.allocate(width * height);
+		sum.allocate(width * height);
+		sumSq.allocate(width * height);
+	}
+
+	OpenCLKernelPtr kernel = getKernel("integralRows");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, count.getCLBuffer());
+	kernel->setArg(2, sum.getCLBuffer());
+	kernel->setArg(3, sumSq.getCLBuffer());
+	kernel->setArg(4, width);
+	scan("integralRows", height);
+
+	kernel = getKernel("integralColumns");
+	kernel->setArg(0, count.getCLBuffer());
+	kernel->setArg(1, sum.getCLBuffer());
+	kernel->setArg(2, sumSq.getCLBuffer());
+	kernel->setArg(3, width);
+	kernel->setArg(4, height);
+	scan("integralColumns", width);
+}
+
+void ofxDepthIntegral::scan(string name, int lines) {
+	OpenCLKernelPtr kernel = getKernel(name);
+	size_t size = ofxDepth.getWorkGroupSize(kernel);
+
+	// Both scans take their local arrays as arguments 5-7
+	kernel->setArg(5, NULL, size * sizeof(cl_uint));
+	kernel->setArg(6, NULL, size * sizeof(cl_ulong));
+	kernel->setArg(7, NULL, size * sizeof(cl_ulong));
+	ofxDepth.run2D(kernel, size, lines, size, 1);
+}
+
+void ofxDepthIntegral::fill(ofxDepthImage & image, int radius, float threshold, ofxDepthImage & outputImage) {
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(width, height);
+
+	OpenCLKernelPtr kernel = getKernel("integralFill");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, outputImage.getCLBuffer());
+	kernel->setArg(2, count.getCLBuffer());
+	kernel->setArg(3, sum.getCLBuffer());
+	kernel->setArg(4, sumSq.getCLBuffer());
+	kernel->setArg(5, radius);
+	kernel->setArg(6, threshold);
+	kernel->setArg(7, image.getFovFactor());
+	ofxDepth.run2D(kernel, width, height);
+}
+
+void ofxDepthIntegral::reject(ofxDepthImage & image, int radius, float minValid, float maxDeviation, ofxDepthImage & outputImage) {
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(width, height);
+
+	OpenCLKernelPtr kernel = getKernel("integralReject");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, outputImage.getCLBuffer());
+	kernel->setArg(2, count.getCLBuffer());
+	kernel->setArg(3, sum.getCLBuffer());
+	kernel->setArg(4, sumSq.getCLBuffer());
+	kernel->setArg(5, radius);
+	kernel->setArg(6, minValid);
+	kernel->setArg(7, maxDeviation);
+	ofxDepth.run2D(kernel, width, height);
+}
+
+void ofxDepthIntegral::stats(int radius, ofxDepthImageT<float, ofVec2f> & outputImage) {
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(width, height);
+
+	OpenCLKernelPtr kernel = getKernel("integralStats");
+	kernel->setArg(0, count.getCLBuffer());
+	kernel->setArg(1, sum.getCLBuffer());
+	kernel->setArg(2, sumSq.getCLBuffer());
+	kernel->setArg(3, outputImage.getCLBuffer());
+	kernel->setArg(4, radius);
+	ofxDepth.run2D(kernel, width, height);
+}
+
+OpenCLKernelPtr ofxDepthIntegral::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthIntegral::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthIntegralProgram);
+		ofxDepth.loadKernel("integralRows", program);
+		ofxDepth.loadKernel("integralColumns", program);
+		ofxDepth.loadKernel("integralFill", program);
+		ofxDepth.loadKernel("integralReject", program);
+		ofxDepth.loadKernel("integralStats", program);
+		return program;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthBuffer.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+//////////////////////////////////////////////////
+// DEPTH INTEGRAL
+//
+// Summed-area tables of the valid pixel count, depth and squared depth
+// of a depth image, built with a parallel scan over rows then columns.
+// Window count, mean and variance then cost the same at any radius.
+
+class ofxDepthIntegral {
+public:
+	void update(ofxDepthImage & image);
+
+	int getWidth() const {
+		return width;
+	}
+	int getHeight() const {
+		return height;
+	}
+
+	// Fills empty pixels with the window mean, like ofxDepthImage::dilate
+	void fill(ofxDepthImage & image, int radius, float threshold, ofxDepthImage & outputImage);
+	// Clears pixels with less than minValid (0-1) of the window valid or further than maxDeviation standard deviations from the window mean
+	void reject(ofxDepthImage & image, int radius, float minValid, float maxDeviation, ofxDepthImage & outputImage);
+	// Window mean and standard deviation per pixel
+	void stats(int radius, ofxDepthImageT<float, ofVec2f> & outputImage);
+
+	ofxDepthBufferT<unsigned int> & getCount() {
+		return count;
+	}
+	ofxDepthBufferT<uint64_t> & getSum() {
+		return sum;
+	}
+	ofxDepthBufferT<uint64_t> & getSumSquared() {
+		return sumSq;
+	}
+
+protected:
+	void scan(string name, int lines);
+
+	int width = 0;
+	int height = 0;
+	ofxDepthBufferT<unsigned int> count;
+	ofxDepthBufferT<uint64_t> sum;
+	ofxDepthBufferT<uint64_t> sumSq;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
@@ -0,0 +1,72 @@
+#include "ofxDepthMappedFile.h"
+
+#ifdef TARGET_WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////
+
+ofxDepthMappedFile::~ofxDepthMappedFile() {
+	close();
+}
+
+bool ofxDepthMappedFile::open(string filepath) {
+	close();
+	string path = ofToDataPath(filepath);
+
+#ifdef TARGET_WIN32
+	fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		fileHandle = nullptr;
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	size = fileSize.QuadPart;
+	mapHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapHandle)
+		data = (const unsigned char*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	fstat(fd, &st);
+	size = st.st_size;
+	void * mapping = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (mapping != MAP_FAILED)
+		data = (const unsigned char*)mapping;
+#endif
+
+	if (!data) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void ofxDepthMappedFile::close() {
+#ifdef TARGET_WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapHandle)
+		CloseHandle(mapHandle);
+	if (fileHandle)
+		CloseHandle(fileHandle);
+	mapHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	if (data)
+		munmap((void*)data, size);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ofMain.h"
+
+//////////////////////////////////////////////////
+// DEPTH MAPPED FILE
+//
+// Read only memory mapping of a whole file
+
+class ofxDepthMappedFile {
+public:
+	~ofxDepthMappedFile();
+
+	bool open(string filepath);
+	void close();
+	bool isOpen() const {
+		return data != nullptr;
+	}
+
+	const unsigned char * getData() const {
+		return data;
+	}
+	size_t getSize() const {
+		return size;
+	}
+
+protected:
+	const unsigned char * data = nullptr;
+	size_t size = 0;
+#ifdef TARGET_WIN32
+	void * fileHandle = nullptr;
+	void * mapHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
@@ -0,0 +1,152 @@
+#include "ofxDepthPackedPoints.h"
+
+#define STRINGIFY(A) #A
+
+// Load and store for each packed format, points stay (0,0,0) when invalid
+string depthPackingProgram = STRINGIFY(
+
+void storePoint3f(__global float* points, int i, float4 p, float scale) {
+	vstore3(p.xyz, i, points);
+}
+
+float4 loadPoint3f(__global float* points, int i, float scale) {
+	return (float4)(vload3(i, points), 1.f);
+}
+
+void storePointHalf(__global half* points, int i, float4 p, float scale) {
+	vstore_half4(p, i, points);
+}
+
+float4 loadPointHalf(__global half* points, int i, float scale) {
+	return vload_half4(i, points);
+}
+
+void storePointShort(__global short* points, int i, float4 p, float scale) {
+	vstore4((short4)(convert_short3_sat_rte(p.xyz / scale), 1), i, points);
+}
+
+float4 loadPointShort(__global short* points, int i, float scale) {
+	short4 s = vload4(i, points);
+	return (float4)(convert_float3(s.xyz) * scale, 1.f);
+}
+);
+
+// Instantiated per format by replacing %format and %type
+string depthPackingKernels = STRINGIFY(
+
+__kernel void pointsFromFov%format(__global unsigned short* depth, float2 fov, __global %type* points, float scale) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int2 dims = (int2)(get_global_size(0), get_global_size(1));
+	float2 angle = fov * (((float2)(coords.x, coords.y) / (float2)(dims.x, dims.y)) - (float2)(0.5f));
+	int i = coords.y * dims.x + coords.x;
+	float d = (float)depth[i];
+	storePoint%format(points, i, (float4)(tan(radians(angle.x)) * d, tan(radians(angle.y)) * d, -d, 1.f), scale);
+}
+
+__kernel void pointsFromTable%format(__global unsigned short* depth, __global float2* table, __global %type* points, float scale) {
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	int i = coords.y * get_global_size(0) + coords.x;
+	float d = (float)depth[i];
+	storePoint%format(points, i, (float4)(table[i].x * d, table[i].y * d, -d, 1.f), scale);
+}
+
+__kernel void transform%format(__global %type* input, __global %type* output, float16 mat, float inputScale, float outputScale) {
+	int i = get_global_id(0);
+	float4 v = loadPoint%format(input, i, inputScale);
+	float4 p = v.x * mat.s0123 + v.y * mat.s4567 + v.z * mat.s89ab + mat.scdef;
+	p.w = 1.f;
+	storePoint%format(output, i, p, outputScale);
+}
+
+__kernel void pack%format(__global float4* input, __global %type* output, float scale) {
+	int i = get_global_id(0);
+	storePoint%format(output, i, input[i], scale);
+}
+
+__kernel void unpack%format(__global %type* input, __global float4* output, float scale) {
+	int i = get_global_id(0);
+	output[i] = loadPoint%format(input, i, scale);
+}
+);
+
+static string getFormatName(ofxDepthPointFormat format) {
+	switch (format) {
+	case OFX_DEPTH_POINTS_FLOAT3:
+		return "3f";
+	case OFX_DEPTH_POINTS_HALF4:
+		return "Half";
+	case OFX_DEPTH_POINTS_SHORT4:
+		return "Short";
+	default:
+		return "";
+	}
+}
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthPointPacking::program;
+
+OpenCLKernelPtr ofxDepthPointPacking::getKernel(string name, ofxDepthPointFormat format) {
+	getProgram();
+	return ofxDepth.getKernel(name + getFormatName(format));
+}
+
+void ofxDepthPointPacking::setVertexBuffer(ofVbo & vbo, ofBufferObject & buffer, ofxDepthPointFormat format) {
+	switch (format) {
+	case OFX_DEPTH_POINTS_FLOAT3:
+		vbo.setVertexBuffer(buffer, 3, sizeof(ofVec3f));
+		break;
+	case OFX_DEPTH_POINTS_HALF4:
+	case OFX_DEPTH_POINTS_SHORT4:
+		// ofVbo only knows float attributes, bindVertexFormat() replaces the pointer before each draw
+		vbo.setVertexBuffer(buffer, 4, 4 * sizeof(int16_t));
+		break;
+	default:
+		vbo.setVertexBuffer(buffer, 4, sizeof(ofVec4f));
+		break;
+	}
+}
+
+bool ofxDepthPointPacking::bindVertexFormat(ofVbo & vbo, ofBufferObject & buffer, ofxDepthPointFormat format) {
+	if (format != OFX_DEPTH_POINTS_HALF4 && format != OFX_DEPTH_POINTS_SHORT4)
+		return true;
+	// Without a VAO ofVbo sets its float pointers on every bind, and the fixed-function path has no position attribute
+	if (!ofIsGLProgrammableRenderer()) {
+		ofLogError("ofxDepthPointPacking") << "bindVertexFormat(): half and short points need the programmable renderer";
+		return false;
+	}
+	// Binding first lets ofVbo apply any pending changes to the VAO, so the packed pointer set after it stays
+	vbo.bind();
+	glBindBuffer(GL_ARRAY_BUFFER, buffer.getId());
+	glVertexAttribPointer(ofShader::POSITION_ATTRIBUTE, 4, format == OFX_DEPTH_POINTS_HALF4 ? GL_HALF_FLOAT : GL_SHORT, GL_FALSE, 4 * sizeof(int16_t), 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	vbo.unbind();
+	return true;
+}
+
+OpenCLProgramPtr ofxDepthPointPacking::getProgram() {
+	if (program)
+		return program;
+	else {
+		ofxDepthPointFormat formats[] = {OFX_DEPTH_POINTS_FLOAT3, OFX_DEPTH_POINTS_HALF4, OFX_DEPTH_POINTS_SHORT4};
+		string types[] = {"float", "half", "short"};
+		string source = depthPackingProgram;
+		for (int f=0; f<3; f++) {
+			string kernels = depthPackingKernels;
+			ofStringReplace(kernels, "%format", getFormatName(formats[f]));
+			ofStringReplace(kernels, "%type", types[f]);
+			source += kernels;
+		}
+
+		program = ofxDepth.loadProgram(source);
+		for (int f=0; f<3; f++) {
+			string name = getFormatName(formats[f]);
+			ofxDepth.loadKernel("pointsFromFov" + name, program);
+			ofxDepth.loadKernel("pointsFromTable" + name, program);
+			ofxDepth.loadKernel("transform" + name, program);
+			ofxDepth.loadKernel("pack" + name, program);
+			ofxDepth.loadKernel("unpack" + name, program);
+		}
+		return program;
+	}
+}
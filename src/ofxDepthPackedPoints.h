@@ -0,0 +1,173 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthCore.h"
+#include "ofxDepthPoints.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+enum ofxDepthPointFormat {
+	OFX_DEPTH_POINTS_FLOAT4,
+	OFX_DEPTH_POINTS_FLOAT3,
+	OFX_DEPTH_POINTS_HALF4,
+	OFX_DEPTH_POINTS_SHORT4
+};
+
+struct ofxDepthHalf4 {
+	uint16_t x;
+	uint16_t y;
+	uint16_t z;
+	uint16_t w;
+};
+
+// Fixed point, position = value * scale
+struct ofxDepthShort4 {
+	int16_t x;
+	int16_t y;
+	int16_t z;
+	int16_t w;
+};
+
+template<class E> struct ofxDepthPointTraits;
+
+template<> struct ofxDepthPointTraits<ofVec3f> {
+	typedef float type;
+	static const ofxDepthPointFormat format = OFX_DEPTH_POINTS_FLOAT3;
+};
+
+template<> struct ofxDepthPointTraits<ofxDepthHalf4> {
+	typedef uint16_t type;
+	static const ofxDepthPointFormat format = OFX_DEPTH_POINTS_HALF4;
+};
+
+template<> struct ofxDepthPointTraits<ofxDepthShort4> {
+	typedef int16_t type;
+	static const ofxDepthPointFormat format = OFX_DEPTH_POINTS_SHORT4;
+};
+
+//////////////////////////////////////////////////
+// POINT PACKING
+//
+// Kernels and vertex attribute setup shared by the packed point formats.
+// Half and short points draw with the programmable renderer only
+
+class ofxDepthPointPacking {
+public:
+	static OpenCLKernelPtr getKernel(string name, ofxDepthPointFormat format);
+	static void setVertexBuffer(ofVbo & vbo, ofBufferObject & buffer, ofxDepthPointFormat format);
+	// Points the VAO at the packed type right before drawing, false if the renderer cannot draw it
+	static bool bindVertexFormat(ofVbo & vbo, ofBufferObject & buffer, ofxDepthPointFormat format);
+
+protected:
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
+
+//////////////////////////////////////////////////
+// PACKED DEPTH POINTS
+//
+// Points in a smaller vertex format than ofxDepthPoints: tight float3 (12 bytes),
+// half4 (8 bytes) or int16 xyz with a scale (8 bytes). Use pack/unpack to
+// exchange with ofxDepthPoints for meshing and compaction.
+
+template<class E>
+class ofxDepthPackedPointsT : public ofxDepthPointsT<typename ofxDepthPointTraits<E>::type, E> {
+public:
+	static const ofxDepthPointFormat format = ofxDepthPointTraits<E>::format;
+
+	void allocate(int numVertices) {
+		if (ofxDepth.getBackend() == OFX_DEPTH_BACKEND_OPENCL)
+			ofxDepth.setup();
+		ofxDepthBuffer::allocate(numVertices);
+		if (!this->isHostOnly())
+			ofxDepthPointPacking::setVertexBuffer(vbo, this->getGLBuffer(), format);
+	}
+
+	// Size of one int16 unit in depth units, e.g. 0.5 covers +-16 m in mm
+	void setScale(float scale) {
+		this->scale = scale;
+	}
+	float getScale() const {
+		return scale;
+	}
+
+	void fromImage(ofxDepthImage & image, float fovH, float fovV) {
+		if (!this->isAllocated())
+			allocate(image.getNumElements());
+		OpenCLKernelPtr kernel = ofxDepthPointPacking::getKernel("pointsFromFov", format);
+		kernel->setArg(0, image.getCLBuffer());
+		kernel->setArg(1, ofVec2f(fovH, fovV));
+		kernel->setArg(2, this->getCLBuffer());
+		kernel->setArg(3, scale);
+		ofxDepth.run2D(kernel, image.getWidth(), image.getHeight());
+	}
+
+	void fromImage(ofxDepthImage & image, ofxDepthTable & table) {
+		if (!this->isAllocated())
+			allocate(image.getNumElements());
+		OpenCLKernelPtr kernel = ofxDepthPointPacking::getKernel("pointsFromTable", format);
+		kernel->setArg(0, image.getCLBuffer());
+		kernel->setArg(1, table.getCLBuffer());
+		kernel->setArg(2, this->getCLBuffer());
+		kernel->setArg(3, scale);
+		ofxDepth.run2D(kernel, image.getWidth(), image.getHeight());
+	}
+
+	void transform(const ofMatrix4x4 & mat) {
+		transform(mat, *this);
+	}
+
+	void transform(const ofMatrix4x4 & mat, ofxDepthPackedPointsT<E> & outputPoints) {
+		if (!outputPoints.isAllocated())
+			outputPoints.allocate(this->getNumElements());
+		OpenCLKernelPtr kernel = ofxDepthPointPacking::getKernel("transform", format);
+		kernel->setArg(0, this->getCLBuffer());
+		kernel->setArg(1, outputPoints.getCLBuffer());
+		kernel->setArg(2, mat);
+		kernel->setArg(3, scale);
+		kernel->setArg(4, outputPoints.getScale());
+		ofxDepth.run1D(kernel, this->getNumElements());
+	}
+
+	void pack(ofxDepthPoints & points) {
+		if (!this->isAllocated())
+			allocate(points.getNumElements());
+		OpenCLKernelPtr kernel = ofxDepthPointPacking::getKernel("pack", format);
+		kernel->setArg(0, points.getCLBuffer());
+		kernel->setArg(1, this->getCLBuffer());
+		kernel->setArg(2, scale);
+		ofxDepth.run1D(kernel, this->getNumElements());
+	}
+
+	void unpack(ofxDepthPoints & points) {
+		if (!points.isAllocated())
+			points.allocate(this->getNumElements());
+		OpenCLKernelPtr kernel = ofxDepthPointPacking::getKernel("unpack", format);
+		kernel->setArg(0, this->getCLBuffer());
+		kernel->setArg(1, points.getCLBuffer());
+		kernel->setArg(2, scale);
+		ofxDepth.run1D(kernel, this->getNumElements());
+	}
+
+	void draw() {
+		if (!ofxDepthPointPacking::bindVertexFormat(vbo, this->getGLBuffer(), format))
+			return;
+		if (format == OFX_DEPTH_POINTS_SHORT4) {
+			ofPushMatrix();
+			ofScale(scale, scale, scale);
+			vbo.draw(GL_POINTS, 0, this->getNumElements());
+			ofPopMatrix();
+		}
+		else
+			vbo.draw(GL_POINTS, 0, this->getNumElements());
+	}
+
+protected:
+	ofVbo vbo;
+	float scale = 1.f;
+};
+
+typedef ofxDepthPackedPointsT<ofVec3f> ofxDepthPoints3f;
+typedef ofxDepthPackedPointsT<ofxDepthHalf4> ofxDepthPointsHalf;
+typedef ofxDepthPackedPointsT<ofxDepthShort4> ofxDepthPointsShort;
@@ -0,0 +1,430 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthPoints.h"
+#include "ofxDepthPipeline.h"
+#include "ofxDepthCamera.h"
+
+//////////////////////////////////////////////////
+
+std::map<string, OpenCLKernelPtr> ofxDepthPipeline::kernels;
+
+ofxDepthPipeline & ofxDepthPipeline::limit(int min, int max) {
+	return addStage(STAGE_LIMIT, min, max, 0, 0, 0, 0, 0);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin, uint16_t outputMax) {
+	return addStage(STAGE_MAP, inputMin, inputMax, outputMin, outputMax, 0, 0, 0);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::subtract(ofxDepthImage & background, int threshold) {
+	return addStage(STAGE_SUBTRACT, threshold, 0, 0, 0, 0, 0, 0, &background);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::accumulate(ofxDepthImage & accumImage, float amount, int threshold) {
+	return addStage(STAGE_ACCUMULATE, threshold, 0, 0, 0, amount, 0, 0, &accumImage);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::denoise(float threshold, int neighbours) {
+	return addStage(STAGE_DENOISE, neighbours, 0, 0, 0, threshold, 0, 0);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::erode(int radius, float threshold) {
+	return addStage(STAGE_ERODE, radius, 0, 0, 0, threshold, 0, 0);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::dilate(int radius, float threshold) {
+	return addStage(STAGE_DILATE, radius, 0, 0, 0, threshold, 0, 0);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::toPoints(float fovH, float fovV, ofxDepthPoints & points) {
+	return addStage(STAGE_POINTS_FOV, 0, 0, 0, 0, fovH, fovV, 0, &points);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::toPoints(ofxDepthTable & table, ofxDepthPoints & points) {
+	return addStage(STAGE_POINTS_TABLE, 0, 0, 0, 0, 0, 0, 0, &table, &points);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::toPoints(ofxDepthCamera & camera, ofxDepthPoints & points) {
+	return toPoints(camera.getTable(), points);
+}
+
+void ofxDepthPipeline::clear() {
+	stages.clear();
+	segmentsDirty = true;
+}
+
+int ofxDepthPipeline::getNumStages() const {
+	return stages.size();
+}
+
+int ofxDepthPipeline::getNumKernels() const {
+	return segments.size();
+}
+
+void ofxDepthPipeline::run(ofxDepthImage & image) {
+	run(image, image);
+}
+
+void ofxDepthPipeline::run(ofxDepthImage & inputImage, ofxDepthImage & outputImage) {
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(inputImage.getWidth(), inputImage.getHeight());
+
+	updateSegments();
+
+	int width = inputImage.getWidth();
+	int height = inputImage.getHeight();
+	float fov = inputImage.getFovFactor();
+
+	for (Stage & stage : stages) {
+		ofxDepthBuffer * points = stage.type == STAGE_POINTS_FOV ? stage.buffer[0] : stage.type == STAGE_POINTS_TABLE ? stage.buffer[1] : nullptr;
+		if (points && !points->isAllocated())
+			((ofxDepthPoints*)points)->allocate(width * height);
+		if (stage.type == STAGE_ACCUMULATE && !stage.buffer[0]->isAllocated())
+			((ofxDepthImage*)stage.buffer[0])->allocate(width, height);
+	}
+
+	shared_ptr<ofxDepthImage> temp[2];
+
+	ofxDepthImage * input = &inputImage;
+	for (size_t s=0; s<segments.size(); s++) {
+		Segment & segment = segments[s];
+		bool last = s == segments.size()-1;
+
+		// A stencil must not write the buffer it reads its neighbours from
+		ofxDepthImage * output = &outputImage;
+		if (!last || (segment.stencil >= 0 && output == input)) {
+			if (!temp[s % 2])
+				temp[s % 2] = ofxDepth.getScratch<ofxDepthImage>(width, height);
+			output = temp[s % 2].get();
+		}
+
+		OpenCLKernelPtr kernel = getKernel(segment);
+		int arg = 0;
+		kernel->setArg(arg++, input->getCLBuffer());
+		kernel->setArg(arg++, output->getCLBuffer());
+		for (int k : segment.pre)
+			setArgs(kernel, k, arg, fov);
+		if (segment.stencil >= 0)
+			setArgs(kernel, segment.stencil, arg, fov);
+		for (int k : segment.post)
+			setArgs(kernel, k, arg, fov);
+		ofxDepth.run2D(kernel, width, height);
+
+		input = output;
+	}
+
+	// A result in scratch is swapped in, the old output storage goes back to the pool
+	if (input == &inputImage && input != &outputImage)
+		input->copy(outputImage);
+	else if (input != &outputImage)
+		outputImage.swap(*input);
+}
+
+ofxDepthPipeline & ofxDepthPipeline::addStage(StageType type, int p0, int p1, int p2, int p3, float v0, float v1, float v2, ofxDepthBuffer * b0, ofxDepthBuffer * b1) {
+	Stage stage;
+	stage.type = type;
+	stage.param[0] = p0;
+	stage.param[1] = p1;
+	stage.param[2] = p2;
+	stage.param[3] = p3;
+	stage.value[0] = v0;
+	stage.value[1] = v1;
+	stage.value[2] = v2;
+	stage.buffer[0] = b0;
+	stage.buffer[1] = b1;
+	stages.push_back(stage);
+	segmentsDirty = true;
+	return *this;
+}
+
+void ofxDepthPipeline::updateSegments() {
+	if (!segmentsDirty)
+		return;
+
+	segments.clear();
+	segments.push_back(Segment());
+	for (size_t k=0; k<stages.size(); k++) {
+		StageType type = stages[k].type;
+		Segment & segment = segments.back();
+		bool open = segment.stencil < 0 && segment.post.empty();
+		if (isStencil(type)) {
+			if (!open) {
+				segments.push_back(Segment());
+			}
+			segments.back().stencil = k;
+		}
+		else if (isStateless(type) && open) {
+			segment.pre.push_back(k);
+		}
+		else {
+			segment.post.push_back(k);
+		}
+	}
+	segmentsDirty = false;
+}
+
+bool ofxDepthPipeline::isStencil(StageType type) {
+	return type == STAGE_DENOISE || type == STAGE_ERODE || type == STAGE_DILATE;
+}
+
+bool ofxDepthPipeline::isStateless(StageType type) {
+	return type == STAGE_LIMIT || type == STAGE_MAP || type == STAGE_SUBTRACT;
+}
+
+string ofxDepthPipeline::getSource(const Segment & segment, string kernelName) {
+	string loadArgs = "__global unsigned short* input, int j";
+	string loadCall = "input, %1";
+	for (int k : segment.pre) {
+		loadArgs += getArgs(k);
+		string names = getArgs(k);
+		// Strip the types from the parameter list to get the call arguments
+		vector<string> parts = ofSplitString(names, ",", true, true);
+		for (string & part : parts) {
+			loadCall += ", " + ofSplitString(part, " ", true, true).back();
+		}
+	}
+
+	string source;
+	source += "unsigned short load(" + loadArgs + ") {\n";
+	source += "	unsigned short v = input[j];\n";
+	for (int k : segment.pre)
+		source += getPointwise(k, "j");
+	source += "	return v;\n";
+	source += "}\n\n";
+
+	source += "__kernel void " + kernelName + "(__global unsigned short* input, __global unsigned short* output";
+	for (int k : segment.pre)
+		source += getArgs(k);
+	if (segment.stencil >= 0)
+		source += getArgs(segment.stencil);
+	for (int k : segment.post)
+		source += getArgs(k);
+	source += ") {\n";
+	source += "	int2 coords = (int2)(get_global_id(0), get_global_id(1));\n";
+	source += "	int width = get_global_size(0);\n";
+	source += "	int height = get_global_size(1);\n";
+	source += "	int i = coords.y * width + coords.x;\n";
+
+	string load = "load(" + loadCall + ")";
+	if (segment.stencil >= 0) {
+		source += "	unsigned short v;\n";
+		source += getStencil(segment.stencil, load);
+	}
+	else {
+		string center = load;
+		ofStringReplace(center, "%1", "i");
+		source += "	unsigned short v = " + center + ";\n";
+	}
+	for (int k : segment.post)
+		source += getPointwise(k, "i");
+	source += "	output[i] = v;\n";
+	source += "}\n";
+	return source;
+}
+
+string ofxDepthPipeline::getArgs(int k) {
+	string n = ofToString(k);
+	switch (stages[k].type) {
+	case STAGE_LIMIT:
+		return ", int min" + n + ", int max" + n;
+	case STAGE_MAP:
+		return ", int imin" + n + ", int imax" + n + ", int omin" + n + ", int omax" + n;
+	case STAGE_SUBTRACT:
+		return ", __global unsigned short* background" + n + ", int threshold" + n;
+	case STAGE_ACCUMULATE:
+		return ", __global unsigned short* accum" + n + ", float amount" + n + ", int threshold" + n;
+	case STAGE_DENOISE:
+		return ", float threshold" + n + ", int neighbours" + n;
+	case STAGE_ERODE:
+	case STAGE_DILATE:
+		return ", int radius" + n + ", float threshold" + n + ", float fov" + n;
+	case STAGE_POINTS_FOV:
+		return ", float2 fov" + n + ", __global float4* points" + n;
+	case STAGE_POINTS_TABLE:
+		return ", __global float2* table" + n + ", __global float4* points" + n;
+	}
+	return "";
+}
+
+string ofxDepthPipeline::getPointwise(int k, string i) {
+	string n = ofToString(k);
+	switch (stages[k].type) {
+	case STAGE_LIMIT:
+		return "	if (v < min" + n + " || v > max" + n + ") v = 0;\n";
+	case STAGE_MAP:
+		// Same 64 bit arithmetic and empty range as the map kernel, so fused and unfused results match
+		return "	if (v != 0) v = imax" + n + " == imin" + n + " ? omin" + n + " : (((long)v - imin" + n + ") * ((long)omax" + n + " - omin" + n + ")) / ((long)imax" + n + " - imin" + n + ") + omin" + n + ";\n";
+	case STAGE_SUBTRACT:
+		return "	if (!(background" + n + "[" + i + "] == 0 || background" + n + "[" + i + "] - v > threshold" + n + ")) v = 0;\n";
+	case STAGE_ACCUMULATE:
+		return
+			"	{\n"
+			"		unsigned short a = accum" + n + "[" + i + "];\n"
+			"		if (v > 0) {\n"
+			"			if (a == 0 || abs(v - a) > threshold" + n + ")\n"
+			"				a = v;\n"
+			"			else\n"
+			"				a = a * (1-amount" + n + ") + v * amount" + n + ";\n"
+			"			accum" + n + "[" + i + "] = a;\n"
+			"		}\n"
+			"		v = a;\n"
+			"	}\n";
+	case STAGE_POINTS_FOV:
+		return
+			"	{\n"
+			"		float2 angle = fov" + n + " * (((float2)(coords.x, coords.y) / (float2)(width, height)) - (float2)(0.5f));\n"
+			"		points" + n + "[" + i + "] = (float4)(tan(radians(angle.x)) * v, tan(radians(angle.y)) * v, -(float)v, 1.f);\n"
+			"	}\n";
+	case STAGE_POINTS_TABLE:
+		return "	points" + n + "[" + i + "] = (float4)(table" + n + "[" + i + "].x * v, table" + n + "[" + i + "].y * v, -(float)v, 1.f);\n";
+	default:
+		return "";
+	}
+}
+
+string ofxDepthPipeline::getStencil(int k, string load) {
+	string n = ofToString(k);
+	string center = load;
+	string neighbour = load;
+	ofStringReplace(center, "%1", "i");
+	ofStringReplace(neighbour, "%1", "y * width + x");
+
+	// Same tests as the depthImageProgram kernels, with out-of-image neighbours skipped
+	switch (stages[k].type) {
+	case STAGE_DENOISE:
+		return
+			"	{\n"
+			"		unsigned short c = " + center + ";\n"
+			"		int xmin = coords.x >= 2 ? coords.x-2 : 0;\n"
+			"		int xmax = coords.x < width-2 ? coords.x+2 : width-2;\n"
+			"		int ymin = coords.y >= 2 ? coords.y-2 : 0;\n"
+			"		int ymax = coords.y < height-2 ? coords.y+2 : height-2;\n"
+			"		int sum = 0;\n"
+			"		for (int y=ymin; y<=ymax; y++) {\n"
+			"			for (int x=xmin; x<=xmax; x++) {\n"
+			"				if (y * width + x != i && abs(c - " + neighbour + ") < threshold" + n + ")\n"
+			"					sum++;\n"
+			"			}\n"
+			"		}\n"
+			"		v = sum < neighbours" + n + " ? 0 : c;\n"
+			"	}\n";
+	case STAGE_ERODE:
+		return
+			"	{\n"
+			"		unsigned short c = " + center + ";\n"
+			"		v = c;\n"
+			"		if (c != 0) {\n"
+			"			int diam = radius" + n + "*2+1;\n"
+			"			float zrt = fabs(c * fov" + n + ") * threshold" + n + ";\n"
+			"			int count = 0;\n"
+			"			for (int y=max(coords.y-radius" + n + ", 0); y<=min(coords.y+radius" + n + ", height-1); y++) {\n"
+			"				for (int x=max(coords.x-radius" + n + ", 0); x<=min(coords.x+radius" + n + ", width-1); x++) {\n"
+			"					unsigned short d = " + neighbour + ";\n"
+			"					if (d != 0 && abs(d - c) < zrt)\n"
+			"						count++;\n"
+			"				}\n"
+			"			}\n"
+			"			if (count < (diam*diam)/2)\n"
+			"				v = 0;\n"
+			"		}\n"
+			"	}\n";
+	case STAGE_DILATE:
+		return
+			"	{\n"
+			"		unsigned short c = " + center + ";\n"
+			"		v = c;\n"
+			"		if (c == 0) {\n"
+			"			int diam = radius" + n + "*2+1;\n"
+			"			int count = 0;\n"
+			"			unsigned long sum = 0;\n"
+			"			for (int y=max(coords.y-radius" + n + ", 0); y<=min(coords.y+radius" + n + ", height-1); y++) {\n"
+			"				for (int x=max(coords.x-radius" + n + ", 0); x<=min(coords.x+radius" + n + ", width-1); x++) {\n"
+			"					unsigned short d = " + neighbour + ";\n"
+			"					if (d != 0) {\n"
+			"						count++;\n"
+			"						sum += d;\n"
+			"					}\n"
+			"				}\n"
+			"			}\n"
+			"			if (count > 0 && count >= (diam*diam)/2-1) {\n"
+			"				unsigned short avg = sum / count;\n"
+			"				float zrt = fabs(avg * fov" + n + ") * threshold" + n + ";\n"
+			"				sum = 0;\n"
+			"				for (int y=max(coords.y-radius" + n + ", 0); y<=min(coords.y+radius" + n + ", height-1); y++) {\n"
+			"					for (int x=max(coords.x-radius" + n + ", 0); x<=min(coords.x+radius" + n + ", width-1); x++) {\n"
+			"						unsigned short d = " + neighbour + ";\n"
+			"						if (d != 0) {\n"
+			"							unsigned long e = d - avg;\n"
+			"							sum += e * e;\n"
+			"						}\n"
+			"					}\n"
+			"				}\n"
+			"				if (sqrt((float)sum / count) < zrt)\n"
+			"					v = avg;\n"
+			"			}\n"
+			"		}\n"
+			"	}\n";
+	default:
+		return "";
+	}
+}
+
+void ofxDepthPipeline::setArgs(OpenCLKernelPtr kernel, int k, int & arg, float fov) {
+	Stage & stage = stages[k];
+	switch (stage.type) {
+	case STAGE_LIMIT:
+		kernel->setArg(arg++, stage.param[0]);
+		kernel->setArg(arg++, stage.param[1]);
+		break;
+	case STAGE_MAP:
+		kernel->setArg(arg++, stage.param[0]);
+		kernel->setArg(arg++, stage.param[1]);
+		kernel->setArg(arg++, stage.param[2]);
+		kernel->setArg(arg++, stage.param[3]);
+		break;
+	case STAGE_SUBTRACT:
+		kernel->setArg(arg++, stage.buffer[0]->getCLBuffer());
+		kernel->setArg(arg++, stage.param[0]);
+		break;
+	case STAGE_ACCUMULATE:
+		kernel->setArg(arg++, stage.buffer[0]->getCLBuffer());
+		kernel->setArg(arg++, stage.value[0]);
+		kernel->setArg(arg++, stage.param[0]);
+		break;
+	case STAGE_DENOISE:
+		kernel->setArg(arg++, stage.value[0]);
+		kernel->setArg(arg++, stage.param[0]);
+		break;
+	case STAGE_ERODE:
+	case STAGE_DILATE:
+		kernel->setArg(arg++, stage.param[0]);
+		kernel->setArg(arg++, stage.value[0]);
+		kernel->setArg(arg++, fov);
+		break;
+	case STAGE_POINTS_FOV:
+		kernel->setArg(arg++, ofVec2f(stage.value[0], stage.value[1]));
+		kernel->setArg(arg++, stage.buffer[0]->getCLBuffer());
+		break;
+	case STAGE_POINTS_TABLE:
+		kernel->setArg(arg++, stage.buffer[0]->getCLBuffer());
+		kernel->setArg(arg++, stage.buffer[1]->getCLBuffer());
+		break;
+	}
+}
+
+OpenCLKernelPtr ofxDepthPipeline::getKernel(const Segment & segment) {
+	// The kernel name is not part of the cache key, so build with a placeholder first
+	string source = getSource(segment, "%kernel");
+	auto it = kernels.find(source);
+	if (it != kernels.end())
+		return it->second;
+
+	string name = "depthPipeline" + ofToString(kernels.size());
+	string named = source;
+	ofStringReplace(named, "%kernel", name);
+	OpenCLProgramPtr program = ofxDepth.loadProgram(named);
+	ofxDepth.loadKernel(name, program);
+	OpenCLKernelPtr kernel = ofxDepth.getKernel(name);
+	kernels[source] = kernel;
+	return kernel;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+class ofxDepthPoints;
+class ofxDepthCamera;
+
+//////////////////////////////////////////////////
+// DEPTH PIPELINE
+//
+// Chain of depth image operations fused into as few OpenCL kernels as
+// possible. Pointwise operations before a stencil are applied to every
+// neighbour the stencil reads, so a kernel ends only where a stencil
+// would need the result of another stencil. Kernels are cached by their
+// generated source, so the chain can be rebuilt every frame with new
+// parameters without recompiling.
+
+class ofxDepthPipeline {
+public:
+	ofxDepthPipeline & limit(int min, int max);
+	ofxDepthPipeline & map(uint16_t inputMin, uint16_t inputMax, uint16_t outputMin = 0, uint16_t outputMax = USHRT_MAX);
+	ofxDepthPipeline & subtract(ofxDepthImage & background, int threshold);
+	ofxDepthPipeline & accumulate(ofxDepthImage & accumImage, float amount, int threshold);
+	ofxDepthPipeline & denoise(float threshold, int neighbours = 1);
+	ofxDepthPipeline & erode(int radius, float threshold);
+	ofxDepthPipeline & dilate(int radius, float threshold);
+	ofxDepthPipeline & toPoints(float fovH, float fovV, ofxDepthPoints & points);
+	ofxDepthPipeline & toPoints(ofxDepthTable & depthTable, ofxDepthPoints & points);
+	ofxDepthPipeline & toPoints(ofxDepthCamera & camera, ofxDepthPoints & points);
+
+	void clear();
+	int getNumStages() const;
+	int getNumKernels() const;
+
+	void run(ofxDepthImage & image);
+	void run(ofxDepthImage & inputImage, ofxDepthImage & outputImage);
+
+protected:
+	enum StageType {
+		STAGE_LIMIT,
+		STAGE_MAP,
+		STAGE_SUBTRACT,
+		STAGE_ACCUMULATE,
+		STAGE_DENOISE,
+		STAGE_ERODE,
+		STAGE_DILATE,
+		STAGE_POINTS_FOV,
+		STAGE_POINTS_TABLE
+	};
+
+	struct Stage {
+		StageType type;
+		int param[4];
+		float value[3];
+		ofxDepthBuffer * buffer[2];
+	};
+
+	struct Segment {
+		vector<int> pre;
+		int stencil = -1;
+		vector<int> post;
+	};
+
+	ofxDepthPipeline & addStage(StageType type, int p0, int p1, int p2, int p3, float v0, float v1, float v2, ofxDepthBuffer * b0 = nullptr, ofxDepthBuffer * b1 = nullptr);
+	void updateSegments();
+
+	static bool isStencil(StageType type);
+	static bool isStateless(StageType type);
+
+	string getSource(const Segment & segment, string kernelName);
+	string getArgs(int k);
+	string getPointwise(int k, string index);
+	string getStencil(int k, string load);
+	void setArgs(OpenCLKernelPtr kernel, int k, int & arg, float fov);
+	OpenCLKernelPtr getKernel(const Segment & segment);
+
+	vector<Stage> stages;
+	vector<Segment> segments;
+	bool segmentsDirty = true;
+
+	static std::map<string, OpenCLKernelPtr> kernels;
+};
@@ -0,0 +1,554 @@
+#include "ofxDepthPointFile.h"
+
+#define STRINGIFY(A) #A
+
+string depthPointFileProgram = STRINGIFY(
+
+float loadFloat(__global uchar* data, ulong offset) {
+	return as_float(vload4(0, data + offset));
+}
+
+// Gathers x, y and z from any interleaved or planar layout of 32 bit floats
+__kernel void gatherPoints(__global uchar* data, __global float4* points, ulong baseX, ulong baseY, ulong baseZ, ulong strideX, ulong strideY, ulong strideZ) {
+	ulong i = get_global_id(0);
+	points[i] = (float4)(loadFloat(data, baseX + i * strideX), loadFloat(data, baseY + i * strideY), loadFloat(data, baseZ + i * strideZ), 1.f);
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthPointFile::program;
+std::mutex ofxDepthPointFile::writerMutex;
+std::condition_variable ofxDepthPointFile::writerCondition;
+std::deque<shared_ptr<ofxDepthPointFile::Job> > ofxDepthPointFile::jobs;
+bool ofxDepthPointFile::writing = false;
+
+static size_t getTypeSize(const string & type) {
+	if (type == "char" || type == "uchar" || type == "int8" || type == "uint8")
+		return 1;
+	if (type == "short" || type == "ushort" || type == "int16" || type == "uint16")
+		return 2;
+	if (type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" || type == "float32")
+		return 4;
+	if (type == "double" || type == "float64")
+		return 8;
+	return 0;
+}
+
+// Next line of the header, false at the end of the file
+static bool getLine(const unsigned char * data, size_t size, size_t & pos, string & line) {
+	if (pos >= size)
+		return false;
+	const unsigned char * start = data + pos;
+	const unsigned char * end = (const unsigned char*)memchr(start, '\n', size - pos);
+	size_t length = end ? end - start : size - pos;
+	line.assign((const char*)start, length);
+	if (!line.empty() && line.back() == '\r')
+		line.pop_back();
+	// A last line without a newline ends at the file size, never past it
+	pos += end ? length + 1 : length;
+	return true;
+}
+
+bool ofxDepthPointFile::load(string filepath, ofxDepthPoints & points) {
+	ofxDepthMappedFile file;
+	Layout layout;
+	vector<unsigned char> decompressed;
+	const unsigned char * data;
+	size_t size;
+	if (!parse(file, filepath, layout, decompressed, data, size))
+		return false;
+
+	if (ofxDepth.getBackend() == OFX_DEPTH_BACKEND_OPENCL)
+		ofxDepth.setup();
+	if (!points.isAllocated() || points.getNumElements() != layout.numPoints)
+		points.allocate(layout.numPoints);
+	if (layout.numPoints == 0)
+		return true;
+
+	if (points.isHostOnly()) {
+		ofVec4f * p = points.getHostData();
+		for (int i=0; i<layout.numPoints; i++) {
+			memcpy(&p[i].x, data + layout.base[0] + i * layout.stride[0], sizeof(float));
+			memcpy(&p[i].y, data + layout.base[1] + i * layout.stride[1], sizeof(float));
+			memcpy(&p[i].z, data + layout.base[2] + i * layout.stride[2], sizeof(float));
+			p[i].w = 1.f;
+		}
+		points.setHostModified();
+		return true;
+	}
+
+	// The mapping goes away on return, so the upload blocks
+	OpenCLBuffer staging;
+	staging.initBuffer(size);
+	ofxDepth.write(staging, data, 0, size, true);
+
+	OpenCLKernelPtr kernel = getKernel("gatherPoints");
+	kernel->setArg(0, staging);
+	kernel->setArg(1, points.getCLBuffer());
+	for (int c=0; c<3; c++) {
+		kernel->setArg(2 + c, (cl_ulong)layout.base[c]);
+		kernel->setArg(5 + c, (cl_ulong)layout.stride[c]);
+	}
+	ofxDepth.run1D(kernel, layout.numPoints);
+	ofxDepth.finish();
+	return true;
+}
+
+bool ofxDepthPointFile::load(string filepath, ofxDepthData & data) {
+	ofxDepthMappedFile file;
+	Layout layout;
+	vector<unsigned char> decompressed;
+	const unsigned char * bytes;
+	size_t size;
+	if (!parse(file, filepath, layout, decompressed, bytes, size))
+		return false;
+
+	data.allocate(layout.numPoints);
+	ofVec4f * p = data.getData().data();
+	for (int i=0; i<layout.numPoints; i++) {
+		memcpy(&p[i].x, bytes + layout.base[0] + i * layout.stride[0], sizeof(float));
+		memcpy(&p[i].y, bytes + layout.base[1] + i * layout.stride[1], sizeof(float));
+		memcpy(&p[i].z, bytes + layout.base[2] + i * layout.stride[2], sizeof(float));
+		p[i].w = 1.f;
+	}
+	data.setCount(layout.numPoints);
+	return true;
+}
+
+bool ofxDepthPointFile::parse(ofxDepthMappedFile & file, string filepath, Layout & layout, vector<unsigned char> & decompressed, const unsigned char *& data, size_t & size) {
+	if (!file.open(filepath)) {
+		ofLogError("ofxDepthPointFile") << "load(): can't read " << filepath;
+		return false;
+	}
+	bool ok = getFormat(filepath) == OFX_DEPTH_PLY_BINARY ? parsePLY(file, layout, data, size) : parsePCD(file, layout, decompressed, data, size);
+	if (!ok)
+		ofLogError("ofxDepthPointFile") << "load(): " << filepath << " is not a binary point file with float x, y and z";
+	return ok;
+}
+
+bool ofxDepthPointFile::parsePCD(const ofxDepthMappedFile & file, Layout & layout, vector<unsigned char> & decompressed, const unsigned char *& data, size_t & size) {
+	vector<string> fields;
+	vector<size_t> sizes;
+	vector<char> types;
+	vector<int> counts;
+	int width = 0;
+	int height = 1;
+	int numPoints = -1;
+	string encoding;
+
+	size_t pos = 0;
+	string line;
+	while (getLine(file.getData(), file.getSize(), pos, line)) {
+		vector<string> parts = ofSplitString(line, " ", true, true);
+		if (parts.empty() || parts[0][0] == '#')
+			continue;
+		if (parts[0] == "FIELDS")
+			fields.assign(parts.begin() + 1, parts.end());
+		else if (parts[0] == "SIZE") {
+			for (size_t i=1; i<parts.size(); i++)
+				sizes.push_back(ofToInt(parts[i]));
+		}
+		else if (parts[0] == "TYPE") {
+			for (size_t i=1; i<parts.size(); i++)
+				types.push_back(parts[i][0]);
+		}
+		else if (parts[0] == "COUNT") {
+			for (size_t i=1; i<parts.size(); i++)
+				counts.push_back(ofToInt(parts[i]));
+		}
+		else if (parts[0] == "WIDTH" && parts.size() > 1)
+			width = ofToInt(parts[1]);
+		else if (parts[0] == "HEIGHT" && parts.size() > 1)
+			height = ofToInt(parts[1]);
+		else if (parts[0] == "POINTS" && parts.size() > 1)
+			numPoints = ofToInt(parts[1]);
+		else if (parts[0] == "DATA" && parts.size() > 1) {
+			encoding = parts[1];
+			break;
+		}
+	}
+
+	if (counts.empty())
+		counts.assign(fields.size(), 1);
+	if (numPoints < 0)
+		numPoints = width > 0 && height > 0 && (long long)width * height <= INT_MAX ? width * height : -1;
+	if (numPoints < 0)
+		return false;
+	if (sizes.size() != fields.size() || types.size() != fields.size() || counts.size() != fields.size())
+		return false;
+
+	// Offsets of each field within a point, which is also the order of the planes when compressed
+	size_t pointSize = 0;
+	vector<size_t> offsets;
+	for (size_t f=0; f<fields.size(); f++) {
+		offsets.push_back(pointSize);
+		pointSize += sizes[f] * counts[f];
+	}
+
+	const char * axes[3] = {"x", "y", "z"};
+	int axisField[3];
+	for (int c=0; c<3; c++) {
+		auto it = std::find(fields.begin(), fields.end(), axes[c]);
+		if (it == fields.end())
+			return false;
+		axisField[c] = it - fields.begin();
+		if (sizes[axisField[c]] != 4 || types[axisField[c]] != 'F')
+			return false;
+	}
+
+	layout.numPoints = numPoints;
+	if (encoding == "binary") {
+		data = file.getData() + pos;
+		size = (size_t)numPoints * pointSize;
+		if (size > file.getSize() - pos)
+			return false;
+		for (int c=0; c<3; c++) {
+			layout.base[c] = offsets[axisField[c]];
+			layout.stride[c] = pointSize;
+		}
+		return true;
+	}
+	if (encoding == "binary_compressed") {
+		uint32_t lengths[2];
+		if (sizeof(lengths) > file.getSize() - pos)
+			return false;
+		memcpy(lengths, file.getData() + pos, sizeof(lengths));
+		if (lengths[0] > file.getSize() - pos - sizeof(lengths) || lengths[1] != (size_t)numPoints * pointSize)
+			return false;
+		decompressed.resize(lengths[1]);
+		if (!decompressLZF(file.getData() + pos + sizeof(lengths), lengths[0], decompressed.data(), decompressed.size()))
+			return false;
+		data = decompressed.data();
+		size = decompressed.size();
+		for (int c=0; c<3; c++) {
+			layout.base[c] = offsets[axisField[c]] * numPoints;
+			layout.stride[c] = sizes[axisField[c]] * counts[axisField[c]];
+		}
+		return true;
+	}
+	return false;
+}
+
+bool ofxDepthPointFile::parsePLY(const ofxDepthMappedFile & file, Layout & layout, const unsigned char *& data, size_t & size) {
+	size_t pos = 0;
+	string line;
+	if (!getLine(file.getData(), file.getSize(), pos, line) || line != "ply")
+		return false;
+
+	// Only the vertex element is read, so it has to be the first one
+	bool littleEndian = false;
+	bool inVertex = false;
+	int numPoints = -1;
+	size_t pointSize = 0;
+	int axisField[3] = {-1, -1, -1};
+	size_t axisOffset[3];
+	int field = 0;
+	while (getLine(file.getData(), file.getSize(), pos, line)) {
+		vector<string> parts = ofSplitString(line, " ", true, true);
+		if (parts.empty())
+			continue;
+		if (parts[0] == "end_header")
+			break;
+		if (parts[0] == "format")
+			littleEndian = parts.size() > 1 && parts[1] == "binary_little_endian";
+		else if (parts[0] == "element" && parts.size() > 2) {
+			if (numPoints < 0 && parts[1] == "vertex") {
+				numPoints = ofToInt(parts[2]);
+				inVertex = true;
+			}
+			else if (numPoints < 0)
+				return false;
+			else
+				inVertex = false;
+		}
+		else if (parts[0] == "property" && inVertex && parts.size() > 2) {
+			size_t typeSize = getTypeSize(parts[1]);
+			if (typeSize == 0)
+				return false;
+			const char * axes[3] = {"x", "y", "z"};
+			for (int c=0; c<3; c++) {
+				if (parts[2] == axes[c]) {
+					if (typeSize != 4 || (parts[1] != "float" && parts[1] != "float32"))
+						return false;
+					axisField[c] = field;
+					axisOffset[c] = pointSize;
+				}
+			}
+			pointSize += typeSize;
+			field++;
+		}
+	}
+
+	if (!littleEndian || numPoints < 0 || axisField[0] < 0 || axisField[1] < 0 || axisField[2] < 0)
+		return false;
+
+	data = file.getData() + pos;
+	size = (size_t)numPoints * pointSize;
+	if (size > file.getSize() - pos)
+		return false;
+	layout.numPoints = numPoints;
+	for (int c=0; c<3; c++) {
+		layout.base[c] = axisOffset[c];
+		layout.stride[c] = pointSize;
+	}
+	return true;
+}
+
+ofxDepthPointFileFormat ofxDepthPointFile::getFormat(string filepath) {
+	return ofToLower(ofFilePath::getFileExt(filepath)) == "ply" ? OFX_DEPTH_PLY_BINARY : OFX_DEPTH_PCD_BINARY;
+}
+
+//////////////////////////////////////////////////
+
+void ofxDepthPointFile::save(string filepath, ofxDepthPoints & points) {
+	save(filepath, points, getFormat(filepath));
+}
+
+void ofxDepthPointFile::save(string filepath, ofxDepthPoints & points, ofxDepthPointFileFormat format) {
+	shared_ptr<Job> job = make_shared<Job>();
+	job->filepath = ofToDataPath(filepath);
+	job->format = format;
+
+	if (points.isHostOnly()) {
+		ofVec4f * p = points.getHostData();
+		job->points.assign(p, p + points.getNumElements());
+		job->count = points.getNumElements();
+		queue(job);
+		return;
+	}
+
+	// Only the count is read back here, the points follow without blocking
+	int bytes = points.getNumElements() * points.getBytesPerElement();
+	if (points.compactPointsSize != bytes) {
+		points.compactPoints.initBuffer(bytes);
+		points.compactPointsSize = bytes;
+	}
+	job->count = points.compact(points.compactPoints);
+	job->points.resize(job->count);
+	if (job->count > 0)
+		job->event = ofxDepth.read(points.compactPoints, job->points.data(), 0, job->count * sizeof(ofVec4f));
+	ofxDepth.flush();
+	queue(job);
+}
+
+void ofxDepthPointFile::save(string filepath, ofxDepthData & data) {
+	save(filepath, data, getFormat(filepath));
+}
+
+void ofxDepthPointFile::save(string filepath, ofxDepthData & data, ofxDepthPointFileFormat format) {
+	shared_ptr<Job> job = make_shared<Job>();
+	job->filepath = ofToDataPath(filepath);
+	job->format = format;
+	job->count = std::min<int>(data.getCount(), data.getSize());
+	job->points.assign(data.getData().begin(), data.getData().begin() + job->count);
+	queue(job);
+}
+
+void ofxDepthPointFile::waitForSaves() {
+	std::unique_lock<std::mutex> lock(writerMutex);
+	writerCondition.wait(lock, [] {
+		return jobs.empty() && !writing;
+	});
+}
+
+void ofxDepthPointFile::queue(shared_ptr<Job> job) {
+	std::unique_lock<std::mutex> lock(writerMutex);
+	jobs.push_back(job);
+	if (!writing) {
+		writing = true;
+		std::thread(&ofxDepthPointFile::writeJobs).detach();
+	}
+}
+
+void ofxDepthPointFile::writeJobs() {
+	while (true) {
+		shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(writerMutex);
+			if (jobs.empty()) {
+				writing = false;
+				writerCondition.notify_all();
+				return;
+			}
+			job = jobs.front();
+			jobs.pop_front();
+		}
+		write(*job);
+	}
+}
+
+void ofxDepthPointFile::write(Job & job) {
+	if (job.event.isValid())
+		job.event.wait();
+
+	// Zeros are dropped here too, for data and host buffers that were not compacted
+	vector<float> xyz;
+	xyz.reserve(job.count * 3);
+	for (int i=0; i<job.count; i++) {
+		const ofVec4f & p = job.points[i];
+		if (p.x == 0 && p.y == 0 && p.z == 0)
+			continue;
+		xyz.push_back(p.x);
+		xyz.push_back(p.y);
+		xyz.push_back(p.z);
+	}
+	size_t numPoints = xyz.size() / 3;
+
+	std::ostringstream header;
+	if (job.format == OFX_DEPTH_PLY_BINARY) {
+		header << "ply\n";
+		header << "format binary_little_endian 1.0\n";
+		header << "element vertex " << numPoints << "\n";
+		header << "property float x\n";
+		header << "property float y\n";
+		header << "property float z\n";
+		header << "end_header\n";
+	}
+	else {
+		header << "# .PCD v0.7 - Point Cloud Data file format\n";
+		header << "VERSION 0.7\n";
+		header << "FIELDS x y z\n";
+		header << "SIZE 4 4 4\n";
+		header << "TYPE F F F\n";
+		header << "COUNT 1 1 1\n";
+		header << "WIDTH " << numPoints << "\n";
+		header << "HEIGHT 1\n";
+		header << "VIEWPOINT 0 0 0 1 0 0 0\n";
+		header << "POINTS " << numPoints << "\n";
+		header << "DATA " << (job.format == OFX_DEPTH_PCD_BINARY_COMPRESSED ? "binary_compressed" : "binary") << "\n";
+	}
+
+	FILE * file = fopen(job.filepath.c_str(), "wb");
+	if (!file) {
+		ofLogError("ofxDepthPointFile") << "save(): can't write " << job.filepath;
+		return;
+	}
+	string text = header.str();
+	fwrite(text.data(), 1, text.size(), file);
+
+	if (job.format == OFX_DEPTH_PCD_BINARY_COMPRESSED) {
+		// Compressed PCD stores all x, then all y, then all z
+		vector<float> planes(xyz.size());
+		for (size_t i=0; i<numPoints; i++) {
+			planes[i] = xyz[i * 3 + 0];
+			planes[numPoints + i] = xyz[i * 3 + 1];
+			planes[numPoints * 2 + i] = xyz[i * 3 + 2];
+		}
+		vector<unsigned char> compressed;
+		uint32_t sizes[2];
+		sizes[0] = compressLZF((const unsigned char*)planes.data(), planes.size() * sizeof(float), compressed);
+		sizes[1] = planes.size() * sizeof(float);
+		fwrite(sizes, sizeof(sizes), 1, file);
+		fwrite(compressed.data(), 1, compressed.size(), file);
+	}
+	else
+		fwrite(xyz.data(), sizeof(float), xyz.size(), file);
+	fclose(file);
+}
+
+//////////////////////////////////////////////////
+
+size_t ofxDepthPointFile::compressLZF(const unsigned char * input, size_t size, vector<unsigned char> & output) {
+	static const int hashBits = 14;
+	static const size_t maxOffset = 1 << 13;
+	static const size_t maxLiteral = 32;
+	static const size_t maxMatch = 264;
+	vector<int64_t> table(1 << hashBits, -1);
+	output.clear();
+	output.reserve(size + size / 16 + 64);
+
+	size_t literal = 0;
+	auto flushLiterals = [&](size_t end) {
+		while (literal < end) {
+			size_t n = std::min(end - literal, maxLiteral);
+			output.push_back(n - 1);
+			output.insert(output.end(), input + literal, input + literal + n);
+			literal += n;
+		}
+	};
+
+	size_t ip = 0;
+	while (ip + 2 < size) {
+		uint32_t v = input[ip] << 16 | input[ip + 1] << 8 | input[ip + 2];
+		uint32_t h = (v * 2654435761u) >> (32 - hashBits);
+		int64_t ref = table[h];
+		table[h] = ip;
+		size_t offset = ip - ref - 1;
+		if (ref >= 0 && offset < maxOffset && memcmp(input + ref, input + ip, 3) == 0) {
+			size_t length = 3;
+			size_t limit = std::min(maxMatch, size - ip);
+			while (length < limit && input[ref + length] == input[ip + length])
+				length++;
+
+			flushLiterals(ip);
+			size_t l = length - 2;
+			if (l < 7)
+				output.push_back((l << 5) | (offset >> 8));
+			else {
+				output.push_back((7 << 5) | (offset >> 8));
+				output.push_back(l - 7);
+			}
+			output.push_back(offset & 0xff);
+			ip += length;
+			literal = ip;
+		}
+		else
+			ip++;
+	}
+	flushLiterals(size);
+	return output.size();
+}
+
+bool ofxDepthPointFile::decompressLZF(const unsigned char * input, size_t size, unsigned char * output, size_t outputSize) {
+	const unsigned char * ip = input;
+	const unsigned char * end = input + size;
+	unsigned char * op = output;
+	unsigned char * outputEnd = output + outputSize;
+	while (ip < end) {
+		size_t ctrl = *ip++;
+		if (ctrl < 32) {
+			size_t n = ctrl + 1;
+			if (ip + n > end || op + n > outputEnd)
+				return false;
+			memcpy(op, ip, n);
+			ip += n;
+			op += n;
+		}
+		else {
+			size_t length = ctrl >> 5;
+			if (length == 7) {
+				if (ip >= end)
+					return false;
+				length += *ip++;
+			}
+			if (ip >= end)
+				return false;
+			size_t offset = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+			length += 2;
+			if (offset > (size_t)(op - output) || op + length > outputEnd)
+				return false;
+			// Matches may overlap their own output
+			const unsigned char * ref = op - offset;
+			for (size_t i=0; i<length; i++)
+				op[i] = ref[i];
+			op += length;
+		}
+	}
+	return op == outputEnd;
+}
+
+OpenCLKernelPtr ofxDepthPointFile::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthPointFile::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthPointFileProgram);
+		ofxDepth.loadKernel("gatherPoints", program);
+		return program;
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthCore.h"
+#include "ofxDepthPoints.h"
+#include "ofxDepthMappedFile.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+using namespace msa;
+
+enum ofxDepthPointFileFormat {
+	OFX_DEPTH_PCD_BINARY,
+	OFX_DEPTH_PCD_BINARY_COMPRESSED,
+	OFX_DEPTH_PLY_BINARY
+};
+
+//////////////////////////////////////////////////
+// DEPTH POINT FILE
+//
+// Binary and binary_compressed PCD and binary little endian PLY.
+// Loading maps the file and uploads the point data in one write, a
+// kernel then gathers x, y and z into ofxDepthPoints. Saving queues
+// the points on a writer thread, so the caller only waits for the
+// points to be compacted on the device.
+
+class ofxDepthPointFile {
+public:
+	static bool load(string filepath, ofxDepthPoints & points);
+	static bool load(string filepath, ofxDepthData & data);
+
+	// Writes the points that are not zero, the format follows the extension (.pcd or .ply) unless given
+	static void save(string filepath, ofxDepthPoints & points);
+	static void save(string filepath, ofxDepthPoints & points, ofxDepthPointFileFormat format);
+	static void save(string filepath, ofxDepthData & data);
+	static void save(string filepath, ofxDepthData & data, ofxDepthPointFileFormat format);
+	// Blocks until every queued save is written, call before exiting so no file is cut short
+	static void waitForSaves();
+
+	// LZF as used by binary_compressed PCD
+	static size_t compressLZF(const unsigned char * input, size_t size, vector<unsigned char> & output);
+	static bool decompressLZF(const unsigned char * input, size_t size, unsigned char * output, size_t outputSize);
+
+protected:
+	// Byte offset of the first point and distance between points for each of x, y and z
+	struct Layout {
+		size_t base[3];
+		size_t stride[3];
+		int numPoints = 0;
+	};
+
+	struct Job {
+		string filepath;
+		ofxDepthPointFileFormat format;
+		vector<ofVec4f> points;
+		int count = 0;
+		ofxDepthEvent event;
+	};
+
+	static bool parse(ofxDepthMappedFile & file, string filepath, Layout & layout, vector<unsigned char> & decompressed, const unsigned char *& data, size_t & size);
+	static bool parsePCD(const ofxDepthMappedFile & file, Layout & layout, vector<unsigned char> & decompressed, const unsigned char *& data, size_t & size);
+	static bool parsePLY(const ofxDepthMappedFile & file, Layout & layout, const unsigned char *& data, size_t & size);
+	static ofxDepthPointFileFormat getFormat(string filepath);
+
+	static void queue(shared_ptr<Job> job);
+	static void writeJobs();
+	static void write(Job & job);
+
+	// The writer thread runs while there are jobs and exits when the queue is empty
+	static std::mutex writerMutex;
+	static std::condition_variable writerCondition;
+	static std::deque<shared_ptr<Job> > jobs;
+	static bool writing;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
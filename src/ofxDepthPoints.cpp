@@ -1,21 +1,60 @@
 #include "ofxDepthCore.h"
 #include "ofxDepthPoints.h"
 #include "ofxDepthImage.h"
+#include "ofxDepthCamera.h"
+#include "ofxDepthPointFile.h"
+#include "ofxDepthCpu.h"
+#include <unordered_map>
 
 #define STRINGIFY(A) #A
 
 string depthPointsProgram = STRINGIFY(
 
-__kernel void transform(__global float4 *input, __global float4 *output, __global float4 *mat) {
+__kernel void transform(__global float4 *input, __global float4 *output, float16 mat) {
 	int i = get_global_id(0);
 	float4 v = input[i];
-
-	output[i].x = mat[0].x * v.x + mat[1].x * v.y + mat[2].x * v.z + mat[3].x;
-	output[i].y = mat[0].y * v.x + mat[1].y * v.y + mat[2].y * v.z + mat[3].y;
-	output[i].z = mat[0].z * v.x + mat[1].z * v.y + mat[2].z * v.z + mat[3].z;
+	output[i] = v.x * mat.s0123 + v.y * mat.s4567 + v.z * mat.s89ab + mat.scdef;
 	output[i].w = 1.f;
 }
 
+// Sensor s of the batch is (depth s, table s) with layout (width, height, offset) and transform s
+__kernel void pointsFromTablesTransform(__global float4* points, __global float16* mats, __global int4* layout,
+	__global unsigned short* d0, __global float2* t0, __global unsigned short* d1, __global float2* t1,
+	__global unsigned short* d2, __global float2* t2, __global unsigned short* d3, __global float2* t3,
+	__global unsigned short* d4, __global float2* t4, __global unsigned short* d5, __global float2* t5,
+	__global unsigned short* d6, __global float2* t6, __global unsigned short* d7, __global float2* t7) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int s = get_global_id(2);
+	int4 l = layout[s];
+	if (x >= l.x || y >= l.y)
+		return;
+
+	__global unsigned short* depth = d0;
+	__global float2* table = t0;
+	switch (s) {
+	case 1: depth = d1; table = t1; break;
+	case 2: depth = d2; table = t2; break;
+	case 3: depth = d3; table = t3; break;
+	case 4: depth = d4; table = t4; break;
+	case 5: depth = d5; table = t5; break;
+	case 6: depth = d6; table = t6; break;
+	case 7: depth = d7; table = t7; break;
+	}
+
+	int i = y * l.x + x;
+	float16 mat = mats[s];
+	float d = (float)depth[i];
+	if (d == 0.f) {
+		points[l.z + i] = (float4)(0.f);
+		return;
+	}
+	float4 v = (float4)(table[i].x * d, table[i].y * d, -d, 1.f);
+	float4 p = v.x * mat.s0123 + v.y * mat.s4567 + v.z * mat.s89ab + mat.scdef;
+	p.w = 1.f;
+	points[l.z + i] = p;
+}
+
 __kernel void smoothNormals(__global float4 *input, __global float4 *output) {
 	int x = get_global_id(0);
 	int y = get_global_id(1);
@@ -45,44 +84,151 @@ __kernel void smoothNormals(__global float4 *input, __global float4 *output) {
 	}
 }
 
-__kernel void pointsToIndices(__global float4* vertices, __global unsigned int* indices, __global float4* normals, float maxFaceDist, float fov) {
-	int2 coords = (int2)(get_global_id(0), get_global_id(1));
-	int2 dim = (int2)(get_global_size(0), get_global_size(1));
-	int i = (coords.y * dim.x + coords.x) * 6;
-
-	int c1 = coords.y * dim.x + coords.x;
-	int c2 = coords.y * dim.x + coords.x + 1;
-	int c3 = (coords.y + 1) * dim.x + coords.x + 1;
-	int c4 = (coords.y + 1) * dim.x + coords.x;
-
-	float4 v1 = vertices[c1];
-	float4 v2 = vertices[c2];
-	float4 v3 = vertices[c3];
-	float4 v4 = vertices[c4];
-
-	float zrt1 = fabs(v1.z * fov) * maxFaceDist;
-	float zrt3 = fabs(v3.z * fov) * maxFaceDist;
+// Triangulates a grid of cells step pixels apart and writes only the triangles that pass.
+// Each work-group reserves its range of the index buffer with one atomic
+__kernel void pointsToIndices(__global float4* vertices, __global unsigned int* indices, __global float4* normals, __global uint* indexCount, int width, int height, int step, float maxFaceDist, float fov, __local uint* group) {
+	int x0 = get_global_id(0) * step;
+	int y0 = get_global_id(1) * step;
+	int x1 = min(x0 + step, width - 1);
+	int y1 = min(y0 + step, height - 1);
+	bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+
+	int c1 = y0 * width + x0;
+	int c2 = y0 * width + x1;
+	int c3 = y1 * width + x1;
+	int c4 = y1 * width + x0;
+
+	bool t1 = false;
+	bool t2 = false;
+	if (x0 < width - 1 && y0 < height - 1) {
+		float4 v1 = vertices[c1];
+		float4 v2 = vertices[c2];
+		float4 v3 = vertices[c3];
+		float4 v4 = vertices[c4];
+
+		float zrt1 = fabs(v1.z * fov) * maxFaceDist * step;
+		float zrt3 = fabs(v3.z * fov) * maxFaceDist * step;
+
+		t1 = length(v1 - v2) < zrt1 && length(v1 - v4) < zrt1;
+		t2 = length(v3 - v2) < zrt3 && length(v3 - v4) < zrt3;
+
+		// Each cell owns the normal of its first corner, the last row and column also own their far corners,
+		// so every vertex of the level is written once whether or not its triangles pass
+		float4 n1 = t1 ? normalize(cross(v2-v1, v4-v1)) : (float4)(0.f);
+		float4 n2 = t2 ? normalize(cross(v4-v3, v2-v3)) : (float4)(0.f);
+		normals[c1] = t1 ? n1 : n2;
+		if (x1 == width - 1)
+			normals[c2] = t2 ? n2 : n1;
+		if (y1 == height - 1)
+			normals[c4] = t2 ? n2 : n1;
+		if (x1 == width - 1 && y1 == height - 1)
+			normals[c3] = n2;
+	}
 
-	if (length(v1 - v2) < zrt1 && length(v1 - v4) < zrt1) {
+	if (first)
+		group[0] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint offset = atomic_add(&group[0], (uint)t1 + (uint)t2);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (first)
+		group[1] = atomic_add(indexCount, group[0] * 3);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int i = group[1] + offset * 3;
+	if (t1) {
 		indices[i+0] = c1;
 		indices[i+1] = c4;
 		indices[i+2] = c2;
-		normals[c1] = normalize(cross(v2-v1, v4-v1));
+		i += 3;
 	}
-	else {
-		indices[i+0] = 0;
-		indices[i+1] = 0;
-		indices[i+2] = 0;
-	}
-	if (length(v3 - v2) < zrt3 && length(v3 - v4) < zrt3) {
-		indices[i+3] = c2;
-		indices[i+4] = c4;
-		indices[i+5] = c3;
-	}	
-	else {
-		indices[i+3] = 0;
-		indices[i+4] = 0;
-		indices[i+5] = 0;
+	if (t2) {
+		indices[i+0] = c2;
+		indices[i+1] = c4;
+		indices[i+2] = c3;
+	}
+}
+
+void emitTriangle(__global unsigned int* indices, __global uint* indexCount, int a, int b, int c) {
+	int i = atomic_add(indexCount, 3);
+	indices[i+0] = a;
+	indices[i+1] = b;
+	indices[i+2] = c;
+}
+
+// True when every point of the cell is valid and within tolerance of the bilinear patch through its corners
+bool isFlat(__global float4* vertices, int width, int x0, int y0, int x1, int y1, float tolerance) {
+	float4 v00 = vertices[y0 * width + x0];
+	float4 v10 = vertices[y0 * width + x1];
+	float4 v01 = vertices[y1 * width + x0];
+	float4 v11 = vertices[y1 * width + x1];
+	if (v00.z == 0.f || v10.z == 0.f || v01.z == 0.f || v11.z == 0.f)
+		return false;
+	for (int y=y0; y<=y1; y++) {
+		float fy = (float)(y - y0) / (y1 - y0);
+		for (int x=x0; x<=x1; x++) {
+			float fx = (float)(x - x0) / (x1 - x0);
+			float4 v = vertices[y * width + x];
+			float4 p = mix(mix(v00, v10, fx), mix(v01, v11, fx), fy);
+			if (v.z == 0.f || length(v.xyz - p.xyz) > tolerance)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Quadtree over blocks of maxStep pixels: flat cells become one quad, others split down to single pixels.
+// T-junctions only occur where a cell is flat, so gaps stay within the flatness tolerance
+__kernel void pointsToIndicesAdaptive(__global float4* vertices, __global unsigned int* indices, __global float4* normals, __global uint* indexCount, int width, int height, int maxStep, float maxFaceDist, float flatness, float fov) {
+	int3 stack[32];
+	int top = 0;
+	stack[top++] = (int3)(get_global_id(0) * maxStep, get_global_id(1) * maxStep, maxStep);
+
+	while (top > 0) {
+		int3 cell = stack[--top];
+		int x0 = cell.x;
+		int y0 = cell.y;
+		if (x0 >= width - 1 || y0 >= height - 1)
+			continue;
+		int x1 = min(x0 + cell.z, width - 1);
+		int y1 = min(y0 + cell.z, height - 1);
+
+		int c1 = y0 * width + x0;
+		int c2 = y0 * width + x1;
+		int c3 = y1 * width + x1;
+		int c4 = y1 * width + x0;
+		float4 v1 = vertices[c1];
+		float4 v2 = vertices[c2];
+		float4 v3 = vertices[c3];
+		float4 v4 = vertices[c4];
+
+		if (cell.z == 1) {
+			float zrt1 = fabs(v1.z * fov) * maxFaceDist;
+			float zrt3 = fabs(v3.z * fov) * maxFaceDist;
+			if (length(v1 - v2) < zrt1 && length(v1 - v4) < zrt1) {
+				emitTriangle(indices, indexCount, c1, c4, c2);
+				normals[c1] = normalize(cross(v2-v1, v4-v1));
+			}
+			if (length(v3 - v2) < zrt3 && length(v3 - v4) < zrt3)
+				emitTriangle(indices, indexCount, c2, c4, c3);
+			continue;
+		}
+
+		if (isFlat(vertices, width, x0, y0, x1, y1, fabs(v1.z * fov) * flatness)) {
+			emitTriangle(indices, indexCount, c1, c4, c2);
+			emitTriangle(indices, indexCount, c2, c4, c3);
+			float4 n = normalize(cross(v2-v1, v4-v1));
+			normals[c1] = n;
+			normals[c2] = n;
+			normals[c3] = n;
+			normals[c4] = n;
+			continue;
+		}
+
+		int half = cell.z / 2;
+		stack[top++] = (int3)(x0, y0, half);
+		stack[top++] = (int3)(x0 + half, y0, half);
+		stack[top++] = (int3)(x0, y0 + half, half);
+		stack[top++] = (int3)(x0 + half, y0 + half, half);
 	}
 }
 
@@ -129,6 +275,137 @@ __kernel void calcNormals(__global float4* vertices, __global float4* normals, f
 		normals[c] = normal;
 }
 
+bool isPoint(float4 p) {
+	return p.x != 0.f || p.y != 0.f || p.z != 0.f;
+}
+
+// Exclusive prefix sum over the work-group, the sum of all values goes to total
+uint scanLocal(__local uint* scan, uint value, uint* total) {
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+	scan[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset=1; offset<size; offset*=2) {
+		uint v = lid >= offset ? scan[lid-offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scan[lid] += v;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	*total = scan[size-1];
+	return scan[lid] - value;
+}
+
+__kernel void compactCount(__global float4* points, __global uint* groups, int count, __local uint* scan) {
+	int i = get_global_id(0);
+	uint valid = i < count && isPoint(points[i]);
+	uint total;
+	scanLocal(scan, valid, &total);
+	if (get_local_id(0) == 0)
+		groups[get_group_id(0)] = total;
+}
+
+// Single work-group, turns the group counts into group offsets
+__kernel void compactGroups(__global uint* groups, __global uint* total, int numGroups, __local uint* scan) {
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+	int chunk = (numGroups + size - 1) / size;
+	int g0 = min(lid * chunk, numGroups);
+	int g1 = min(g0 + chunk, numGroups);
+
+	uint sum = 0;
+	for (int g=g0; g<g1; g++)
+		sum += groups[g];
+
+	uint all;
+	uint offset = scanLocal(scan, sum, &all);
+	for (int g=g0; g<g1; g++) {
+		uint c = groups[g];
+		groups[g] = offset;
+		offset += c;
+	}
+	if (lid == 0)
+		total[0] = all;
+}
+
+__kernel void compactScatter(__global float4* points, __global uint* groups, __global float4* output, int count, __local uint* scan) {
+	int i = get_global_id(0);
+	float4 p = i < count ? points[i] : (float4)(0.f);
+	uint valid = isPoint(p);
+	uint total;
+	uint offset = scanLocal(scan, valid, &total);
+	if (valid)
+		output[groups[get_group_id(0)] + offset] = p;
+}
+
+// A slot belongs to the first point that claims it, 0xffffffff marks an empty slot. Points compare
+// their voxel against the owner's, so voxels anywhere in the grid are told apart
+int3 voxelOf(float4 p, float voxelSize) {
+	return convert_int3(floor(p.xyz / voxelSize));
+}
+
+uint voxelHash(int3 v) {
+	return (uint)v.x * 73856093u ^ (uint)v.y * 19349663u ^ (uint)v.z * 83492791u;
+}
+
+__kernel void voxelClear(__global uint* keys, __global uint* counts, __global uint* sums, __global int* normalSums) {
+	int i = get_global_id(0);
+	keys[i] = 0xffffffff;
+	counts[i] = 0;
+	vstore3((uint3)(0), i, sums);
+	vstore3((int3)(0), i, normalSums);
+}
+
+// Positions are summed in 1/4096 of a voxel relative to the voxel corner, normals in 1/1024
+__kernel void voxelInsert(__global float4* points, __global float4* normals, int useNormals, __global uint* keys, __global int* cells, __global uint* counts, __global uint* sums, __global int* normalSums, float voxelSize, uint mask) {
+	int i = get_global_id(0);
+	float4 p = points[i];
+	if (!isPoint(p))
+		return;
+
+	float3 f = p.xyz / voxelSize;
+	float3 v = floor(f);
+	int3 cell = convert_int3(v);
+	uint slot = voxelHash(cell) & mask;
+	for (uint n=0; n<=mask; n++) {
+		uint owner = atomic_cmpxchg(&keys[slot], 0xffffffff, (uint)i);
+		if (owner == 0xffffffff) {
+			vstore3(cell, slot, cells);
+			break;
+		}
+		if (all(voxelOf(points[owner], voxelSize) == cell))
+			break;
+		slot = (slot + 1) & mask;
+	}
+
+	uint3 offset = convert_uint3(clamp(f - v, 0.f, 1.f) * 4096.f);
+	atomic_inc(&counts[slot]);
+	atomic_add(&sums[slot * 3 + 0], offset.x);
+	atomic_add(&sums[slot * 3 + 1], offset.y);
+	atomic_add(&sums[slot * 3 + 2], offset.z);
+	if (useNormals) {
+		int3 n = convert_int3_rte(normals[i].xyz * 1024.f);
+		atomic_add(&normalSums[slot * 3 + 0], n.x);
+		atomic_add(&normalSums[slot * 3 + 1], n.y);
+		atomic_add(&normalSums[slot * 3 + 2], n.z);
+	}
+}
+
+__kernel void voxelEmit(__global uint* keys, __global int* cells, __global uint* counts, __global uint* sums, __global int* normalSums, __global float4* output, __global float4* outputNormals, int useNormals, float voxelSize, __global uint* total) {
+	int i = get_global_id(0);
+	if (keys[i] == 0xffffffff)
+		return;
+
+	float n = counts[i];
+	float3 offset = convert_float3(vload3(i, sums)) / (n * 4096.f);
+	float3 p = (convert_float3(vload3(i, cells)) + offset) * voxelSize;
+	uint o = atomic_inc(total);
+	output[o] = (float4)(p, 1.f);
+	if (useNormals) {
+		float3 normal = convert_float3(vload3(i, normalSums));
+		outputNormals[o] = length(normal) > 0.f ? (float4)(normalize(normal), 0.f) : (float4)(0.f);
+	}
+}
+
 __kernel void mapTexCoords(__global float2* table, __global float2* texCoords, float width, float height) {
 	int2 coords = (int2)(get_global_id(0), get_global_id(1));
 	int2 dim = (int2)(get_global_size(0), get_global_size(1));
@@ -150,36 +427,22 @@ __kernel void orthTexCoords(__global float4* vertices, __global float2* texCoord
 //////////////////////////////////////////////////
 
 OpenCLProgramPtr ofxDepthPoints::program;
+const int ofxDepthPoints::maxBatchSize;
 
 void ofxDepthPoints::allocate(int numVertices) {
-	ofxDepth.setup();
+	if (ofxDepth.getBackend() == OFX_DEPTH_BACKEND_OPENCL)
+		ofxDepth.setup();
 	ofxDepthBuffer::allocate(numVertices);
-	vbo.setVertexBuffer(getGLBuffer(), getNumTypePerElement(), getBytesPerElement());
+	if (!isHostOnly())
+		vbo.setVertexBuffer(getGLBuffer(), getNumTypePerElement(), getBytesPerElement());
 }
 
 void ofxDepthPoints::load(string filepath) {
-	ofFile file(filepath);
-	string line;
-	int width = 0;
-	int height = 0;
-	int points = 0;
-	while(std::getline(file, line) && line.find("DATA") != 0) {
-		vector<string> parts = ofSplitString(line, " ");
-		if (parts[0] == "WIDTH")
-			width = ofToInt(parts[1]);
-		if (parts[0] == "HEIGHT")
-			height = ofToInt(parts[1]);
-		if (parts[0] == "POINTS")
-			points = ofToInt(parts[1]);
-		cout << line << endl;
-	}
-	if (line.find("DATA") == 0) {
-		size_t pos = file.tellg();
-		uint64_t s = file.getSize();
-		uint64_t n = (s - pos) / sizeof(float);
-		vector<ofVec3f> dat;
-		dat.resize(points);
-	}
+	ofxDepthPointFile::load(filepath, *this);
+}
+
+void ofxDepthPoints::save(string filepath) {
+	ofxDepthPointFile::save(filepath, *this);
 }
 
 void ofxDepthPoints::read(ofxDepthData & data) {
@@ -189,7 +452,7 @@ void ofxDepthPoints::read(ofxDepthData & data) {
 
 void ofxDepthPoints::read(vector<ofVec4f> & points) {
 	points.resize(getNumElements());
-	clBuf.read(points.data(), 0, points.size() * sizeof(ofVec4f));
+	ofxDepthBuffer::read(points.data(), points.size());
 }
 
 void ofxDepthPoints::write(ofxDepthData & data) {
@@ -197,41 +460,95 @@ void ofxDepthPoints::write(ofxDepthData & data) {
 }
 
 void ofxDepthPoints::write(vector<ofVec4f> & points, int count) {
-	clBuf.write(points.data(), 0, count * sizeof(ofVec4f));
+	ofxDepthBuffer::write(points.data(), count);
 }
 
 void ofxDepthPoints::updateMesh(int width, int height, float noiseThreshold, bool mode) {
+	updateMeshLOD(width, height, 1, noiseThreshold, mode);
+}
 
-	if (!indBuf.isAllocated()) {
-		indBuf.allocate(width * height * 6);
-		vbo.setIndexBuffer(indBuf.getGLBuffer());
-	}
-	if (!norBuf.isAllocated()) {
-		norBuf.allocate(getNumElements());
-		vbo.setNormalBuffer(norBuf.getGLBuffer(), norBuf.getBytesPerElement());
-	}
+void ofxDepthPoints::updateMeshLOD(int width, int height, int step, float noiseThreshold, bool mode) {
+
+	step = std::max(step, 1);
+	int cellsX = (width - 1 + step - 1) / step;
+	int cellsY = (height - 1 + step - 1) / step;
+	allocateMesh(cellsX * cellsY * 6);
 
 	OpenCLKernelPtr kernel = getKernel("pointsToIndices");
 	kernel->setArg(0, getCLBuffer());
 	kernel->setArg(1, indBuf.getCLBuffer());
 	kernel->setArg(2, norBuf.getCLBuffer());
-	kernel->setArg(3, noiseThreshold);
-	kernel->setArg(4, tanf(60 * DEG_TO_RAD)/height);
-	kernel->run2D(width, height);
+	kernel->setArg(3, indexCountBuf);
+	kernel->setArg(4, width);
+	kernel->setArg(5, height);
+	kernel->setArg(6, step);
+	kernel->setArg(7, noiseThreshold);
+	kernel->setArg(8, getFovFactor(height));
+	kernel->setArg(9, NULL, 2 * sizeof(cl_uint));
+	ofxDepth.run2D(kernel, cellsX, cellsY);
+
+	// Read back without blocking, drawMesh() waits for it
+	indexCountEvent = ofxDepth.read(indexCountBuf, &indexCount, 0, sizeof(cl_uint));
 
 	if (mode) {
 		kernel = getKernel("calcNormals");
 		kernel->setArg(0, getCLBuffer());
 		kernel->setArg(1, norBuf.getCLBuffer());
 		kernel->setArg(2, noiseThreshold);
-		kernel->setArg(3, tanf(60 * DEG_TO_RAD)/height);
-		kernel->run2D(width, height);
+		kernel->setArg(3, getFovFactor(height));
+		ofxDepth.run2D(kernel, width, height);
 	}
 
 	vbo.enableIndices();
 	vbo.enableNormals();
 }
 
+void ofxDepthPoints::updateMeshAdaptive(int width, int height, int maxStep, float noiseThreshold, float flatness) {
+
+	// Power of two up to 64 keeps the traversal stack within 32 cells
+	int step = 1;
+	while (step * 2 <= std::min(maxStep, 64))
+		step *= 2;
+	allocateMesh((width - 1) * (height - 1) * 6);
+
+	OpenCLKernelPtr kernel = getKernel("pointsToIndicesAdaptive");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, indBuf.getCLBuffer());
+	kernel->setArg(2, norBuf.getCLBuffer());
+	kernel->setArg(3, indexCountBuf);
+	kernel->setArg(4, width);
+	kernel->setArg(5, height);
+	kernel->setArg(6, step);
+	kernel->setArg(7, noiseThreshold);
+	kernel->setArg(8, flatness);
+	kernel->setArg(9, getFovFactor(height));
+	ofxDepth.run2D(kernel, (width - 1 + step - 1) / step, (height - 1 + step - 1) / step);
+
+	indexCountEvent = ofxDepth.read(indexCountBuf, &indexCount, 0, sizeof(cl_uint));
+
+	vbo.enableIndices();
+	vbo.enableNormals();
+}
+
+void ofxDepthPoints::allocateMesh(int numIndices) {
+	if (!norBuf.isAllocated()) {
+		norBuf.allocate(getNumElements());
+		vbo.setNormalBuffer(norBuf.getGLBuffer(), norBuf.getBytesPerElement());
+	}
+	// Not tied to the normals, which downsample() can allocate first
+	if (!indexCountBufAllocated) {
+		indexCountBuf.initBuffer(sizeof(cl_uint));
+		indexCountBufAllocated = true;
+	}
+	if (!indBuf.isAllocated() || indBuf.getNumElements() != numIndices) {
+		indBuf.allocate(numIndices);
+		vbo.setIndexBuffer(indBuf.getGLBuffer());
+	}
+
+	static const cl_uint zero = 0;
+	ofxDepth.write(indexCountBuf, &zero, 0, sizeof(cl_uint));
+}
+
 void ofxDepthPoints::updateTexCoords(ofxDepthTable & table, float u, float v) {
 
 	if (!texBuf.isAllocated()) {
@@ -244,7 +561,7 @@ void ofxDepthPoints::updateTexCoords(ofxDepthTable & table, float u, float v) {
 	kernel->setArg(1, texBuf.getCLBuffer());
 	kernel->setArg(2, u);
 	kernel->setArg(3, v);
-	kernel->run2D(table.getWidth(), table.getHeight());
+	ofxDepth.run2D(kernel, table.getWidth(), table.getHeight());
 
 	vbo.enableTexCoords();
 }
@@ -263,39 +580,363 @@ void ofxDepthPoints::updateTexCoords(float x, float y, float scaleX, float scale
 	kernel->setArg(3, y);
 	kernel->setArg(4, scaleX);
 	kernel->setArg(5, scaleY);
-	kernel->run1D(getNumElements());
+	ofxDepth.run1D(kernel, getNumElements());
 
 	vbo.enableTexCoords();
 }
 
 void ofxDepthPoints::draw() {
+	draw(0, getNumElements());
+}
+
+void ofxDepthPoints::draw(int first, int count) {
 	vbo.disableIndices();
-	vbo.draw(GL_POINTS, 0, getNumElements());
+	vbo.draw(GL_POINTS, first, count);
 }
 
 void ofxDepthPoints::drawMesh() {
 	if (indBuf.isAllocated()) {
 		vbo.enableIndices();
-		vbo.drawElements(GL_TRIANGLES, indBuf.getNumElements());
+		vbo.drawElements(GL_TRIANGLES, getIndexCount());
 	}
 }
 
+int ofxDepthPoints::getIndexCount() {
+	indexCountEvent.wait();
+	return indexCount;
+}
+
+void ofxDepthPoints::setFovFactor(float fovFactor) {
+	this->fovFactor = fovFactor;
+}
+
+void ofxDepthPoints::setCamera(const ofxDepthCamera & camera) {
+	fovFactor = camera.getFovFactor();
+}
+
+float ofxDepthPoints::getFovFactor(int height) const {
+	return fovFactor > 0.f ? fovFactor : tanf(60*DEG_TO_RAD)/height;
+}
+
 void ofxDepthPoints::transform(const ofMatrix4x4 &mat, ofxDepthPoints &outputPoints) {
 
-	if (matrix.size() == 0) {
-		matrix.initBuffer(4);
+	if (!outputPoints.isAllocated())
+		outputPoints.allocate(getNumElements());
+
+	// ofMatrix4x4 is 16 floats row by row, passed by value as float16
+	OpenCLKernelPtr kernel = getKernel("transform");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, outputPoints.getCLBuffer());
+	kernel->setArg(2, mat);
+	ofxDepth.run1D(kernel, getNumElements());
+}
+
+void ofxDepthPoints::fromImages(vector<ofxDepthImage*> & images, vector<ofxDepthTable*> & tables, vector<ofMatrix4x4> & transforms) {
+
+	int count = std::min<int>(std::min(images.size(), tables.size()), std::min<size_t>(transforms.size(), maxBatchSize));
+	if (count == 0)
+		return;
+
+	vector<int> layout(count * 4, 0);
+	int total = 0;
+	int maxWidth = 0;
+	int maxHeight = 0;
+	for (int s=0; s<count; s++) {
+		if (tables[s]->getWidth() != images[s]->getWidth() || tables[s]->getHeight() != images[s]->getHeight()) {
+			ofLogError("ofxDepthPoints") << "fromImages(): table " << s << " is " << tables[s]->getWidth() << "x" << tables[s]->getHeight() << ", image is " << images[s]->getWidth() << "x" << images[s]->getHeight();
+			return;
+		}
+		layout[s * 4 + 0] = images[s]->getWidth();
+		layout[s * 4 + 1] = images[s]->getHeight();
+		layout[s * 4 + 2] = total;
+		total += images[s]->getNumElements();
+		maxWidth = std::max(maxWidth, images[s]->getWidth());
+		maxHeight = std::max(maxHeight, images[s]->getHeight());
 	}
 
-	for (int i=0; i<4; i++) {
-		matrix[i] = mat.getRowAsVec4f(i);
+	if (!isAllocated() || getNumElements() != total)
+		allocate(total);
+
+	if (isHostOnly()) {
+		float * points = (float*)getHostData();
+		for (int s=0; s<count; s++)
+			ofxDepthCpu::pointsFromTable(images[s]->getHostData(), (float*)tables[s]->getHostData(), layout[s * 4 + 0], layout[s * 4 + 1], transforms[s].getPtr(), points + layout[s * 4 + 2] * 4);
+		setHostModified();
+		return;
 	}
-	matrix.writeToDevice();
 
-	OpenCLKernelPtr kernel = getKernel("transform");
+	// Layout and extrinsics stay on the device and are only written when they change
+	if (layout != batchLayout) {
+		batchLayout = layout;
+		batchLayoutBuf.initBuffer(layout.size() * sizeof(int));
+		ofxDepth.write(batchLayoutBuf, batchLayout.data(), 0, layout.size() * sizeof(int), true);
+	}
+	if ((int)batchTransforms.size() != count || memcmp(batchTransforms.data(), transforms.data(), count * sizeof(ofMatrix4x4)) != 0) {
+		if ((int)batchTransforms.size() != count)
+			batchTransformsBuf.initBuffer(count * sizeof(ofMatrix4x4));
+		batchTransforms.assign(transforms.begin(), transforms.begin() + count);
+		ofxDepth.write(batchTransformsBuf, batchTransforms.data(), 0, count * sizeof(ofMatrix4x4), true);
+	}
+
+	OpenCLKernelPtr kernel = getKernel("pointsFromTablesTransform");
 	kernel->setArg(0, getCLBuffer());
-	kernel->setArg(1, outputPoints.getCLBuffer());
-	kernel->setArg(2, matrix);
-	kernel->run1D(getNumElements());
+	kernel->setArg(1, batchTransformsBuf);
+	kernel->setArg(2, batchLayoutBuf);
+	for (int s=0; s<maxBatchSize; s++) {
+		// Unused slots repeat the first sensor, the kernel never reads them
+		int k = s < count ? s : 0;
+		kernel->setArg(3 + s * 2, images[k]->getCLBuffer());
+		kernel->setArg(4 + s * 2, tables[k]->getCLBuffer());
+	}
+	ofxDepth.run3D(kernel, maxWidth, maxHeight, count);
+}
+
+int ofxDepthPoints::compact(ofxDepthPoints & outputPoints) {
+
+	// Every point may be valid
+	if (!outputPoints.isAllocated() || outputPoints.getNumElements() < getNumElements())
+		outputPoints.allocate(getNumElements());
+
+	if (isHostOnly()) {
+		ofVec4f * in = getHostData();
+		ofVec4f * out = outputPoints.getHostData();
+		int n = 0;
+		for (int i=0; i<getNumElements(); i++) {
+			if (in[i].x != 0 || in[i].y != 0 || in[i].z != 0)
+				out[n++] = in[i];
+		}
+		outputPoints.setHostModified();
+		return n;
+	}
+
+	// The scatter of one group would overwrite points another group has not read yet, so go through a copy
+	if (&outputPoints == this) {
+		int bytes = getNumElements() * getBytesPerElement();
+		if (compactPointsSize != bytes) {
+			compactPoints.initBuffer(bytes);
+			compactPointsSize = bytes;
+		}
+		int count = compact(compactPoints);
+		if (count > 0)
+			ofxDepth.copy(compactPoints, getCLBuffer(), count * getBytesPerElement());
+		return count;
+	}
+
+	return compact(outputPoints.getCLBuffer());
+}
+
+int ofxDepthPoints::compact(ofxDepthData & data) {
+
+	if (isHostOnly()) {
+		read(data);
+		return data.removeZeros();
+	}
+
+	int bytes = getNumElements() * getBytesPerElement();
+	if (compactPointsSize != bytes) {
+		compactPoints.initBuffer(bytes);
+		compactPointsSize = bytes;
+	}
+
+	int count = compact(compactPoints);
+	data.allocate(count);
+	if (count > 0)
+		ofxDepth.read(compactPoints, data.getData().data(), 0, count * getBytesPerElement(), true);
+	data.setCount(count);
+	return count;
+}
+
+int ofxDepthPoints::compact(OpenCLBuffer & output) {
+	int count = getNumElements();
+	if (count == 0)
+		return 0;
+	OpenCLKernelPtr countKernel = getKernel("compactCount");
+	OpenCLKernelPtr scatterKernel = getKernel("compactScatter");
+	OpenCLKernelPtr groupsKernel = getKernel("compactGroups");
+
+	size_t size = std::min(ofxDepth.getWorkGroupSize(countKernel), ofxDepth.getWorkGroupSize(scatterKernel));
+	int numGroups = (count + size - 1) / size;
+	if (compactGroupsSize == 0)
+		compactTotal.initBuffer(sizeof(cl_uint));
+	if (compactGroupsSize < numGroups) {
+		compactGroups.initBuffer(numGroups * sizeof(cl_uint));
+		compactGroupsSize = numGroups;
+	}
+
+	// Count per work-group, scan the counts, then each group scatters to its offset
+	countKernel->setArg(0, getCLBuffer());
+	countKernel->setArg(1, compactGroups);
+	countKernel->setArg(2, count);
+	countKernel->setArg(3, NULL, size * sizeof(cl_uint));
+	ofxDepth.run1D(countKernel, numGroups * size, size);
+
+	size_t groupsSize = ofxDepth.getWorkGroupSize(groupsKernel);
+	groupsKernel->setArg(0, compactGroups);
+	groupsKernel->setArg(1, compactTotal);
+	groupsKernel->setArg(2, numGroups);
+	groupsKernel->setArg(3, NULL, groupsSize * sizeof(cl_uint));
+	ofxDepth.run1D(groupsKernel, groupsSize, groupsSize);
+
+	scatterKernel->setArg(0, getCLBuffer());
+	scatterKernel->setArg(1, compactGroups);
+	scatterKernel->setArg(2, output);
+	scatterKernel->setArg(3, count);
+	scatterKernel->setArg(4, NULL, size * sizeof(cl_uint));
+	ofxDepth.run1D(scatterKernel, numGroups * size, size);
+
+	cl_uint total = 0;
+	ofxDepth.read(compactTotal, &total, 0, sizeof(cl_uint), true);
+	return total;
+}
+
+int ofxDepthPoints::downsample(float voxelSize, ofxDepthPoints & outputPoints) {
+
+	// There can be as many voxels as points
+	if (!outputPoints.isAllocated() || outputPoints.getNumElements() < getNumElements())
+		outputPoints.allocate(getNumElements());
+
+	bool normals = norBuf.isAllocated();
+	if (normals && outputPoints.norBuf.getNumElements() < outputPoints.getNumElements()) {
+		outputPoints.norBuf.allocate(outputPoints.getNumElements());
+		if (!outputPoints.isHostOnly())
+			outputPoints.vbo.setNormalBuffer(outputPoints.norBuf.getGLBuffer(), outputPoints.norBuf.getBytesPerElement());
+	}
+
+	if (isHostOnly()) {
+		vector<ofVec4f> voxels;
+		vector<ofVec4f> voxelNormals;
+		int count = downsample(voxelSize, getHostData(), normals ? norBuf.getHostData() : nullptr, getNumElements(), voxels, normals ? &voxelNormals : nullptr);
+		std::copy(voxels.begin(), voxels.end(), outputPoints.getHostData());
+		outputPoints.setHostModified();
+		if (normals) {
+			std::copy(voxelNormals.begin(), voxelNormals.end(), outputPoints.norBuf.getHostData());
+			outputPoints.norBuf.setHostModified();
+		}
+		return count;
+	}
+
+	return downsample(voxelSize, outputPoints.getCLBuffer(), normals ? &outputPoints.norBuf.getCLBuffer() : nullptr);
+}
+
+int ofxDepthPoints::downsample(float voxelSize, ofxDepthData & data) {
+
+	if (isHostOnly()) {
+		int count = downsample(voxelSize, getHostData(), nullptr, getNumElements(), data.getData(), nullptr);
+		data.setCount(count);
+		return count;
+	}
+
+	int bytes = getNumElements() * getBytesPerElement();
+	if (compactPointsSize != bytes) {
+		compactPoints.initBuffer(bytes);
+		compactPointsSize = bytes;
+	}
+
+	int count = downsample(voxelSize, compactPoints, nullptr);
+	data.allocate(count);
+	if (count > 0)
+		ofxDepth.read(compactPoints, data.getData().data(), 0, count * getBytesPerElement(), true);
+	data.setCount(count);
+	return count;
+}
+
+int ofxDepthPoints::downsample(float voxelSize, OpenCLBuffer & output, OpenCLBuffer * outputNormals) {
+	int count = getNumElements();
+	if (count == 0)
+		return 0;
+
+	// Open addressing table at most half full, so probes stay short
+	int size = 1;
+	while (size < count * 2)
+		size *= 2;
+	if (voxelTableSize != size) {
+		voxelKeys.initBuffer(size * sizeof(cl_uint));
+		voxelCells.initBuffer(size * 3 * sizeof(cl_int));
+		voxelCounts.initBuffer(size * sizeof(cl_uint));
+		voxelSums.initBuffer(size * 3 * sizeof(cl_uint));
+		voxelNormals.initBuffer(size * 3 * sizeof(cl_int));
+		voxelTotal.initBuffer(sizeof(cl_uint));
+		voxelTableSize = size;
+	}
+
+	OpenCLKernelPtr kernel = getKernel("voxelClear");
+	kernel->setArg(0, voxelKeys);
+	kernel->setArg(1, voxelCounts);
+	kernel->setArg(2, voxelSums);
+	kernel->setArg(3, voxelNormals);
+	ofxDepth.run1D(kernel, size);
+
+	int useNormals = outputNormals != nullptr;
+	kernel = getKernel("voxelInsert");
+	kernel->setArg(0, getCLBuffer());
+	kernel->setArg(1, useNormals ? norBuf.getCLBuffer() : getCLBuffer());
+	kernel->setArg(2, useNormals);
+	kernel->setArg(3, voxelKeys);
+	kernel->setArg(4, voxelCells);
+	kernel->setArg(5, voxelCounts);
+	kernel->setArg(6, voxelSums);
+	kernel->setArg(7, voxelNormals);
+	kernel->setArg(8, voxelSize);
+	kernel->setArg(9, (cl_uint)(size - 1));
+	ofxDepth.run1D(kernel, count);
+
+	static const cl_uint zero = 0;
+	ofxDepth.write(voxelTotal, &zero, 0, sizeof(cl_uint));
+
+	kernel = getKernel("voxelEmit");
+	kernel->setArg(0, voxelKeys);
+	kernel->setArg(1, voxelCells);
+	kernel->setArg(2, voxelCounts);
+	kernel->setArg(3, voxelSums);
+	kernel->setArg(4, voxelNormals);
+	kernel->setArg(5, output);
+	kernel->setArg(6, useNormals ? *outputNormals : output);
+	kernel->setArg(7, useNormals);
+	kernel->setArg(8, voxelSize);
+	kernel->setArg(9, voxelTotal);
+	ofxDepth.run1D(kernel, size);
+
+	cl_uint total = 0;
+	ofxDepth.read(voxelTotal, &total, 0, sizeof(cl_uint), true);
+	return total;
+}
+
+// Voxel coordinates keep 21 bits each, so voxels more than 2^20 voxel sizes from the origin alias
+// with others. The device table keeps full coordinates
+int ofxDepthPoints::downsample(float voxelSize, const ofVec4f * points, const ofVec4f * normals, int count, vector<ofVec4f> & output, vector<ofVec4f> * outputNormals) {
+	struct Voxel {
+		ofVec3f position;
+		ofVec3f normal;
+		int count = 0;
+	};
+	std::unordered_map<uint64_t, Voxel> voxels;
+	for (int i=0; i<count; i++) {
+		const ofVec4f & p = points[i];
+		if (p.x == 0 && p.y == 0 && p.z == 0)
+			continue;
+		uint64_t x = (int64_t)floorf(p.x / voxelSize) & 0x1fffff;
+		uint64_t y = (int64_t)floorf(p.y / voxelSize) & 0x1fffff;
+		uint64_t z = (int64_t)floorf(p.z / voxelSize) & 0x1fffff;
+		Voxel & voxel = voxels[x | (y << 21) | (z << 42)];
+		voxel.position += ofVec3f(p.x, p.y, p.z);
+		if (normals)
+			voxel.normal += ofVec3f(normals[i].x, normals[i].y, normals[i].z);
+		voxel.count++;
+	}
+	output.clear();
+	if (outputNormals)
+		outputNormals->clear();
+	for (auto & voxel : voxels) {
+		ofVec3f p = voxel.second.position / voxel.second.count;
+		output.push_back(ofVec4f(p.x, p.y, p.z, 1.f));
+		if (outputNormals) {
+			ofVec3f n = voxel.second.normal;
+			if (n.length() > 0)
+				n = n.getNormalized();
+			outputNormals->push_back(ofVec4f(n.x, n.y, n.z, 0.f));
+		}
+	}
+	return output.size();
 }
 
 void ofxDepthPoints::smoothNormals(int width, int height) {
@@ -308,7 +949,7 @@ void ofxDepthPoints::smoothNormals(int width, int height) {
 	OpenCLKernelPtr kernel = getKernel("smoothNormals");
 	kernel->setArg(0, norBufTemp.getCLBuffer());
 	kernel->setArg(1, norBuf.getCLBuffer());
-	kernel->run2D(width, height);
+	ofxDepth.run2D(kernel, width, height);
 }
 
 void ofxDepthPoints::transform(const ofMatrix4x4 &mat) {
@@ -361,11 +1002,19 @@ OpenCLProgramPtr ofxDepthPoints::getProgram() {
 	else {
 		program = ofxDepth.loadProgram(depthPointsProgram);
 		ofxDepth.loadKernel("pointsToIndices", program);
+		ofxDepth.loadKernel("pointsToIndicesAdaptive", program);
 		ofxDepth.loadKernel("smoothNormals", program);
 		ofxDepth.loadKernel("calcNormals", program);
 		ofxDepth.loadKernel("transform", program);
+		ofxDepth.loadKernel("pointsFromTablesTransform", program);
 		ofxDepth.loadKernel("mapTexCoords", program);
 		ofxDepth.loadKernel("orthTexCoords", program);
+		ofxDepth.loadKernel("compactCount", program);
+		ofxDepth.loadKernel("compactGroups", program);
+		ofxDepth.loadKernel("compactScatter", program);
+		ofxDepth.loadKernel("voxelClear", program);
+		ofxDepth.loadKernel("voxelInsert", program);
+		ofxDepth.loadKernel("voxelEmit", program);
 		return program;
 	}
 }
@@ -7,6 +7,8 @@ using namespace msa;
 
 class ofxDepthData;
 class ofxDepthTable;
+class ofxDepthCamera;
+class ofxDepthImage;
 
 //////////////////////////////////////////////////
 // DEPTH POINTS
@@ -28,7 +30,10 @@ public:
 
 	void allocate(int numVertices);
 
+	// Binary PCD or PLY, see ofxDepthPointFile
 	void load(string filepath);
+	// Queues the points that are not zero for writing on a background thread
+	void save(string filepath);
 
 	void read(ofxDepthData & data);
 	void read(vector<ofVec4f> & points);
@@ -36,19 +41,55 @@ public:
 	void write(vector<ofVec4f> & points, int count);
 
 	void updateMesh(int width, int height, float noiseThreshold = 10.f, bool mode = false);
+	// Mesh on a grid of every step'th point, the index buffer is sized for that level
+	void updateMeshLOD(int width, int height, int step, float noiseThreshold = 10.f, bool mode = false);
+	// Merges flat regions into quads of up to maxStep points, flatness is relative to depth like noiseThreshold
+	void updateMeshAdaptive(int width, int height, int maxStep = 16, float noiseThreshold = 10.f, float flatness = 1.f);
 	void updateTexCoords(ofxDepthTable & table, float u = 1.f, float v = 1.f);
 	void updateTexCoords(float x, float y, float scaleX = 1.f, float scaleY = 1.f);
 
 	void draw();
+	void draw(int first, int count);
 	void drawMesh();
+	// Indices of the triangles kept by the last updateMesh()
+	int getIndexCount();
+
+	// Size of a pixel at depth 1 for the mesh face thresholds. Defaults to a 60 degree sensor
+	void setFovFactor(float fovFactor);
+	void setCamera(const ofxDepthCamera & camera);
 
 	void smoothNormals(int width, int height);
 	void transform(const ofMatrix4x4 & mat);
 	void transform(const ofMatrix4x4 & mat, ofxDepthPoints & outputPoints);
 
+	// Unprojects up to 8 sensors into one world space buffer in a single launch.
+	// Sensor s starts after the points of sensors 0 to s-1
+	void fromImages(vector<ofxDepthImage*> & images, vector<ofxDepthTable*> & tables, vector<ofMatrix4x4> & transforms);
+	static const int maxBatchSize = 8;
+
+	// Packs the points that are not zero at the start of outputPoints, in order, and returns how many there are. Works in place
+	int compact(ofxDepthPoints & outputPoints);
+	// Reads back only the points that are not zero
+	int compact(ofxDepthData & data);
+
+	// Averages the points, and normals if there are any, of each voxelSize cube into one point.
+	// Points are hashed into voxels on the device. On the host, voxels more than 2^20 voxel sizes
+	// from the origin alias with others
+	int downsample(float voxelSize, ofxDepthPoints & outputPoints);
+	int downsample(float voxelSize, ofxDepthData & data);
+
 	static ofMesh makeFrustum(float fovH, float fovV, float clipNear, float clipFar);
 
 protected:
+	friend class ofxDepthPointFile;
+
+	int compact(OpenCLBuffer & output);
+	int downsample(float voxelSize, OpenCLBuffer & output, OpenCLBuffer * outputNormals);
+	// Host version for host-only points, normals and outputNormals may be null
+	static int downsample(float voxelSize, const ofVec4f * points, const ofVec4f * normals, int count, vector<ofVec4f> & output, vector<ofVec4f> * outputNormals);
+	void allocateMesh(int numIndices);
+	float getFovFactor(int height) const;
+
 	static OpenCLKernelPtr getKernel(string name);
 	static OpenCLProgramPtr getProgram();
 	static OpenCLProgramPtr program;
@@ -60,7 +101,30 @@ protected:
 	ofxDepthBufferT<float, ofVec2f> texBuf;
 	ofVbo vbo;
 
-	OpenCLBufferManagedT<ofVec4f> matrix;
+	OpenCLBuffer batchLayoutBuf;
+	OpenCLBuffer batchTransformsBuf;
+	vector<int> batchLayout;
+	vector<ofMatrix4x4> batchTransforms;
+	float fovFactor = 0.f;
+
+	OpenCLBuffer indexCountBuf;
+	bool indexCountBufAllocated = false;
+	cl_uint indexCount = 0;
+	ofxDepthEvent indexCountEvent;
+
+	OpenCLBuffer compactGroups;
+	OpenCLBuffer compactTotal;
+	OpenCLBuffer compactPoints;
+	int compactGroupsSize = 0;
+	int compactPointsSize = 0;
+
+	OpenCLBuffer voxelKeys;
+	OpenCLBuffer voxelCells;
+	OpenCLBuffer voxelCounts;
+	OpenCLBuffer voxelSums;
+	OpenCLBuffer voxelNormals;
+	OpenCLBuffer voxelTotal;
+	int voxelTableSize = 0;
 };
 
 //////////////////////////////////////////////////
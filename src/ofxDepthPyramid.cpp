@@ -0,0 +1,278 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthPyramid.h"
+#include "ofxDepthCpu.h"
+
+#define STRINGIFY(A) #A
+
+string depthPyramidProgram = STRINGIFY(
+
+// Reduces the valid pixels of each 2x2 block by min (0), lower median (1) or mean (2)
+__kernel void pyramidDown(__global unsigned short* input, __global unsigned short* output, int inputWidth, int inputHeight, int mode) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int width = get_global_size(0);
+
+	unsigned short values[4];
+	int n = 0;
+	for (int dy=0; dy<2; dy++) {
+		int iy = min(y * 2 + dy, inputHeight - 1);
+		for (int dx=0; dx<2; dx++) {
+			unsigned short v = input[iy * inputWidth + min(x * 2 + dx, inputWidth - 1)];
+			if (v == 0)
+				continue;
+			int j = n++;
+			while (j > 0 && values[j-1] > v) {
+				values[j] = values[j-1];
+				j--;
+			}
+			values[j] = v;
+		}
+	}
+
+	unsigned short d = 0;
+	if (n > 0) {
+		if (mode == 0)
+			d = values[0];
+		else if (mode == 1)
+			d = values[(n - 1) / 2];
+		else {
+			uint sum = 0;
+			for (int j=0; j<n; j++)
+				sum += values[j];
+			d = (sum + n / 2) / n;
+		}
+	}
+	output[y * width + x] = d;
+}
+
+// Keeps valid pixels and fills the rest with the bilinear mean of the valid coarse pixels around it
+__kernel void pyramidUp(__global unsigned short* input, __global unsigned short* coarse, __global unsigned short* output, int coarseWidth, int coarseHeight) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int i = y * get_global_size(0) + x;
+	unsigned short c = input[i];
+	if (c != 0) {
+		output[i] = c;
+		return;
+	}
+
+	float2 p = (float2)(x + 0.5f, y + 0.5f) * 0.5f - 0.5f;
+	float2 f = p - floor(p);
+	int x0 = (int)floor(p.x);
+	int y0 = (int)floor(p.y);
+	float sum = 0;
+	float weights = 0;
+	for (int dy=0; dy<2; dy++) {
+		int cy = clamp(y0 + dy, 0, coarseHeight - 1);
+		float wy = dy ? f.y : 1.f - f.y;
+		for (int dx=0; dx<2; dx++) {
+			int cx = clamp(x0 + dx, 0, coarseWidth - 1);
+			float w = wy * (dx ? f.x : 1.f - f.x);
+			unsigned short d = coarse[cy * coarseWidth + cx];
+			if (d != 0 && w > 0.f) {
+				sum += d * w;
+				weights += w;
+			}
+		}
+	}
+	output[i] = weights > 0.f ? (unsigned short)(sum / weights + 0.5f) : 0;
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthPyramid::program;
+
+void ofxDepthPyramid::update(ofxDepthImage & image, int numLevels, ofxDepthPyramidMode mode) {
+
+	int width = image.getWidth();
+	int height = image.getHeight();
+	int maxLevels = 1;
+	while ((width >> (maxLevels - 1)) > 1 || (height >> (maxLevels - 1)) > 1)
+		maxLevels++;
+	if (numLevels <= 0 || numLevels > maxLevels)
+		numLevels = maxLevels;
+
+	source = &image;
+	this->numLevels = numLevels;
+	if (levels.size() < numLevels - 1)
+		levels.resize(numLevels - 1);
+
+	ofxDepthImage * input = &image;
+	for (int l=1; l<numLevels; l++) {
+		int w = (input->getWidth() + 1) / 2;
+		int h = (input->getHeight() + 1) / 2;
+		shared_ptr<ofxDepthImage> & level = levels[l-1];
+		if (!level)
+			level = make_shared<ofxDepthImage>();
+		if (!level->isAllocated() || level->getWidth() != w || level->getHeight() != h)
+			level->allocate(w, h);
+		down(*input, *level, mode);
+		input = level.get();
+	}
+}
+
+int ofxDepthPyramid::getNumLevels() const {
+	return numLevels;
+}
+
+ofxDepthImage & ofxDepthPyramid::getLevel(int level) {
+	return level == 0 ? *source : *levels[level-1];
+}
+
+void ofxDepthPyramid::fill(ofxDepthImage & outputImage) {
+
+	if (!source)
+		return;
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(source->getWidth(), source->getHeight());
+
+	if (numLevels == 1) {
+		if (&outputImage != source)
+			source->copy(outputImage);
+		return;
+	}
+
+	// Each pixel reads only its own fine value, so the levels can be filled in place
+	for (int l=numLevels-2; l>0; l--)
+		up(getLevel(l), getLevel(l+1), getLevel(l));
+	up(*source, getLevel(1), outputImage);
+}
+
+void ofxDepthPyramid::fill(ofxDepthImage & image, int numLevels, ofxDepthImage & outputImage) {
+	update(image, numLevels, OFX_DEPTH_PYRAMID_MEAN);
+	fill(outputImage);
+}
+
+void ofxDepthPyramid::down(ofxDepthImage & input, ofxDepthImage & output, ofxDepthPyramidMode mode) {
+
+	// Without OpenCL the kernel runs on the host copies
+	if (input.isHostOnly()) {
+		const unsigned short * in = input.getHostData();
+		unsigned short * out = output.getHostData();
+		int inputWidth = input.getWidth();
+		int inputHeight = input.getHeight();
+		int width = output.getWidth();
+		ofxDepthCpu::parallelRows(output.getHeight(), [=](int y0, int y1) {
+			for (int y=y0; y<y1; y++) {
+				for (int x=0; x<width; x++) {
+					unsigned short values[4];
+					int n = 0;
+					for (int dy=0; dy<2; dy++) {
+						int iy = std::min(y * 2 + dy, inputHeight - 1);
+						for (int dx=0; dx<2; dx++) {
+							unsigned short v = in[iy * inputWidth + std::min(x * 2 + dx, inputWidth - 1)];
+							if (v == 0)
+								continue;
+							int j = n++;
+							while (j > 0 && values[j-1] > v) {
+								values[j] = values[j-1];
+								j--;
+							}
+							values[j] = v;
+						}
+					}
+
+					unsigned short d = 0;
+					if (n > 0) {
+						if (mode == OFX_DEPTH_PYRAMID_MIN)
+							d = values[0];
+						else if (mode == OFX_DEPTH_PYRAMID_MEDIAN)
+							d = values[(n - 1) / 2];
+						else {
+							unsigned int sum = 0;
+							for (int j=0; j<n; j++)
+								sum += values[j];
+							d = (sum + n / 2) / n;
+						}
+					}
+					out[y * width + x] = d;
+				}
+			}
+		});
+		output.setHostModified();
+		return;
+	}
+
+	OpenCLKernelPtr kernel = getKernel("pyramidDown");
+	kernel->setArg(0, input.getCLBuffer());
+	kernel->setArg(1, output.getCLBuffer());
+	kernel->setArg(2, input.getWidth());
+	kernel->setArg(3, input.getHeight());
+	kernel->setArg(4, (int)mode);
+	ofxDepth.run2D(kernel, output.getWidth(), output.getHeight());
+}
+
+void ofxDepthPyramid::up(ofxDepthImage & input, ofxDepthImage & coarse, ofxDepthImage & output) {
+
+	if (input.isHostOnly()) {
+		const unsigned short * in = input.getHostData();
+		const unsigned short * coarseData = coarse.getHostData();
+		unsigned short * out = output.getHostData();
+		int width = input.getWidth();
+		int coarseWidth = coarse.getWidth();
+		int coarseHeight = coarse.getHeight();
+		ofxDepthCpu::parallelRows(input.getHeight(), [=](int y0, int y1) {
+			for (int y=y0; y<y1; y++) {
+				for (int x=0; x<width; x++) {
+					int i = y * width + x;
+					unsigned short c = in[i];
+					if (c != 0) {
+						out[i] = c;
+						continue;
+					}
+
+					float px = (x + 0.5f) * 0.5f - 0.5f;
+					float py = (y + 0.5f) * 0.5f - 0.5f;
+					float fx = px - floorf(px);
+					float fy = py - floorf(py);
+					int cx0 = (int)floorf(px);
+					int cy0 = (int)floorf(py);
+					float sum = 0;
+					float weights = 0;
+					for (int dy=0; dy<2; dy++) {
+						int cy = ofClamp(cy0 + dy, 0, coarseHeight - 1);
+						float wy = dy ? fy : 1.f - fy;
+						for (int dx=0; dx<2; dx++) {
+							int cx = ofClamp(cx0 + dx, 0, coarseWidth - 1);
+							float w = wy * (dx ? fx : 1.f - fx);
+							unsigned short d = coarseData[cy * coarseWidth + cx];
+							if (d != 0 && w > 0.f) {
+								sum += d * w;
+								weights += w;
+							}
+						}
+					}
+					out[i] = weights > 0.f ? (unsigned short)(sum / weights + 0.5f) : 0;
+				}
+			}
+		});
+		output.setHostModified();
+		return;
+	}
+
+	OpenCLKernelPtr kernel = getKernel("pyramidUp");
+	kernel->setArg(0, input.getCLBuffer());
+	kernel->setArg(1, coarse.getCLBuffer());
+	kernel->setArg(2, output.getCLBuffer());
+	kernel->setArg(3, coarse.getWidth());
+	kernel->setArg(4, coarse.getHeight());
+	ofxDepth.run2D(kernel, input.getWidth(), input.getHeight());
+}
+
+OpenCLKernelPtr ofxDepthPyramid::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthPyramid::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthPyramidProgram);
+		ofxDepth.loadKernel("pyramidDown", program);
+		ofxDepth.loadKernel("pyramidUp", program);
+		return program;
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+enum ofxDepthPyramidMode {
+	OFX_DEPTH_PYRAMID_MIN,
+	OFX_DEPTH_PYRAMID_MEDIAN,
+	OFX_DEPTH_PYRAMID_MEAN
+};
+
+//////////////////////////////////////////////////
+// DEPTH PYRAMID
+//
+// Levels of half the size of the one before, each pixel reduced from
+// the valid pixels of its 2x2 block. Push-pull fills holes of any size
+// by pulling valid depth up to the level where the hole closes and
+// pushing it back down, one pass per level.
+
+class ofxDepthPyramid {
+public:
+	// Level 0 is the image itself and must stay alive while the levels are used. 0 levels goes down to 1 pixel
+	void update(ofxDepthImage & image, int numLevels = 0, ofxDepthPyramidMode mode = OFX_DEPTH_PYRAMID_MEAN);
+
+	int getNumLevels() const;
+	ofxDepthImage & getLevel(int level);
+
+	// Fills the empty pixels of level 0 from the levels above, the levels are filled in place on the way down
+	void fill(ofxDepthImage & outputImage);
+	// Builds the pyramid of the image and fills its holes
+	void fill(ofxDepthImage & image, int numLevels, ofxDepthImage & outputImage);
+
+protected:
+	void down(ofxDepthImage & input, ofxDepthImage & output, ofxDepthPyramidMode mode);
+	void up(ofxDepthImage & input, ofxDepthImage & coarse, ofxDepthImage & output);
+
+	ofxDepthImage * source = nullptr;
+	vector<shared_ptr<ofxDepthImage> > levels;
+	int numLevels = 0;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};
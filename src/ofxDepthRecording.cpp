@@ -0,0 +1,259 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthRecording.h"
+#include "ofxDepthCodec.h"
+
+static const char recordingMagic[4] = {'O', 'D', 'R', 'S'};
+
+//////////////////////////////////////////////////
+
+ofxDepthRecorder::~ofxDepthRecorder() {
+	close();
+}
+
+bool ofxDepthRecorder::open(string filepath, int width, int height, ofxDepthRecordingCodec codec, int tolerance) {
+	close();
+	file = fopen(ofToDataPath(filepath).c_str(), "wb");
+	if (!file) {
+		ofLogError("ofxDepthRecorder") << "open(): can't write " << filepath;
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, recordingMagic, 4);
+	header.version = 1;
+	header.width = width;
+	header.height = height;
+	header.codec = codec;
+	this->tolerance = tolerance;
+	fwrite(&header, sizeof(header), 1, file);
+	offset = sizeof(header);
+	index.clear();
+	return true;
+}
+
+void ofxDepthRecorder::close() {
+	if (!file)
+		return;
+	header.numFrames = index.size();
+	header.indexOffset = offset;
+	if (!index.empty())
+		fwrite(index.data(), sizeof(ofxDepthRecordingFrame), index.size(), file);
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+	file = nullptr;
+}
+
+bool ofxDepthRecorder::isOpen() const {
+	return file != nullptr;
+}
+
+void ofxDepthRecorder::add(ofxDepthImage & image) {
+	add(image, ofGetElapsedTimeMicros());
+}
+
+void ofxDepthRecorder::add(ofxDepthImage & image, uint64_t timestamp) {
+	if (image.getWidth() != header.width || image.getHeight() != header.height) {
+		ofLogError("ofxDepthRecorder") << "add(): image is " << image.getWidth() << "x" << image.getHeight() << ", recording " << header.width << "x" << header.height;
+		return;
+	}
+	add(image.getHostData(), timestamp);
+}
+
+void ofxDepthRecorder::add(const unsigned short * data, uint64_t timestamp) {
+	if (header.codec == OFX_DEPTH_CODEC_RVL) {
+		encoded.clear();
+		size_t size = ofxDepthCodec::encode(data, header.width, header.height, encoded, tolerance);
+		addFrame(encoded.data(), size, timestamp);
+	}
+	else
+		addFrame(data, header.width * header.height * sizeof(unsigned short), timestamp);
+}
+
+void ofxDepthRecorder::addFrame(const void * data, uint64_t size, uint64_t timestamp) {
+	if (!file)
+		return;
+	fwrite(data, 1, size, file);
+	ofxDepthRecordingFrame frame;
+	frame.offset = offset;
+	frame.size = size;
+	frame.timestamp = timestamp;
+	index.push_back(frame);
+	offset += size;
+}
+
+int ofxDepthRecorder::getNumFrames() const {
+	return index.size();
+}
+
+//////////////////////////////////////////////////
+
+ofxDepthPlayer::~ofxDepthPlayer() {
+	close();
+}
+
+bool ofxDepthPlayer::open(string filepath) {
+	close();
+	if (!file.open(filepath) || file.getSize() < sizeof(ofxDepthRecordingHeader)) {
+		ofLogError("ofxDepthPlayer") << "open(): can't map " << filepath;
+		close();
+		return false;
+	}
+	data = file.getData();
+	size = file.getSize();
+
+	header = (const ofxDepthRecordingHeader*)data;
+	if (memcmp(header->magic, recordingMagic, 4) != 0 || header->indexOffset < sizeof(ofxDepthRecordingHeader) || header->indexOffset > size
+		|| header->numFrames > (size - header->indexOffset) / sizeof(ofxDepthRecordingFrame)) {
+		ofLogError("ofxDepthPlayer") << "open(): " << filepath << " is not a finished depth recording";
+		close();
+		return false;
+	}
+	if (header->codec != OFX_DEPTH_CODEC_RAW && header->codec != OFX_DEPTH_CODEC_RVL) {
+		ofLogError("ofxDepthPlayer") << "open(): unknown codec " << header->codec;
+		close();
+		return false;
+	}
+	if (header->width == 0 || header->height == 0 || (uint64_t)header->width * header->height > INT_MAX / sizeof(unsigned short)) {
+		ofLogError("ofxDepthPlayer") << "open(): " << filepath << " has a frame size of " << header->width << "x" << header->height;
+		close();
+		return false;
+	}
+	index = (const ofxDepthRecordingFrame*)(data + header->indexOffset);
+
+	// Every frame has to lie inside the file, so reads and prefetching never touch pages past the mapping
+	uint64_t frameBytes = (uint64_t)header->width * header->height * sizeof(unsigned short);
+	for (uint64_t i=0; i<header->numFrames; i++) {
+		const ofxDepthRecordingFrame & frame = index[i];
+		if (frame.offset < sizeof(ofxDepthRecordingHeader) || frame.offset > header->indexOffset || frame.size > header->indexOffset - frame.offset
+			|| (header->codec == OFX_DEPTH_CODEC_RAW && frame.size < frameBytes)) {
+			ofLogError("ofxDepthPlayer") << "open(): " << filepath << " frame " << i << " is out of range, the recording is damaged";
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+void ofxDepthPlayer::close() {
+	setPrefetch(0);
+
+	// Uploads may still be reading from the mapping
+	if (data && ofxDepth.getBackend() == OFX_DEPTH_BACKEND_OPENCL)
+		ofxDepth.finish();
+
+	file.close();
+	data = nullptr;
+	size = 0;
+	header = nullptr;
+	index = nullptr;
+}
+
+bool ofxDepthPlayer::isOpen() const {
+	return data != nullptr;
+}
+
+int ofxDepthPlayer::getWidth() const {
+	return header ? header->width : 0;
+}
+
+int ofxDepthPlayer::getHeight() const {
+	return header ? header->height : 0;
+}
+
+int ofxDepthPlayer::getNumFrames() const {
+	return header ? header->numFrames : 0;
+}
+
+uint64_t ofxDepthPlayer::getTimestamp(int frame) const {
+	return index[frame].timestamp;
+}
+
+int ofxDepthPlayer::getFrame(uint64_t timestamp) const {
+	const ofxDepthRecordingFrame * end = index + getNumFrames();
+	const ofxDepthRecordingFrame * it = std::upper_bound(index, end, timestamp, [](uint64_t t, const ofxDepthRecordingFrame & frame) {
+		return t < frame.timestamp;
+	});
+	return std::max<int>(it - index - 1, 0);
+}
+
+ofxDepthRecordingCodec ofxDepthPlayer::getCodec() const {
+	return header ? (ofxDepthRecordingCodec)header->codec : OFX_DEPTH_CODEC_RAW;
+}
+
+const unsigned short * ofxDepthPlayer::getData(int frame) const {
+	if (getCodec() != OFX_DEPTH_CODEC_RAW)
+		return nullptr;
+	return (const unsigned short*)(data + index[frame].offset);
+}
+
+bool ofxDepthPlayer::read(int frame, ofxDepthImage & image) {
+	if (!isOpen() || frame < 0 || frame >= getNumFrames())
+		return false;
+
+	if (!image.isAllocated() || image.getWidth() != getWidth() || image.getHeight() != getHeight())
+		image.allocate(getWidth(), getHeight());
+	bool ok = true;
+	if (getCodec() == OFX_DEPTH_CODEC_RVL) {
+		// decode() would reallocate the image to whatever the frame claims
+		int width, height;
+		if (!ofxDepthCodec::getSize(data + index[frame].offset, index[frame].size, width, height) || width != getWidth() || height != getHeight()) {
+			ofLogError("ofxDepthPlayer") << "read(): frame " << frame << " is not a " << getWidth() << "x" << getHeight() << " frame";
+			return false;
+		}
+		ok = ofxDepthCodec::decode(data + index[frame].offset, index[frame].size, image);
+		if (!ok)
+			ofLogError("ofxDepthPlayer") << "read(): frame " << frame << " can't be decoded";
+	}
+	else
+		image.write((unsigned short*)getData(frame), getWidth() * getHeight());
+
+	if (prefetchRunning) {
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		prefetchFrom = frame + 1;
+		prefetchCondition.notify_one();
+	}
+	return ok;
+}
+
+void ofxDepthPlayer::setPrefetch(int numFrames) {
+	if (prefetchRunning) {
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			prefetchRunning = false;
+			prefetchCondition.notify_one();
+		}
+		prefetchThread.join();
+	}
+	prefetchFrames = numFrames;
+	prefetchFrom = -1;
+	if (numFrames > 0) {
+		prefetchRunning = true;
+		prefetchThread = std::thread(&ofxDepthPlayer::prefetch, this);
+	}
+}
+
+void ofxDepthPlayer::prefetch() {
+	int done = -1;
+	while (true) {
+		int from;
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			prefetchCondition.wait(lock, [&] {
+				return !prefetchRunning || prefetchFrom != done;
+			});
+			if (!prefetchRunning)
+				return;
+			from = done = prefetchFrom;
+		}
+
+		// Touching a byte per page faults the frames in ahead of the upload
+		int to = std::min(from + prefetchFrames, getNumFrames());
+		volatile unsigned char sum = 0;
+		for (int f=from; f<to && prefetchRunning; f++) {
+			const unsigned char * p = data + index[f].offset;
+			for (uint64_t i=0; i<index[f].size; i+=4096)
+				sum += p[i];
+		}
+	}
+}
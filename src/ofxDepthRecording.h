@@ -0,0 +1,116 @@
+#pragma once
+
+#include "ofxDepthImage.h"
+#include "ofxDepthMappedFile.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+//////////////////////////////////////////////////
+// DEPTH RECORDING
+//
+// Container for depth image sequences: a header, the frames one after
+// the other and an index of (offset, size, timestamp) per frame at the
+// end. The player maps the whole file, so seeking is an index lookup
+// and frames are uploaded straight from the mapping.
+
+struct ofxDepthRecordingHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t codec;
+	uint32_t reserved;
+	uint64_t numFrames;
+	uint64_t indexOffset;
+};
+
+struct ofxDepthRecordingFrame {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t timestamp;
+};
+
+enum ofxDepthRecordingCodec {
+	OFX_DEPTH_CODEC_RAW = 0,
+	// ofxDepthCodec, lossy when recorded with a tolerance
+	OFX_DEPTH_CODEC_RVL = 1
+};
+
+//////////////////////////////////////////////////
+// DEPTH RECORDER
+
+class ofxDepthRecorder {
+public:
+	~ofxDepthRecorder();
+
+	bool open(string filepath, int width, int height, ofxDepthRecordingCodec codec = OFX_DEPTH_CODEC_RAW, int tolerance = 0);
+	// Writes the index, the file is not playable before
+	void close();
+	bool isOpen() const;
+
+	// Timestamp in microseconds, defaults to ofGetElapsedTimeMicros()
+	void add(ofxDepthImage & image);
+	void add(ofxDepthImage & image, uint64_t timestamp);
+	void add(const unsigned short * data, uint64_t timestamp);
+
+	int getNumFrames() const;
+
+protected:
+	void addFrame(const void * data, uint64_t size, uint64_t timestamp);
+
+	FILE * file = nullptr;
+	ofxDepthRecordingHeader header;
+	vector<ofxDepthRecordingFrame> index;
+	uint64_t offset = 0;
+	int tolerance = 0;
+	vector<unsigned char> encoded;
+};
+
+//////////////////////////////////////////////////
+// DEPTH PLAYER
+
+class ofxDepthPlayer {
+public:
+	~ofxDepthPlayer();
+
+	bool open(string filepath);
+	void close();
+	bool isOpen() const;
+
+	int getWidth() const;
+	int getHeight() const;
+	int getNumFrames() const;
+	uint64_t getTimestamp(int frame) const;
+	// Last frame at or before the timestamp
+	int getFrame(uint64_t timestamp) const;
+
+	ofxDepthRecordingCodec getCodec() const;
+	// Pixels of a frame inside the mapping, nullptr unless the recording is raw
+	const unsigned short * getData(int frame) const;
+
+	// Uploads a frame and prefetches the ones after it, false if the frame could not be decoded
+	bool read(int frame, ofxDepthImage & image);
+
+	// Number of frames after the last read one that a background thread pages in, 0 stops it
+	void setPrefetch(int numFrames);
+
+protected:
+	void prefetch();
+
+	ofxDepthMappedFile file;
+	const unsigned char * data = nullptr;
+	size_t size = 0;
+
+	const ofxDepthRecordingHeader * header = nullptr;
+	const ofxDepthRecordingFrame * index = nullptr;
+
+	std::thread prefetchThread;
+	std::mutex prefetchMutex;
+	std::condition_variable prefetchCondition;
+	std::atomic<bool> prefetchRunning{false};
+	int prefetchFrames = 0;
+	int prefetchFrom = -1;
+};
@@ -0,0 +1,133 @@
+#include "ofxDepthCore.h"
+#include "ofxDepthTemporal.h"
+#include "ofxDepthCpu.h"
+
+#define STRINGIFY(A) #A
+
+string depthTemporalProgram = STRINGIFY(
+
+// Frame f of the ring starts at f * size, slot is where the new frame goes
+__kernel void temporalPercentile(__global unsigned short* input, __global unsigned short* ring, __global unsigned short* output, int size, int slot, int numFilled, float percentile) {
+	int i = get_global_id(0);
+	unsigned short c = input[i];
+	ring[slot * size + i] = c;
+
+	unsigned short values[9];
+	int n = 0;
+	for (int f=0; f<numFilled; f++) {
+		unsigned short v = f == slot ? c : ring[f * size + i];
+		if (v == 0)
+			continue;
+		int j = n++;
+		while (j > 0 && values[j-1] > v) {
+			values[j] = values[j-1];
+			j--;
+		}
+		values[j] = v;
+	}
+
+	output[i] = n > 0 ? values[(int)(percentile * (n - 1) + 0.5f)] : 0;
+}
+);
+
+//////////////////////////////////////////////////
+
+OpenCLProgramPtr ofxDepthTemporal::program;
+const int ofxDepthTemporal::maxFrames;
+
+void ofxDepthTemporal::setup(int width, int height, int numFrames) {
+	if (numFrames > maxFrames) {
+		ofLogWarning("ofxDepthTemporal") << "setup(): " << numFrames << " frames, using " << maxFrames;
+		numFrames = maxFrames;
+	}
+	this->width = width;
+	this->height = height;
+	this->numFrames = std::max(numFrames, 1);
+	if (ring.getNumElements() != width * height * this->numFrames)
+		ring.allocate(width * height * this->numFrames);
+	clear();
+}
+
+void ofxDepthTemporal::clear() {
+	numFilled = 0;
+	slot = 0;
+}
+
+void ofxDepthTemporal::update(ofxDepthImage & image, float percentile) {
+	update(image, image, percentile);
+}
+
+void ofxDepthTemporal::update(ofxDepthImage & image, ofxDepthImage & outputImage, float percentile) {
+
+	if (image.getWidth() != width || image.getHeight() != height || numFrames == 0)
+		setup(image.getWidth(), image.getHeight(), numFrames == 0 ? 5 : numFrames);
+
+	if (!outputImage.isAllocated())
+		outputImage.allocate(width, height);
+
+	// Each pixel reads its input before writing its output, so filtering in place is safe
+	numFilled = std::min(numFilled + 1, numFrames);
+	percentile = ofClamp(percentile, 0.f, 1.f);
+
+	// Without OpenCL the same percentile runs on the host copies
+	if (image.isHostOnly()) {
+		const unsigned short * input = image.getHostData();
+		unsigned short * frames = ring.getHostData();
+		unsigned short * output = outputImage.getHostData();
+		int size = width * height;
+		int w = width;
+		int current = slot;
+		int filled = numFilled;
+		ofxDepthCpu::parallelRows(height, [=](int y0, int y1) {
+			for (int i=y0*w; i<y1*w; i++) {
+				unsigned short c = input[i];
+				frames[current * size + i] = c;
+				unsigned short values[maxFrames];
+				int n = 0;
+				for (int f=0; f<filled; f++) {
+					unsigned short v = frames[f * size + i];
+					if (v == 0)
+						continue;
+					int j = n++;
+					while (j > 0 && values[j-1] > v) {
+						values[j] = values[j-1];
+						j--;
+					}
+					values[j] = v;
+				}
+				output[i] = n > 0 ? values[(int)(percentile * (n - 1) + 0.5f)] : 0;
+			}
+		});
+		ring.setHostModified();
+		outputImage.setHostModified();
+		slot = (slot + 1) % numFrames;
+		return;
+	}
+
+	OpenCLKernelPtr kernel = getKernel("temporalPercentile");
+	kernel->setArg(0, image.getCLBuffer());
+	kernel->setArg(1, ring.getCLBuffer());
+	kernel->setArg(2, outputImage.getCLBuffer());
+	kernel->setArg(3, width * height);
+	kernel->setArg(4, slot);
+	kernel->setArg(5, numFilled);
+	kernel->setArg(6, percentile);
+	ofxDepth.run1D(kernel, width * height);
+
+	slot = (slot + 1) % numFrames;
+}
+
+OpenCLKernelPtr ofxDepthTemporal::getKernel(string name) {
+	getProgram();
+	return ofxDepth.getKernel(name);
+}
+
+OpenCLProgramPtr ofxDepthTemporal::getProgram() {
+	if (program)
+		return program;
+	else {
+		program = ofxDepth.loadProgram(depthTemporalProgram);
+		ofxDepth.loadKernel("temporalPercentile", program);
+		return program;
+	}
+}
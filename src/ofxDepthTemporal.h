@@ -0,0 +1,52 @@
+#pragma once
+
+#include "MSAOpenCL.h"
+#include "ofxDepthBuffer.h"
+#include "ofxDepthImage.h"
+
+using namespace msa;
+
+//////////////////////////////////////////////////
+// DEPTH TEMPORAL
+//
+// Per-pixel median or percentile of the last few frames, ignoring
+// zeros. Frames are kept in a ring on the device and each new frame is
+// written into the oldest slot by the same kernel that filters it, so
+// the ring only moves its slot index.
+
+class ofxDepthTemporal {
+public:
+	static const int maxFrames = 9;
+
+	void setup(int width, int height, int numFrames = 5);
+	// Forgets the frames seen so far
+	void clear();
+
+	int getNumFrames() const {
+		return numFrames;
+	}
+	// Frames in the ring, up to getNumFrames()
+	int getNumFilled() const {
+		return numFilled;
+	}
+
+	// Adds the image to the ring and writes the percentile (0-1) of each pixel, 0.5 is the median
+	void update(ofxDepthImage & image, float percentile = 0.5f);
+	void update(ofxDepthImage & image, ofxDepthImage & outputImage, float percentile = 0.5f);
+
+	ofxDepthBufferT<unsigned short> & getRing() {
+		return ring;
+	}
+
+protected:
+	int width = 0;
+	int height = 0;
+	int numFrames = 0;
+	int numFilled = 0;
+	int slot = 0;
+	ofxDepthBufferT<unsigned short> ring;
+
+	static OpenCLKernelPtr getKernel(string name);
+	static OpenCLProgramPtr getProgram();
+	static OpenCLProgramPtr program;
+};